@@ -0,0 +1,350 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Arrow IPC streams. The metadata of each message is a Flatbuffer, built
+ * front to back: every table is written before what it points to, so its
+ * offsets can be patched in once they're known and always point forwards,
+ * as Flatbuffers requires. Values are in host byte order, which is little
+ * endian everywhere powerup runs, as the schema declares.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rc.h"
+
+#include "arrow.h"
+
+#define ARROW_CONTINUATION 0xffffffffu
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_DURATION 18
+#define ARROW_MILLISECOND 1
+/* Of each buffer in a batch body, for readers using them in place. */
+#define ARROW_ALIGN 64
+#define PAD_ARROW(n) (((n) + ARROW_ALIGN - 1) & ~(uint64_t) (ARROW_ALIGN - 1))
+
+/* Enough for the schema, the biggest metadata written. */
+#define FB_MAX 8192
+/* Most fields of any table written. */
+#define FB_MAX_FIELDS 8
+
+/* Metadata of one message under construction. */
+struct _arrow_fb {
+  unsigned char buf[FB_MAX];
+  size_t len;
+  int overflow;
+};
+
+/* A field of a table: size bytes holding value, or absent if size is 0.
+ * Offsets are 4 bytes and patched in later at at. */
+struct _fb_field {
+  int size;
+  uint64_t value;
+  size_t at;
+};
+
+typedef struct _arrow_fb arrow_fb;
+typedef struct _fb_field fb_field;
+
+const unsigned char kArrowPadding[ARROW_ALIGN] = { 0 };
+
+int arrow_write_schema(output* out);
+size_t arrow_field(arrow_fb* b, int column);
+int arrow_flush_batch(arrow_writer* w);
+size_t arrow_message(arrow_fb* b, int header_type, uint64_t body_len);
+int arrow_write_message(output* out, arrow_fb* b);
+size_t fb_put(arrow_fb* b, const void* data, size_t n);
+void fb_pad(arrow_fb* b, size_t align);
+void fb_patch(arrow_fb* b, size_t at, size_t target);
+size_t fb_table(arrow_fb* b, fb_field* fields, int n);
+size_t fb_string(arrow_fb* b, const char* s);
+size_t fb_offsets(arrow_fb* b, uint32_t n);
+size_t fb_structs(arrow_fb* b, const void* data, uint32_t n, size_t size);
+
+int arrow_writer_init(arrow_writer* w, output* out, uint32_t batch_size) {
+  int i;
+
+  memset(w, 0, sizeof(arrow_writer));
+  w->out = out;
+  w->batch_size = batch_size;
+  colfile_clock_init(&w->clock);
+  for (i = 0; i < COL_COUNT; i++) {
+    w->columns[i] = (unsigned char*) malloc(batch_size * colfile_width(i));
+    if (!w->columns[i]) {
+      perror("Failed to allocate column buffers");
+      return OUTPUT_ERROR;
+    }
+  }
+  return arrow_write_schema(out);
+}
+
+int arrow_writer_add(arrow_writer* w, const powerlog6s* log) {
+  colfile_transpose(w->columns, w->count,
+      colfile_clock_time(&w->clock, log->interval), log);
+  w->records++;
+  if (++w->count == w->batch_size) {
+    return arrow_flush_batch(w);
+  }
+  return SUCCESS;
+}
+
+int arrow_writer_close(arrow_writer* w) {
+  uint32_t eos[2] = { ARROW_CONTINUATION, 0 };
+  int rc;
+  int i;
+
+  rc = SUCCESS;
+  if (w->count > 0) {
+    rc = arrow_flush_batch(w);
+  }
+  if (rc == SUCCESS) {
+    rc = output_write(w->out, eos, sizeof(eos));
+  }
+  for (i = 0; i < COL_COUNT; i++) {
+    free(w->columns[i]);
+    w->columns[i] = NULL;
+  }
+  return rc;
+}
+
+/* Message { version, header: Schema { fields: [Field] } }. */
+int arrow_write_schema(output* out) {
+  arrow_fb b;
+  /* Little endian by default. */
+  fb_field schema[2] = { { 0, 0, 0 }, { 4, 0, 0 } };
+  size_t header;
+  size_t fields;
+  int i;
+
+  header = arrow_message(&b, ARROW_HEADER_SCHEMA, 0);
+  fb_patch(&b, header, fb_table(&b, schema, 2));
+  fields = fb_offsets(&b, COL_COUNT);
+  fb_patch(&b, schema[1].at, fields);
+  for (i = 0; i < COL_COUNT; i++) {
+    fb_patch(&b, fields + 4 + 4 * i, arrow_field(&b, i));
+  }
+  return arrow_write_message(out, &b);
+}
+
+/* Field { name, nullable, type, children, custom_metadata }, returning
+ * where the table is. */
+size_t arrow_field(arrow_fb* b, int column) {
+  fb_field field[7] = { { 4, 0, 0 }, { 1, 0, 0 }, { 1, ARROW_TYPE_INT, 0 },
+      { 4, 0, 0 }, { 0, 0, 0 }, { 4, 0, 0 }, { 0, 0, 0 } };
+  fb_field type[2] = { { 4, colfile_width(column) * 8, 0 },
+      { 1, colfile_signed(column), 0 } };
+  fb_field unit[2] = { { 4, 0, 0 }, { 4, 0, 0 } };
+  size_t table;
+  size_t metadata;
+
+  if (column == COL_TIME) {
+    field[2].value = ARROW_TYPE_DURATION;
+    type[0].size = 2;
+    type[0].value = ARROW_MILLISECOND;
+    type[1].size = 0;
+  }
+  if (kColfileUnits[column]) {
+    field[6].size = 4;
+  }
+  table = fb_table(b, field, 7);
+  fb_patch(b, field[0].at, fb_string(b, kColfileNames[column]));
+  fb_patch(b, field[3].at, fb_table(b, type, 2));
+  /* Readers insist on children, even for a type that has none. */
+  fb_patch(b, field[5].at, fb_offsets(b, 0));
+  if (kColfileUnits[column]) {
+    metadata = fb_offsets(b, 1);
+    fb_patch(b, field[6].at, metadata);
+    fb_patch(b, metadata + 4, fb_table(b, unit, 2));
+    fb_patch(b, unit[0].at, fb_string(b, "unit"));
+    fb_patch(b, unit[1].at, fb_string(b, kColfileUnits[column]));
+  }
+  return table;
+}
+
+/* Message { version, header: RecordBatch { length, nodes, buffers } } and
+ * the body, each column as an empty validity buffer and its values. */
+int arrow_flush_batch(arrow_writer* w) {
+  uint64_t nodes[COL_COUNT][2];
+  uint64_t buffers[2 * COL_COUNT][2];
+  fb_field batch[3] = { { 8, w->count, 0 }, { 4, 0, 0 }, { 4, 0, 0 } };
+  arrow_fb b;
+  uint64_t body;
+  uint64_t bytes;
+  size_t header;
+  int i;
+
+  body = 0;
+  for (i = 0; i < COL_COUNT; i++) {
+    bytes = (uint64_t) w->count * colfile_width(i);
+    nodes[i][0] = w->count;
+    nodes[i][1] = 0;
+    buffers[2 * i][0] = body;
+    buffers[2 * i][1] = 0;
+    buffers[2 * i + 1][0] = body;
+    buffers[2 * i + 1][1] = bytes;
+    body += PAD_ARROW(bytes);
+  }
+  header = arrow_message(&b, ARROW_HEADER_RECORD_BATCH, body);
+  fb_patch(&b, header, fb_table(&b, batch, 3));
+  fb_patch(&b, batch[1].at, fb_structs(&b, nodes, COL_COUNT, 16));
+  fb_patch(&b, batch[2].at, fb_structs(&b, buffers, 2 * COL_COUNT, 16));
+  if (arrow_write_message(w->out, &b) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  for (i = 0; i < COL_COUNT; i++) {
+    bytes = (uint64_t) w->count * colfile_width(i);
+    if (output_write(w->out, w->columns[i], bytes) != SUCCESS
+        || output_write(w->out, kArrowPadding, PAD_ARROW(bytes) - bytes)
+        != SUCCESS) {
+      return OUTPUT_ERROR;
+    }
+  }
+  w->batches++;
+  w->count = 0;
+  return SUCCESS;
+}
+
+/* Starts b with a Message table, returning where to patch in the offset of
+ * its header. */
+size_t arrow_message(arrow_fb* b, int header_type, uint64_t body_len) {
+  fb_field message[4] = { { 2, ARROW_METADATA_V5, 0 }, { 1, header_type, 0 },
+      { 4, 0, 0 }, { 8, body_len, 0 } };
+  size_t root;
+
+  b->len = 0;
+  b->overflow = 0;
+  root = fb_put(b, kArrowPadding, 4);
+  fb_patch(b, root, fb_table(b, message, 4));
+  return message[2].at;
+}
+
+/* Writes the continuation marker, the metadata's length and the metadata,
+ * padded so whatever follows is aligned to 8 bytes. */
+int arrow_write_message(output* out, arrow_fb* b) {
+  uint32_t prefix[2];
+
+  fb_pad(b, 8);
+  if (b->overflow) {
+    fprintf(stderr, "Arrow metadata is longer than %d bytes.\n", FB_MAX);
+    return OUTPUT_ERROR;
+  }
+  prefix[0] = ARROW_CONTINUATION;
+  prefix[1] = b->len;
+  if (output_write(out, prefix, sizeof(prefix)) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  return output_write(out, b->buf, b->len);
+}
+
+/* Appends n bytes, returning where they went. */
+size_t fb_put(arrow_fb* b, const void* data, size_t n) {
+  size_t at;
+
+  at = b->len;
+  if (b->len + n > FB_MAX) {
+    b->overflow = 1;
+    return at;
+  }
+  memcpy(b->buf + at, data, n);
+  b->len += n;
+  return at;
+}
+
+void fb_pad(arrow_fb* b, size_t align) {
+  while (b->len % align != 0 && !b->overflow) {
+    fb_put(b, kArrowPadding, 1);
+  }
+}
+
+/* Points the offset at at to target, which must come after it. */
+void fb_patch(arrow_fb* b, size_t at, size_t target) {
+  uint32_t offset;
+
+  if (b->overflow) {
+    return;
+  }
+  offset = target - at;
+  memcpy(b->buf + at, &offset, 4);
+}
+
+/* Writes a vtable and then the table, each field aligned to its size,
+ * storing where each field went in its at. Returns where the table is. */
+size_t fb_table(arrow_fb* b, fb_field* fields, int n) {
+  uint16_t vtable[2 + FB_MAX_FIELDS];
+  uint16_t len;
+  int32_t back;
+  size_t table;
+  size_t at;
+  int i;
+
+  len = 4;
+  for (i = 0; i < n; i++) {
+    if (fields[i].size > 0) {
+      len = (len + fields[i].size - 1) & ~(fields[i].size - 1);
+      vtable[2 + i] = len;
+      len += fields[i].size;
+    } else {
+      vtable[2 + i] = 0;
+    }
+  }
+  vtable[0] = (2 + n) * sizeof(uint16_t);
+  vtable[1] = len;
+  fb_pad(b, 2);
+  at = fb_put(b, vtable, vtable[0]);
+  fb_pad(b, 8);
+  table = b->len;
+  back = table - at;
+  fb_put(b, &back, 4);
+  while (b->len < table + len && !b->overflow) {
+    fb_put(b, kArrowPadding, 1);
+  }
+  for (i = 0; i < n && !b->overflow; i++) {
+    if (fields[i].size > 0) {
+      fields[i].at = table + vtable[2 + i];
+      memcpy(b->buf + fields[i].at, &fields[i].value, fields[i].size);
+    }
+  }
+  return table;
+}
+
+size_t fb_string(arrow_fb* b, const char* s) {
+  uint32_t len;
+  size_t at;
+
+  len = strlen(s);
+  fb_pad(b, 4);
+  at = fb_put(b, &len, 4);
+  fb_put(b, s, len + 1);
+  return at;
+}
+
+/* A vector of n offsets, each to be patched in at 4 + 4 * i from where it
+ * starts. */
+size_t fb_offsets(arrow_fb* b, uint32_t n) {
+  size_t at;
+  uint32_t i;
+
+  fb_pad(b, 4);
+  at = fb_put(b, &n, 4);
+  for (i = 0; i < n; i++) {
+    fb_put(b, kArrowPadding, 4);
+  }
+  return at;
+}
+
+/* A vector of n structs of size bytes, aligned to 8. */
+size_t fb_structs(arrow_fb* b, const void* data, uint32_t n, size_t size) {
+  size_t at;
+
+  fb_pad(b, 4);
+  if (b->len % 8 == 0) {
+    fb_put(b, kArrowPadding, 4);
+  }
+  at = fb_put(b, &n, 4);
+  fb_put(b, data, n * size);
+  return at;
+}
@@ -0,0 +1,45 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Log entries as an Apache Arrow IPC stream, for analytics tools to load
+ * straight into columns without parsing CSV. The stream is a schema
+ * message, record batches of up to batch_size entries each, and the end of
+ * stream marker, with version 5 metadata. It has the columns of colfile.h,
+ * each non-null and of the field's own integer type, except time which is a
+ * duration in milliseconds. Columns with a unit name it in their "unit"
+ * metadata, as in the CSV header.
+ *
+ * Batch bodies are each column's values in turn, padded to 64 bytes, so a
+ * reader mapping the stream can use them in place. The Flatbuffers metadata
+ * is built by hand, needing neither the Arrow nor the Flatbuffers library.
+ */
+
+#ifndef ARROW_H_
+#define ARROW_H_
+
+#include <stdint.h>
+
+#include "colfile.h"
+#include "output.h"
+#include "powerlog6s.h"
+
+struct _arrow_writer {
+  output* out;
+  uint32_t batch_size;
+  uint32_t count; /* entries in the current batch */
+  unsigned char* columns[COL_COUNT];
+  colfile_clock clock;
+  uint64_t records;
+  uint64_t batches;
+};
+
+typedef struct _arrow_writer arrow_writer;
+
+/* Writes the schema. Returns SUCCESS or OUTPUT_ERROR. */
+int arrow_writer_init(arrow_writer* w, output* out, uint32_t batch_size);
+int arrow_writer_add(arrow_writer* w, const powerlog6s* log);
+/* Writes the last partial batch and the end of stream marker, and frees
+ * w. */
+int arrow_writer_close(arrow_writer* w);
+
+#endif  /* ARROW_H_ */
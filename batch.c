@@ -0,0 +1,835 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Batch conversion on a work stealing pool. Each thread has a queue of
+ * dumps, dealt out largest first, and when its own runs dry it steals from
+ * the tail of another's, where that thread's smallest are. Dumps are cut
+ * into chunks of --convert_chunk records, and a thread with no dump left to
+ * start helps with the chunks of those already started, so one huge dump is
+ * spread over every thread just as many small ones are.
+ *
+ * A dump's chunks are taken in order, no more than a window of them past
+ * the last written out, and each is written out, or its statistics merged,
+ * by whichever thread finishes the one due next, taking any that finished
+ * out of turn along with it. So there's no writer thread to wait for, and
+ * only a window of chunks per dump is ever held in memory.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "convert.h"
+#include "decimate.h"
+#include "flags.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "stats.h"
+#include "timing.h"
+
+#include "batch.h"
+
+#define MAX_BATCH_THREADS 256
+
+DEFINE_bool(batch, 0, "Convert each dump given, each in the directories "
+    "given and each matching the glob patterns given to a file of its own, "
+    "rather than all to stdout as one log, on --convert_threads threads");
+DEFINE_string(batch_output, NULL, "Directory to write --batch conversions "
+    "to, rather than beside each dump. Each is named after its dump, with "
+    "--batch_suffix replaced by .csv or .arrow, and nothing is converted if "
+    "two would have the same name");
+DEFINE_string(batch_suffix, ".bin", "Files in directories given to --batch "
+    "are taken to be dumps if their names end with this");
+DEFINE_bool(batch_stats, 0, "With --batch, print a --stats summary of each "
+    "dump to stdout rather than converting it");
+
+void fregister_batch() {
+  REGISTER(batch_stats);
+  REGISTER(batch_suffix);
+  REGISTER(batch_output);
+  REGISTER(batch);
+}
+
+/* A chunk formatted or summarized, waiting its turn to be written out. */
+struct _batch_piece {
+  uint64_t chunk;
+  output out; /* formatted CSV, written straight from its buffer */
+  stats st;
+  int rc;
+  struct _batch_piece* next; /* among the spares */
+};
+
+struct _batch_file {
+  char* path;
+  char* real_path; /* canonical, so a dump given twice is done once */
+  char* out_path; /* NULL with --batch_stats */
+  uint64_t size; /* bytes in the dump */
+  dump d; /* mapped when started, unless it's converted whole */
+  uint64_t chunks;
+  int fd; /* output, or -1 */
+  int active; /* started, and not yet finished */
+  uint64_t next; /* next chunk for a thread to take */
+  uint64_t committed; /* chunks written out, or merged, so far */
+  int committing; /* a thread is writing chunks out */
+  struct _batch_piece** pending; /* finished out of turn, chunk % window */
+  stats* st; /* merged so far, with --batch_stats */
+  int rc;
+};
+
+/* A thread's own queue of dumps to start, taken from the head by the thread
+ * and from the tail by thieves. */
+struct _batch_queue {
+  pthread_mutex_t lock;
+  int* files;
+  int head;
+  int tail;
+};
+
+struct _batch {
+  struct _batch_file* files;
+  int nfiles;
+  int cap;
+  struct _batch_queue* queues;
+  int nthreads;
+  uint64_t window; /* chunks of a dump that may be taken past committed */
+  int whole; /* dumps are converted whole by convert_dumps(), not chunked */
+
+  pthread_mutex_t lock; /* guards all but the queues */
+  pthread_cond_t progress;
+  int* active; /* files started and not finished */
+  int nactive;
+  int queued; /* files still in the queues */
+  int finished;
+  struct _batch_piece* spares;
+  uint64_t records; /* in the dumps started */
+  uint64_t read; /* bytes of the dumps started */
+  uint64_t bytes; /* written out */
+  uint64_t steals;
+  int rc;
+};
+
+struct _batch_thread {
+  struct _batch* b;
+  int id;
+};
+
+typedef struct _batch_piece batch_piece;
+typedef struct _batch_file batch_file;
+typedef struct _batch_queue batch_queue;
+typedef struct _batch batch;
+typedef struct _batch_thread batch_thread;
+
+int batch_find(batch* b, const char* path, int named);
+int batch_scan(batch* b, const char* dir);
+int batch_add(batch* b, const char* path, uint64_t size);
+int ends_with(const char* s, const char* suffix);
+char* batch_output_path(const char* path);
+void batch_dedupe(batch* b);
+int compare_real_paths(const void* a, const void* b);
+int batch_check_outputs(batch* b);
+int compare_out_paths(const void* a, const void* b);
+int compare_sizes(const void* a, const void* b);
+int batch_deal(batch* b);
+void* batch_worker(void* arg);
+int batch_claimable(batch* b, batch_file* f);
+batch_file* batch_claim(batch* b, int current, int any);
+int batch_take(batch* b, int id);
+void batch_start(batch* b, int file);
+batch_piece* batch_piece_new(batch* b);
+void batch_chunk(batch* b, batch_file* f, batch_piece* p);
+void batch_commit(batch* b, batch_file* f, batch_piece* p);
+void batch_finish(batch* b, batch_file* f);
+void batch_forget(batch* b, batch_file* f);
+void batch_piece_free(batch_piece* p);
+void batch_report(batch* b, double elapsed);
+
+int batch_enabled() {
+  return FLAGS_batch;
+}
+
+int batch_run(int count, char** paths) {
+  pthread_t threads[MAX_BATCH_THREADS];
+  batch_thread args[MAX_BATCH_THREADS];
+  batch_piece* p;
+  batch b;
+  double start;
+  int i;
+
+  if (FLAGS_convert_chunk == 0) {
+    fprintf(stderr, "--convert_chunk must be at least 1.\n");
+    return USER_SUCKS;
+  }
+  memset(&b, 0, sizeof(batch));
+  for (i = 0; i < count && b.rc == SUCCESS; i++) {
+    b.rc = batch_find(&b, paths[i], 1);
+  }
+  if (b.rc == SUCCESS) {
+    batch_dedupe(&b);
+  }
+  if (b.rc == SUCCESS && b.nfiles == 0) {
+    fprintf(stderr, "No dumps found to convert.\n");
+    b.rc = DEVICE_MISSING;
+  }
+  if (b.rc == SUCCESS && !FLAGS_batch_stats) {
+    b.rc = batch_check_outputs(&b);
+  }
+  b.nthreads = FLAGS_convert_threads;
+  if (b.nthreads == 0) {
+    b.nthreads = sysconf(_SC_NPROCESSORS_ONLN) > 0
+        ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  }
+  if (b.nthreads > MAX_BATCH_THREADS) {
+    b.nthreads = MAX_BATCH_THREADS;
+  }
+  /* As with convert_dumps(), enough to keep every thread busy on one dump
+   * while its next chunk due is still being formatted. */
+  b.window = 2 * b.nthreads;
+  /* Decimating and Arrow aren't worth spreading over threads, as
+   * convert_dumps() finds, but dumps can still be done side by side. */
+  b.whole = !FLAGS_batch_stats
+      && (strcmp(FLAGS_format, "arrow") == 0 || decimating());
+  if (b.rc == SUCCESS) {
+    b.rc = batch_deal(&b);
+  }
+
+  if (b.rc == SUCCESS) {
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.progress, NULL);
+    start = timing_now();
+    for (i = 0; i < b.nthreads; i++) {
+      args[i].b = &b;
+      args[i].id = i;
+      if (pthread_create(&threads[i], NULL, batch_worker, &args[i]) != 0) {
+        perror("Failed to start batch thread");
+        exit(DEVICE_ERROR);
+      }
+    }
+    for (i = 0; i < b.nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    batch_report(&b, timing_now() - start);
+    if (b.rc == SUCCESS && b.finished < b.nfiles) {
+      fprintf(stderr, "Interrupted with %d of %d dumps unfinished, leaving "
+          "the output of those started incomplete.\n",
+          b.nfiles - b.finished, b.nfiles);
+      b.rc = OUTPUT_ERROR;
+    }
+    pthread_cond_destroy(&b.progress);
+    pthread_mutex_destroy(&b.lock);
+  }
+
+  /* Anything left was cut short by an interrupt. */
+  for (i = 0; i < b.nfiles; i++) {
+    batch_forget(&b, &b.files[i]);
+  }
+  while (b.spares) {
+    p = b.spares;
+    b.spares = p->next;
+    batch_piece_free(p);
+  }
+  for (i = 0; b.queues && i < b.nthreads; i++) {
+    pthread_mutex_destroy(&b.queues[i].lock);
+    free(b.queues[i].files);
+  }
+  free(b.queues);
+  free(b.active);
+  free(b.files);
+  return b.rc;
+}
+
+/* Adds the dump at path, or the dumps under it if it's a directory, or
+ * those matching it if it's a pattern. Files named on the command line or
+ * matching a pattern are dumps whatever they're called. */
+int batch_find(batch* b, const char* path, int named) {
+  struct stat st;
+  glob_t g;
+  size_t i;
+  int rc;
+
+  if (named && strpbrk(path, "*?[")) {
+    if (glob(path, 0, NULL, &g) != 0) {
+      fprintf(stderr, "Nothing matches %s.\n", path);
+      return DEVICE_MISSING;
+    }
+    rc = SUCCESS;
+    for (i = 0; i < g.gl_pathc && rc == SUCCESS; i++) {
+      rc = batch_find(b, g.gl_pathv[i], 1);
+    }
+    globfree(&g);
+    return rc;
+  }
+  /* Links found in directories aren't followed, so they can't loop. */
+  if ((named ? stat(path, &st) : lstat(path, &st)) != 0) {
+    perror(path);
+    return DEVICE_MISSING;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    return batch_scan(b, path);
+  } else if (!named && (!S_ISREG(st.st_mode)
+      || !ends_with(path, FLAGS_batch_suffix))) {
+    return SUCCESS;
+  }
+  return batch_add(b, path, st.st_size);
+}
+
+int batch_scan(batch* b, const char* dir) {
+  struct dirent* e;
+  char* path;
+  DIR* d;
+  int rc;
+
+  d = opendir(dir);
+  if (!d) {
+    perror(dir);
+    return DEVICE_MISSING;
+  }
+  rc = SUCCESS;
+  while (rc == SUCCESS && (e = readdir(d)) != NULL) {
+    /* Hidden files, and . and .. */
+    if (e->d_name[0] == '.') {
+      continue;
+    }
+    path = (char*) malloc(strlen(dir) + strlen(e->d_name) + 2);
+    if (!path) {
+      perror("Failed to allocate path");
+      rc = USER_SUCKS;
+      break;
+    }
+    sprintf(path, "%s/%s", dir, e->d_name);
+    rc = batch_find(b, path, 0);
+    free(path);
+  }
+  closedir(d);
+  return rc;
+}
+
+int batch_add(batch* b, const char* path, uint64_t size) {
+  batch_file* files;
+  batch_file* f;
+
+  if (b->nfiles == b->cap) {
+    b->cap = b->cap ? 2 * b->cap : 64;
+    files = (batch_file*) realloc(b->files, b->cap * sizeof(batch_file));
+    if (!files) {
+      perror("Failed to allocate dumps");
+      return USER_SUCKS;
+    }
+    b->files = files;
+  }
+  f = &b->files[b->nfiles];
+  memset(f, 0, sizeof(batch_file));
+  f->real_path = realpath(path, NULL);
+  if (!f->real_path) {
+    perror(path);
+    return DEVICE_MISSING;
+  }
+  f->path = strdup(path);
+  f->out_path = FLAGS_batch_stats ? NULL : batch_output_path(path);
+  if (!f->path || (!FLAGS_batch_stats && !f->out_path)) {
+    perror("Failed to allocate path");
+    free(f->real_path);
+    free(f->path);
+    free(f->out_path);
+    return USER_SUCKS;
+  }
+  f->size = size;
+  f->fd = -1;
+  b->nfiles++;
+  return SUCCESS;
+}
+
+int ends_with(const char* s, const char* suffix) {
+  size_t n = strlen(s);
+  size_t m = strlen(suffix);
+
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/* Names the conversion of the dump at path. */
+char* batch_output_path(const char* path) {
+  const char* extension;
+  const char* base;
+  char* out;
+  size_t len;
+
+  extension = strcmp(FLAGS_format, "arrow") == 0 ? ".arrow" : ".csv";
+  base = path;
+  if (FLAGS_batch_output && strrchr(path, '/')) {
+    base = strrchr(path, '/') + 1;
+  }
+  len = strlen(base);
+  if (ends_with(base, FLAGS_batch_suffix)) {
+    len -= strlen(FLAGS_batch_suffix);
+  }
+  out = (char*) malloc((FLAGS_batch_output ? strlen(FLAGS_batch_output) : 0)
+      + len + strlen(extension) + 2);
+  if (out && FLAGS_batch_output) {
+    sprintf(out, "%s/%.*s%s", FLAGS_batch_output, (int) len, base,
+        extension);
+  } else if (out) {
+    sprintf(out, "%.*s%s", (int) len, base, extension);
+  }
+  return out;
+}
+
+/* Drops dumps given more than once, as one named and also under a
+ * directory named is, or one reached by two links, converting just one of
+ * them. The order doesn't matter, as batch_deal() sorts by size. */
+void batch_dedupe(batch* b) {
+  int kept;
+  int i;
+
+  qsort(b->files, b->nfiles, sizeof(batch_file), compare_real_paths);
+  kept = 0;
+  for (i = 0; i < b->nfiles; i++) {
+    if (kept > 0
+        && strcmp(b->files[kept - 1].real_path, b->files[i].real_path) == 0) {
+      batch_forget(b, &b->files[i]);
+    } else {
+      b->files[kept++] = b->files[i];
+    }
+  }
+  b->nfiles = kept;
+}
+
+int compare_real_paths(const void* a, const void* b) {
+  return strcmp(((const batch_file*) a)->real_path,
+      ((const batch_file*) b)->real_path);
+}
+
+/* Fails if any two different dumps would be converted to the same file, as
+ * dumps of the same name in different directories are with --batch_output,
+ * before anything's written. */
+int batch_check_outputs(batch* b) {
+  batch_file** sorted;
+  int rc;
+  int i;
+
+  sorted = (batch_file**) malloc(b->nfiles * sizeof(batch_file*));
+  if (!sorted) {
+    perror("Failed to allocate dumps");
+    return USER_SUCKS;
+  }
+  for (i = 0; i < b->nfiles; i++) {
+    sorted[i] = &b->files[i];
+  }
+  qsort(sorted, b->nfiles, sizeof(batch_file*), compare_out_paths);
+  rc = SUCCESS;
+  for (i = 1; i < b->nfiles; i++) {
+    if (strcmp(sorted[i - 1]->out_path, sorted[i]->out_path) == 0) {
+      fprintf(stderr, "Both %s and %s would be converted to %s.\n",
+          sorted[i - 1]->path, sorted[i]->path, sorted[i]->out_path);
+      rc = USER_SUCKS;
+    }
+  }
+  free(sorted);
+  return rc;
+}
+
+int compare_out_paths(const void* a, const void* b) {
+  return strcmp((*(batch_file* const*) a)->out_path,
+      (*(batch_file* const*) b)->out_path);
+}
+
+/* Largest first. */
+int compare_sizes(const void* a, const void* b) {
+  const batch_file* x = (const batch_file*) a;
+  const batch_file* y = (const batch_file*) b;
+
+  return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+/* Deals the dumps out to the threads' queues, largest first, so each
+ * thread starts on the largest it has and thieves take the smallest. */
+int batch_deal(batch* b) {
+  batch_queue* q;
+  int i;
+
+  qsort(b->files, b->nfiles, sizeof(batch_file), compare_sizes);
+  b->queues = (batch_queue*) calloc(b->nthreads, sizeof(batch_queue));
+  b->active = (int*) malloc(b->nfiles * sizeof(int));
+  if (!b->queues || !b->active) {
+    perror("Failed to allocate queues");
+    return USER_SUCKS;
+  }
+  for (i = 0; i < b->nthreads; i++) {
+    pthread_mutex_init(&b->queues[i].lock, NULL);
+    b->queues[i].files = (int*) malloc(
+        ((b->nfiles + b->nthreads - 1) / b->nthreads) * sizeof(int));
+    if (!b->queues[i].files) {
+      perror("Failed to allocate queues");
+      return USER_SUCKS;
+    }
+  }
+  for (i = 0; i < b->nfiles; i++) {
+    q = &b->queues[i % b->nthreads];
+    q->files[q->tail++] = i;
+  }
+  b->queued = b->nfiles;
+  return SUCCESS;
+}
+
+/* Works on chunks of the dump it last started while it can, then starts
+ * another, and once there are none left to start helps with the others'
+ * until every dump is finished. */
+void* batch_worker(void* arg) {
+  batch_thread* t = (batch_thread*) arg;
+  batch* b = t->b;
+  batch_piece* p;
+  batch_file* f;
+  uint64_t chunk;
+  int current;
+  int file;
+
+  current = -1;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    f = batch_claim(b, current, b->queued == 0);
+    while (!f && (b->queued == 0 || capture_interrupted)) {
+      if (b->finished == b->nfiles || capture_interrupted) {
+        pthread_cond_broadcast(&b->progress);
+        pthread_mutex_unlock(&b->lock);
+        return NULL;
+      }
+      pthread_cond_wait(&b->progress, &b->lock);
+      f = batch_claim(b, current, 1);
+    }
+    p = NULL;
+    chunk = 0;
+    if (f) {
+      chunk = f->next++;
+      p = b->spares;
+      if (p) {
+        b->spares = p->next;
+      }
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (f) {
+      if (!p) {
+        p = batch_piece_new(b);
+      }
+      p->chunk = chunk;
+      batch_chunk(b, f, p);
+      batch_commit(b, f, p);
+      continue;
+    }
+    file = batch_take(b, t->id);
+    if (file >= 0) {
+      batch_start(b, file);
+      current = file;
+    }
+  }
+}
+
+int batch_claimable(batch* b, batch_file* f) {
+  return f->active && f->next < f->chunks
+      && f->next < f->committed + b->window;
+}
+
+/* Finds a dump with a chunk to take, current if it has one or else, if any
+ * will do, whichever has most left. Called with b->lock held. */
+batch_file* batch_claim(batch* b, int current, int any) {
+  batch_file* best;
+  batch_file* f;
+  int i;
+
+  if (capture_interrupted) {
+    return NULL;
+  }
+  if (current >= 0 && batch_claimable(b, &b->files[current])) {
+    return &b->files[current];
+  }
+  best = NULL;
+  for (i = 0; any && i < b->nactive; i++) {
+    f = &b->files[b->active[i]];
+    if (batch_claimable(b, f)
+        && (!best || f->chunks - f->next > best->chunks - best->next)) {
+      best = f;
+    }
+  }
+  return best;
+}
+
+/* Takes the next dump from the thread's own queue, or steals one from
+ * another's, returning -1 if there are none left. */
+int batch_take(batch* b, int id) {
+  batch_queue* q;
+  int stolen;
+  int file;
+  int i;
+
+  file = -1;
+  stolen = 0;
+  q = &b->queues[id];
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    file = q->files[q->head++];
+  }
+  pthread_mutex_unlock(&q->lock);
+  for (i = 1; file < 0 && i < b->nthreads; i++) {
+    q = &b->queues[(id + i) % b->nthreads];
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+      file = q->files[--q->tail];
+      stolen = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  if (file >= 0) {
+    pthread_mutex_lock(&b->lock);
+    b->queued--;
+    b->steals += stolen;
+    pthread_mutex_unlock(&b->lock);
+  }
+  return file;
+}
+
+/* Maps a dump and opens its output, making its chunks available to every
+ * thread. */
+void batch_start(batch* b, int file) {
+  batch_file* f = &b->files[file];
+  int rc;
+
+  rc = SUCCESS;
+  if (b->whole) {
+    f->d.count = f->size / sizeof(powerlog6s);
+  } else {
+    rc = map_dump(&f->d, f->path);
+  }
+  if (rc == SUCCESS && f->out_path) {
+    f->fd = open(f->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0) {
+      perror(f->out_path);
+      rc = OUTPUT_ERROR;
+    }
+  }
+  if (rc == SUCCESS && f->out_path && !b->whole) {
+    rc = write_header(f->fd, f->d.times != NULL);
+  }
+  if (rc == SUCCESS && FLAGS_batch_stats) {
+    f->st = (stats*) malloc(sizeof(stats));
+    if (!f->st) {
+      perror("Failed to allocate statistics");
+      rc = USER_SUCKS;
+    } else {
+      stats_init(f->st);
+    }
+  }
+  f->pending = (batch_piece**) calloc(b->window, sizeof(batch_piece*));
+  if (rc == SUCCESS && !f->pending) {
+    perror("Failed to allocate chunks");
+    rc = USER_SUCKS;
+  }
+  f->chunks = b->whole ? 1
+      : (f->d.count + FLAGS_convert_chunk - 1) / FLAGS_convert_chunk;
+  f->rc = rc;
+
+  pthread_mutex_lock(&b->lock);
+  b->records += f->d.count;
+  b->read += f->size;
+  if (rc == SUCCESS && f->chunks > 0) {
+    f->active = 1;
+    b->active[b->nactive++] = file;
+    pthread_cond_broadcast(&b->progress);
+  }
+  pthread_mutex_unlock(&b->lock);
+  /* Once active, another thread may finish it before this one gets here. */
+  if (rc != SUCCESS || f->chunks == 0) {
+    batch_finish(b, f);
+  }
+}
+
+batch_piece* batch_piece_new(batch* b) {
+  batch_piece* p;
+
+  p = (batch_piece*) malloc(sizeof(batch_piece));
+  if (!p) {
+    perror("Failed to allocate chunk");
+    exit(USER_SUCKS);
+  }
+  memset(p, 0, sizeof(batch_piece));
+  /* Pieces go from dump to dump, so have room for times whether or not
+   * the dump has any. */
+  if (!b->whole && !FLAGS_batch_stats && output_open(&p->out, -1,
+      FLAGS_convert_chunk * (POWERLOG6S_CSV_MAX + DRIFT_CSV_MAX))
+      != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  return p;
+}
+
+/* Formats or summarizes a chunk into p, or converts the whole dump. */
+void batch_chunk(batch* b, batch_file* f, batch_piece* p) {
+  const powerlog6s* records;
+  const drift_record* times;
+  uint64_t count;
+  uint64_t i;
+  char* line;
+
+  p->rc = SUCCESS;
+  if (b->whole) {
+    p->rc = convert_dumps(1, &f->path, f->fd);
+    return;
+  }
+  records = f->d.records + p->chunk * FLAGS_convert_chunk;
+  count = f->d.count - p->chunk * FLAGS_convert_chunk;
+  if (count > FLAGS_convert_chunk) {
+    count = FLAGS_convert_chunk;
+  }
+  if (f->st) {
+    stats_init(&p->st);
+    for (i = 0; i < count; i++) {
+      /* Gap markers aren't entries. */
+      if (records[i].type != POWERLOG6S_GAP) {
+        stats_add(&p->st, &records[i]);
+      }
+    }
+    return;
+  }
+  times = f->d.times ? f->d.times + p->chunk * FLAGS_convert_chunk : NULL;
+  line = p->out.buf;
+  if (times) {
+    for (i = 0; i < count; i++) {
+      line += drift_csv_format_entry(&records[i], &times[i], line);
+    }
+  } else {
+    for (i = 0; i < count; i++) {
+      line += powerlog6s_csv_format(&records[i], line);
+    }
+  }
+  output_commit(&p->out, line - p->out.buf);
+}
+
+/* Hands in a finished chunk, and if no other thread is already at it,
+ * writes out every chunk now due, finishing the dump after its last. */
+void batch_commit(batch* b, batch_file* f, batch_piece* p) {
+  int done;
+  int rc;
+
+  pthread_mutex_lock(&b->lock);
+  f->pending[p->chunk % b->window] = p;
+  if (f->committing) {
+    pthread_mutex_unlock(&b->lock);
+    return;
+  }
+  f->committing = 1;
+  while ((p = f->pending[f->committed % b->window]) != NULL) {
+    f->pending[f->committed % b->window] = NULL;
+    rc = f->rc != SUCCESS ? f->rc : p->rc;
+    pthread_mutex_unlock(&b->lock);
+
+    if (rc == SUCCESS && f->st) {
+      stats_merge(f->st, &p->st);
+    } else if (rc == SUCCESS && p->out.len > 0) {
+      p->out.fd = f->fd;
+      rc = output_flush(&p->out);
+    }
+    p->out.len = 0;
+
+    pthread_mutex_lock(&b->lock);
+    if (f->rc == SUCCESS) {
+      f->rc = rc;
+    }
+    f->committed++;
+    p->next = b->spares;
+    b->spares = p;
+    pthread_cond_broadcast(&b->progress);
+  }
+  f->committing = 0;
+  done = f->committed == f->chunks;
+  pthread_mutex_unlock(&b->lock);
+  if (done) {
+    batch_finish(b, f);
+  }
+}
+
+/* Prints a dump's statistics, or closes its output, and counts it done. */
+void batch_finish(batch* b, batch_file* f) {
+  off_t end;
+  int i;
+
+  if (f->st && f->rc == SUCCESS) {
+    stats_print(f->st, f->path, stdout);
+  }
+  end = 0;
+  if (f->fd >= 0) {
+    end = lseek(f->fd, 0, SEEK_CUR);
+    if (close(f->fd) != 0 && f->rc == SUCCESS) {
+      perror(f->out_path);
+      f->rc = OUTPUT_ERROR;
+    }
+    f->fd = -1;
+  }
+
+  pthread_mutex_lock(&b->lock);
+  for (i = 0; f->active && i < b->nactive; i++) {
+    if (&b->files[b->active[i]] == f) {
+      b->active[i] = b->active[--b->nactive];
+      break;
+    }
+  }
+  f->active = 0;
+  b->bytes += end > 0 ? end : 0;
+  b->finished++;
+  if (f->rc != SUCCESS && b->rc == SUCCESS) {
+    b->rc = f->rc;
+  }
+  pthread_cond_broadcast(&b->progress);
+  pthread_mutex_unlock(&b->lock);
+  batch_forget(b, f);
+}
+
+/* Frees what's left of a dump, finished or not. */
+void batch_forget(batch* b, batch_file* f) {
+  uint64_t i;
+
+  if (f->fd >= 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  unmap_dump(&f->d);
+  for (i = 0; f->pending && i < b->window; i++) {
+    if (f->pending[i]) {
+      batch_piece_free(f->pending[i]);
+    }
+  }
+  free(f->pending);
+  f->pending = NULL;
+  free(f->st);
+  f->st = NULL;
+  free(f->path);
+  f->path = NULL;
+  free(f->real_path);
+  f->real_path = NULL;
+  free(f->out_path);
+  f->out_path = NULL;
+}
+
+void batch_piece_free(batch_piece* p) {
+  p->out.len = 0;
+  if (p->out.buf) {
+    output_close(&p->out);
+  }
+  free(p);
+}
+
+void batch_report(batch* b, double elapsed) {
+  fprintf(stderr, "%s %d of %d dumps, %llu records and %.1f MB, into %.1f "
+      "MB in %.3f s on %d threads (%.1f MB/s, %.0f records/s), %llu "
+      "stolen.\n", FLAGS_batch_stats ? "Summarized" : "Converted",
+      b->finished, b->nfiles, (unsigned long long) b->records, b->read / 1e6,
+      b->bytes / 1e6, elapsed, b->nthreads,
+      elapsed > 0 ? b->read / elapsed / 1e6 : 0,
+      elapsed > 0 ? b->records / elapsed : 0,
+      (unsigned long long) b->steals);
+}
@@ -0,0 +1,21 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Batch processing of whole archives of dumps in one run: each dump found
+ * among the paths given, directories and glob patterns included, is
+ * converted to a file of its own, or summarized with --batch_stats, on a
+ * pool of threads that balance one huge dump against many tiny ones.
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+void fregister_batch();
+
+int batch_enabled();
+/* Converts or summarizes every dump at or under the count paths, returning
+ * SUCCESS or the first error code from rc.h. Prints the throughput to stderr
+ * when done. */
+int batch_run(int count, char** paths);
+
+#endif  /* BATCH_H_ */
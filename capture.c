@@ -0,0 +1,1190 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Capture of log data from one device: reading reports, interpreting them
+ * and writing the result out.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "hidselect.h"
+#include "metrics.h"
+#include "rc.h"
+#include "timing.h"
+
+#include "capture.h"
+
+#define MAX_COLUMN_BLOCK (1 << 24)
+/* Enough for the most any format writes in one go. */
+#define MIN_OUTPUT_BUFFER 16384
+/* Milliseconds before looking again at output held back by output_idle(). */
+#define IDLE_FLUSH_MS 10
+/* Gaps and entries out of order warned of in each log. */
+#define MAX_CONTINUITY_WARNINGS 10
+/* Seconds the --threaded reader sleeps waiting for room in a full ring. */
+#define RING_FULL_WAIT 0.001
+
+DEFINE_bool(autoend, 1, "Exit when the device indicates the end of a log."
+    " Only works when interpreting device data (see --interpret)");
+DEFINE_bool(binary, 0, "Dump data as raw binary rather than CSV if "
+    "interpreting the data, or hex if not. Same as --format=binary when "
+    "interpreting");
+DEFINE_string(format, "csv", "How to write interpreted log entries: csv, "
+    "binary for the packed records as sent by the device, columnar for "
+    "blocks of columns with a time index (see colfile.h), or delta for a "
+    "compact encoding of the differences between records (see delta.h) which "
+    "is written out a frame of records at a time, or arrow for an Apache "
+    "Arrow IPC stream (see arrow.h), which also applies to converting dumps, "
+    "or framed for binary records in checksummed blocks that powerrecover "
+    "can salvage from a damaged file (see frame.h)");
+DEFINE_uint64(column_block, 4096, "Records per block with --format=columnar, "
+    "or per record batch with --format=arrow");
+DEFINE_uint64(frame_records, 1024, "Most records per block with "
+    "--format=framed");
+DEFINE_uint64(frame_commit_ms, 1000, "With --format=framed, write out a "
+    "block that isn't full once its first record has waited this many "
+    "milliseconds, along with any others waiting, 0 to wait till it's full. "
+    "--fsync_ms and --fsync_records say how often to fsync() the blocks");
+DEFINE_bool(interpret, 1, "Interpret the binary data being read to "
+    "output only log entires. If false, full buffers will be written");
+DEFINE_int64(read_timeout, 1000, "Milliseconds to wait for a report before "
+    "giving up and waiting again, -1 to wait indefinitely. Also bounds how "
+    "long shutdown takes, and the reader thread of --threaded always gives up "
+    "after a second");
+DEFINE_bool(read_stats, 0, "Print statistics on wakeups and CPU use of the "
+    "read loop at exit");
+DEFINE_uint64(output_buffer, 1 << 20, "Bytes of output gathered before "
+    "writing them out. Output is also written whenever the device goes quiet");
+DEFINE_bool(threaded, 0, "Read from the device on a dedicated thread, so "
+    "slow output never holds up USB reads");
+DEFINE_bool(async_output, 0, "Write output on a thread of its own, a few "
+    "--output_buffer sized buffers at a time, so a slow disk or pipe never "
+    "holds up decoding");
+DEFINE_uint64(fsync_records, 0, "fsync() output once this many entries, or "
+    "reports with --interpret=0, have been written since it last was. 0 "
+    "leaves it to --fsync_ms, or to the kernel if that's 0 too");
+DEFINE_uint64(fsync_ms, 0, "fsync() output once it's been unsynced for this "
+    "many milliseconds, 0 for no limit");
+DEFINE_uint64(rotate_bytes, 0, "Once an --output_pattern file has grown to "
+    "this many bytes, carry on in a new one named after it with .1, .2 and so "
+    "on appended, each a complete file in the --format. 0 never rotates");
+DEFINE_uint64(ring_size, 4096, "Reports the --threaded reader can queue up "
+    "for output. Must be a power of two");
+DEFINE_bool(continuity, 0, "Check the interval of each entry follows on "
+    "from the last, warning of gaps and entries out of order, and summarize "
+    "what was lost at the end of each log");
+DEFINE_bool(mark_gaps, 0, "Write a marker in place of entries found "
+    "missing, as a comment line in CSV or a record of type 0x1f in binary. "
+    "Implies --continuity. Not written when decimating");
+DEFINE_bool(stats, 0, "Print a summary of current, voltages, cells, rpm and "
+    "temperatures at the end of each log, and of whatever was captured of "
+    "the last one at exit");
+DEFINE_bool(reconnect, 0, "When the device fails, as when it's unplugged, "
+    "keep looking for it again the same way it was first found and carry on "
+    "capturing into the same output, with a marker where it was lost. "
+    "Several devices are found again by serial number, or where they were "
+    "found if they have none");
+DEFINE_uint64(reconnect_delay, 100, "Milliseconds to wait before first "
+    "looking for a lost device, doubling after each failed look");
+DEFINE_uint64(reconnect_max_delay, 5000, "Most milliseconds to wait between "
+    "looks for a lost device");
+DEFINE_uint64(reconnect_attempts, 1000, "Looks for a lost device before "
+    "giving up on it, or 0 to keep looking until interrupted");
+
+void fregister_capture() {
+  REGISTER(reconnect_attempts);
+  REGISTER(reconnect_max_delay);
+  REGISTER(reconnect_delay);
+  REGISTER(reconnect);
+  REGISTER(mark_gaps);
+  REGISTER(continuity);
+  REGISTER(stats);
+  REGISTER(frame_commit_ms);
+  REGISTER(frame_records);
+  REGISTER(column_block);
+  REGISTER(format);
+  REGISTER(ring_size);
+  REGISTER(rotate_bytes);
+  REGISTER(fsync_ms);
+  REGISTER(fsync_records);
+  REGISTER(async_output);
+  REGISTER(threaded);
+  REGISTER(output_buffer);
+  REGISTER(read_stats);
+  REGISTER(read_timeout);
+  REGISTER(interpret);
+  REGISTER(binary);
+  REGISTER(autoend);
+}
+
+volatile sig_atomic_t capture_interrupted = 0;
+
+int capture_direct(capture* c);
+int start_format(capture* c);
+int finish_format(capture* c);
+int begin_session(capture* c);
+int end_session(capture* c, const char* how);
+int rotate_output(capture* c);
+int parse_format(char* format);
+int write_delta_frame(capture* c);
+int commit_frames(capture* c);
+int idle_timeout(capture* c, int timeout);
+int writes_markers(capture* c);
+int capture_threaded(capture* c);
+void capture_warn(capture* c, const char* format, ...);
+int decode_report(capture* c, unsigned char* buf, int len);
+int enqueue_report(capture* c, unsigned char* buf, int len);
+int print_log(capture* c, powerlog6s* log);
+int write_log(void* arg, const powerlog6s* log);
+int restart_decimation(capture* c, uint64_t total);
+int print_raw(capture* c, unsigned char* buf, int len);
+void print_stats(capture* c);
+int checking_continuity();
+int check_continuity(capture* c, const powerlog6s* log);
+void print_continuity(capture* c);
+void print_read_stats(capture* c);
+int process_report(capture* c, unsigned char* buf, int len, double arrival,
+    double realtime);
+int time_report(capture* c, unsigned char* buf, int len, double arrival);
+int interpret_report(capture* c, unsigned char* buf, int len);
+void note_written(capture* c);
+int note_pending(capture* c);
+void print_host_time(capture* c);
+int read_log(capture* c, int timeout,
+    int (*handle)(capture* c, unsigned char* buf, int len));
+void note_read(capture* c, int len, double start);
+int reconnect(capture* c,
+    int (*handle)(capture* c, unsigned char* buf, int len));
+int mark_reconnect(capture* c, unsigned char* buf);
+void* read_reports(void* arg);
+int write_reports(capture* c);
+
+int capture_init(capture* c, char* name, log_device* device, int fd) {
+  memset(c, 0, sizeof(capture));
+  c->name = name;
+  c->device = device;
+  if (FLAGS_output_buffer < MIN_OUTPUT_BUFFER) {
+    fprintf(stderr, "--output_buffer must be at least %d bytes.\n",
+        MIN_OUTPUT_BUFFER);
+    return USER_SUCKS;
+  }
+  c->format = FLAGS_binary ? FORMAT_BINARY : parse_format(FLAGS_format);
+  if (c->format < 0) {
+    fprintf(stderr, "Unknown --format '%s'.\n", FLAGS_format);
+    return USER_SUCKS;
+  }
+  if (flight_enabled()) {
+    if (c->format != FORMAT_CSV || !FLAGS_interpret) {
+      fprintf(stderr, "--flight_recorder records interpreted entries as "
+          "they are, so can't be combined with --format, --binary or "
+          "--interpret=0.\n");
+      return USER_SUCKS;
+    }
+    c->format = FORMAT_FLIGHT;
+  }
+  if ((c->format == FORMAT_COLUMNAR || c->format == FORMAT_ARROW)
+      && (FLAGS_column_block == 0 || FLAGS_column_block > MAX_COLUMN_BLOCK)) {
+    fprintf(stderr, "--column_block must be between 1 and %d.\n",
+        MAX_COLUMN_BLOCK);
+    return USER_SUCKS;
+  }
+  if (c->format == FORMAT_FRAMED && (FLAGS_frame_records == 0
+      || FLAGS_frame_records > FRAME_MAX_RECORDS)) {
+    fprintf(stderr, "--frame_records must be between 1 and %d.\n",
+        FRAME_MAX_RECORDS);
+    return USER_SUCKS;
+  }
+  if (FLAGS_mark_gaps && !writes_markers(c)) {
+    fprintf(stderr, "--mark_gaps only works with --format=csv, binary or "
+        "framed, or --flight_recorder.\n");
+    return USER_SUCKS;
+  }
+  if (FLAGS_host_time && (!FLAGS_interpret || decimating()
+      || (c->format != FORMAT_CSV && c->format != FORMAT_BINARY))) {
+    fprintf(stderr, "--host_time only works with --format=csv or binary, "
+        "and without --interpret=0 or --decimate.\n");
+    return USER_SUCKS;
+  }
+  if (output_open(&c->out, fd, FLAGS_output_buffer) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  output_set_sync(&c->out, FLAGS_fsync_records, FLAGS_fsync_ms);
+  if (FLAGS_async_output && output_start_async(&c->out) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  /* Each session starts its own file when it begins. */
+  if (FLAGS_interpret && !sessions_enabled() && start_format(c) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  if (FLAGS_interpret && decimating()
+      && decimator_init(&c->decimate, 0, write_log, c) != SUCCESS) {
+    return USER_SUCKS;
+  }
+  if (live_enabled()
+      && live_open(&c->live, c->name ? c->name : "device") != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  stats_init(&c->stats);
+  continuity_init(&c->continuity, 0, 0);
+  drift_init(&c->drift);
+  c->start = timing_now();
+  c->start_cpu = timing_cpu();
+  return SUCCESS;
+}
+
+int capture_run(capture* c) {
+  if (FLAGS_threaded) {
+    c->rc = capture_threaded(c);
+  } else {
+    c->rc = capture_direct(c);
+  }
+  return c->rc;
+}
+
+void* capture_thread(void* c) {
+  capture_run((capture*) c);
+  return NULL;
+}
+
+void capture_finish(capture* c) {
+  if (FLAGS_interpret && decimating()
+      && decimator_finish(&c->decimate) != SUCCESS && c->rc == SUCCESS) {
+    c->rc = OUTPUT_ERROR;
+  }
+  if (c->session.open) {
+    if (end_session(c, "exit") != SUCCESS && c->rc == SUCCESS) {
+      c->rc = OUTPUT_ERROR;
+    }
+  } else if (!sessions_enabled()) {
+    if (FLAGS_interpret && finish_format(c) != SUCCESS && c->rc == SUCCESS) {
+      c->rc = OUTPUT_ERROR;
+    }
+    if (output_flush(&c->out) != SUCCESS && c->rc == SUCCESS) {
+      c->rc = OUTPUT_ERROR;
+    }
+  }
+  note_written(c);
+  free(c->pending);
+  c->pending = NULL;
+  if (c->live.header) {
+    live_close(&c->live);
+  }
+  if (FLAGS_stats && c->stats.records > 0) {
+    print_stats(c);
+  }
+  if (checking_continuity() && c->continuity.entries > 0) {
+    print_continuity(c);
+  }
+  if (FLAGS_read_stats) {
+    print_read_stats(c);
+  }
+  if (FLAGS_host_time && c->drift.fitted + c->latency.count > 0) {
+    print_host_time(c);
+  }
+  if (c->reconnects > 0) {
+    capture_warn(c, "Reconnected %llu times, %.3f s without the device, at "
+        "most %.3f s at once.\n", (unsigned long long) c->reconnects,
+        c->offline, c->max_offline);
+  }
+}
+
+void capture_summary(capture* c) {
+  double elapsed;
+
+  elapsed = timing_now() - c->start;
+  capture_warn(c, "%llu records (%.0f/s), %llu control messages, %llu "
+      "errors, %llu bytes written, result %d.\n",
+      (unsigned long long) c->records,
+      elapsed > 0 ? c->records / elapsed : 0.0,
+      (unsigned long long) c->controls, (unsigned long long) c->errors,
+      (unsigned long long) c->out.bytes, c->rc);
+}
+
+int capture_direct(capture* c) {
+  int timeout;
+  int rc;
+
+  do {
+    timeout = idle_timeout(c, (int) FLAGS_read_timeout);
+    rc = read_log(c, timeout, decode_report);
+    /* Everything queued has been handled, so pass it on before sleeping. */
+    if ((commit_frames(c) != SUCCESS || output_idle(&c->out) != SUCCESS)
+        && rc == READ_AGAIN) {
+      rc = OUTPUT_ERROR;
+    }
+    note_written(c);
+    if (rc == DEVICE_ERROR && FLAGS_reconnect) {
+      rc = reconnect(c, decode_report);
+    }
+  } while (rc == READ_AGAIN && !capture_interrupted);
+  return rc == READ_AGAIN ? SUCCESS : rc;
+}
+
+/* The reader thread only moves reports from the device into the ring. This
+ * thread decodes and writes them out, so a stalled consumer of our output
+ * fills the ring rather than the kernel's much smaller queue. */
+int capture_threaded(capture* c) {
+  pthread_t reader;
+  int rc;
+
+  if (ring_init(&c->reports, FLAGS_ring_size) != SUCCESS) {
+    return USER_SUCKS;
+  }
+  if (pthread_create(&reader, NULL, read_reports, c) != 0) {
+    perror("Failed to start reader thread");
+    ring_destroy(&c->reports);
+    return DEVICE_ERROR;
+  }
+  rc = write_reports(c);
+  __atomic_store_n(&c->stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(reader, NULL);
+  ring_destroy(&c->reports);
+  return rc == READ_AGAIN ? SUCCESS : rc;
+}
+
+void* read_reports(void* arg) {
+  capture* c = (capture*) arg;
+  int timeout;
+  int rc;
+
+  timeout = FLAGS_read_timeout < 0 || FLAGS_read_timeout > 1000
+      ? 1000 : (int) FLAGS_read_timeout;
+  do {
+    rc = read_log(c, timeout, enqueue_report);
+    if (rc == DEVICE_ERROR && FLAGS_reconnect) {
+      rc = reconnect(c, enqueue_report);
+    }
+  } while (rc == READ_AGAIN && !capture_interrupted
+      && !__atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE));
+  c->reader_rc = rc;
+  ring_close(&c->reports);
+  return NULL;
+}
+
+int enqueue_report(capture* c, unsigned char* buf, int len) {
+  powerlog6s_ctl* ctl = (powerlog6s_ctl*) buf;
+  int control;
+
+  /* Control messages are few, and say where logs start and end, so are
+   * worth waiting for room for. An entry finding the ring full is counted
+   * as an overrun, and reading carries on regardless, so the device never
+   * backs up. */
+  control = FLAGS_interpret && len >= 3 && ctl->len >= 3
+      && ctl->type == POWERLOG6S_CONTROL;
+  while (control && ring_full(&c->reports) && !capture_interrupted
+      && !__atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE)) {
+    timing_sleep(RING_FULL_WAIT);
+  }
+  if (!ring_push(&c->reports, buf, len, c->arrival, c->arrival_realtime)) {
+    metrics_count(METRIC_RING_OVERRUNS, 1);
+  }
+  /* Capture stops at END, so there's nothing to read after it, and the
+   * device may well be gone. */
+  if (control && ctl->cmd == POWERLOG6S_END && FLAGS_autoend
+      && !sessions_enabled()) {
+    return SUCCESS;
+  }
+  return READ_AGAIN;
+}
+
+int write_reports(capture* c) {
+  ring_slot* slot;
+  int rc;
+
+  for (;;) {
+    slot = ring_peek(&c->reports);
+    if (slot) {
+      rc = process_report(c, slot->buf, slot->len, slot->arrival,
+          slot->realtime);
+      ring_release(&c->reports);
+      if (rc != READ_AGAIN) {
+        return rc;
+      }
+    } else if (commit_frames(c) != SUCCESS
+        || output_idle(&c->out) != SUCCESS) {
+      return OUTPUT_ERROR;
+    } else {
+      note_written(c);
+      if (!ring_closed(&c->reports)) {
+        ring_wait(&c->reports, idle_timeout(c, -1));
+      } else if (!ring_peek(&c->reports)) {
+        return c->reader_rc;
+      }
+    }
+  }
+}
+
+/* Writes a message to stderr, prefixed with the device name if there's more
+ * than one device, without other threads' messages getting mixed in. */
+void capture_warn(capture* c, const char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  flockfile(stderr);
+  if (c->name) {
+    fprintf(stderr, "%s: ", c->name);
+  }
+  vfprintf(stderr, format, args);
+  funlockfile(stderr);
+  va_end(args);
+}
+
+int parse_format(char* format) {
+  if (strcmp(format, "csv") == 0) {
+    return FORMAT_CSV;
+  } else if (strcmp(format, "binary") == 0) {
+    return FORMAT_BINARY;
+  } else if (strcmp(format, "columnar") == 0) {
+    return FORMAT_COLUMNAR;
+  } else if (strcmp(format, "delta") == 0) {
+    return FORMAT_DELTA;
+  } else if (strcmp(format, "arrow") == 0) {
+    return FORMAT_ARROW;
+  } else if (strcmp(format, "framed") == 0) {
+    return FORMAT_FRAMED;
+  } else {
+    return -1;
+  }
+}
+
+int print_log(capture* c, powerlog6s* log) {
+  c->records++;
+  c->session.records++;
+  c->last_interval = log->interval;
+  if (checking_continuity() && check_continuity(c, log) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  if (FLAGS_stats) {
+    stats_add(&c->stats, log);
+  }
+  if (decimating()) {
+    return decimator_add(&c->decimate, log) == SUCCESS ? READ_AGAIN
+        : OUTPUT_ERROR;
+  }
+  return write_log(c, log) == SUCCESS ? READ_AGAIN : OUTPUT_ERROR;
+}
+
+/* Writes an entry out in the chosen format. Takes a void* to be usable as a
+ * decimate_emit. */
+int write_log(void* arg, const powerlog6s* log) {
+  capture* c = (capture*) arg;
+  drift_record times;
+  char* line;
+
+  c->out.records++;
+  if (FLAGS_host_time) {
+    drift_correct(&c->drift, log, c->stamp, c->stamp_realtime, &times);
+  }
+  if (c->live.header) {
+    live_publish(&c->live, log);
+  }
+  switch (c->format) {
+    case FORMAT_CSV:
+      line = output_reserve(&c->out, POWERLOG6S_CSV_MAX + DRIFT_CSV_MAX);
+      if (!line) {
+        return OUTPUT_ERROR;
+      }
+      output_commit(&c->out, drift_csv_format_entry(log,
+          FLAGS_host_time ? &times : NULL, line));
+      break;
+    case FORMAT_BINARY:
+      if (output_write(&c->out, log, sizeof(powerlog6s)) != SUCCESS
+          || (FLAGS_host_time && output_write(&c->out, &times,
+          sizeof(drift_record)) != SUCCESS)) {
+        return OUTPUT_ERROR;
+      }
+      break;
+    case FORMAT_COLUMNAR:
+      if (colfile_writer_add(&c->columns, log) != SUCCESS) {
+        return OUTPUT_ERROR;
+      }
+      break;
+    case FORMAT_DELTA:
+      if (delta_encoder_add(&c->delta, log) && write_delta_frame(c)
+          != SUCCESS) {
+        return OUTPUT_ERROR;
+      }
+      break;
+    case FORMAT_ARROW:
+      if (arrow_writer_add(&c->arrow, log) != SUCCESS) {
+        return OUTPUT_ERROR;
+      }
+      break;
+    case FORMAT_FLIGHT:
+      flight_add(&c->flight, log);
+      break;
+    case FORMAT_FRAMED:
+      if (frame_writer_add(&c->frames, log) != SUCCESS) {
+        return OUTPUT_ERROR;
+      }
+      break;
+  }
+  return FLAGS_host_time ? note_pending(c) : SUCCESS;
+}
+
+/* Starts decimating a new log afresh, after writing out what's held back of
+ * the last one. total is the length of the new log if known, else 0. */
+int restart_decimation(capture* c, uint64_t total) {
+  int rc;
+
+  rc = decimator_finish(&c->decimate);
+  if (decimator_init(&c->decimate, total, write_log, c) != SUCCESS) {
+    rc = USER_SUCKS;
+  }
+  return rc;
+}
+
+int write_delta_frame(capture* c) {
+  unsigned char* frame;
+
+  frame = (unsigned char*) output_reserve(&c->out, DELTA_FRAME_MAX);
+  if (!frame) {
+    return OUTPUT_ERROR;
+  }
+  output_commit(&c->out, delta_encoder_frame(&c->delta, frame));
+  return SUCCESS;
+}
+
+/* Writes out a framed block that's waited --frame_commit_ms for more
+ * entries, so it goes out with the next flush rather than sitting in
+ * memory while the device is slow. */
+int commit_frames(capture* c) {
+  if (c->format != FORMAT_FRAMED || c->frames.count == 0
+      || FLAGS_frame_commit_ms == 0 || timing_now() - c->frames.started
+      < FLAGS_frame_commit_ms / 1000.0) {
+    return SUCCESS;
+  }
+  return frame_writer_seal(&c->frames);
+}
+
+/* Milliseconds, at most timeout or -1 for no limit, to wait for a report
+ * before something held back is due to be written out. */
+int idle_timeout(capture* c, int timeout) {
+  double due;
+
+  if (c->out.len > 0 && (timeout < 0 || timeout > IDLE_FLUSH_MS)) {
+    timeout = IDLE_FLUSH_MS;
+  }
+  if (c->format == FORMAT_FRAMED && c->frames.count > 0
+      && FLAGS_frame_commit_ms > 0) {
+    due = (c->frames.started - timing_now()) * 1000 + FLAGS_frame_commit_ms;
+    if (timeout < 0 || due < timeout) {
+      timeout = due > 0 ? (int) due + 1 : 0;
+    }
+  }
+  return timeout;
+}
+
+/* Whether the format can hold the markers of --mark_gaps and --reconnect,
+ * which are records of their own. */
+int writes_markers(capture* c) {
+  return c->format == FORMAT_CSV || c->format == FORMAT_BINARY
+      || c->format == FORMAT_FLIGHT || c->format == FORMAT_FRAMED;
+}
+
+/* Writes whatever a file in the format starts with. */
+int start_format(capture* c) {
+  switch (c->format) {
+    case FORMAT_CSV:
+      if (FLAGS_host_time) {
+        return output_write(&c->out, powerlog6s_csv_columns(),
+            strlen(powerlog6s_csv_columns()) - 1) == SUCCESS
+            ? output_write(&c->out, DRIFT_CSV_COLUMNS,
+            strlen(DRIFT_CSV_COLUMNS)) : OUTPUT_ERROR;
+      }
+      return output_write(&c->out, powerlog6s_csv_columns(),
+          strlen(powerlog6s_csv_columns()));
+    case FORMAT_BINARY:
+      return FLAGS_host_time
+          ? output_write(&c->out, DRIFT_MAGIC, DRIFT_MAGIC_LEN) : SUCCESS;
+    case FORMAT_COLUMNAR:
+      return colfile_writer_init(&c->columns, &c->out, FLAGS_column_block);
+    case FORMAT_DELTA:
+      delta_encoder_init(&c->delta);
+      return output_write(&c->out, DELTA_MAGIC, DELTA_MAGIC_LEN);
+    case FORMAT_ARROW:
+      return arrow_writer_init(&c->arrow, &c->out, FLAGS_column_block);
+    case FORMAT_FLIGHT:
+      return flight_open(&c->flight, c->name ? c->name : "device");
+    case FORMAT_FRAMED:
+      return frame_writer_init(&c->frames, &c->out, FLAGS_frame_records);
+    default:
+      return SUCCESS;
+  }
+}
+
+/* Writes out whatever the format still has buffered. */
+int finish_format(capture* c) {
+  switch (c->format) {
+    case FORMAT_COLUMNAR:
+      return colfile_writer_close(&c->columns);
+    case FORMAT_DELTA:
+      return write_delta_frame(c);
+    case FORMAT_ARROW:
+      return arrow_writer_close(&c->arrow);
+    case FORMAT_FLIGHT:
+      return flight_close(&c->flight);
+    case FORMAT_FRAMED:
+      return frame_writer_close(&c->frames);
+    default:
+      return SUCCESS;
+  }
+}
+
+/* Switches output to the next session's file. */
+int begin_session(capture* c) {
+  if (session_open(&c->session, c->name ? c->name : "device", c->offset,
+      c->out.bytes) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  c->out.fd = c->session.fd;
+  return start_format(c) == SUCCESS ? SUCCESS : OUTPUT_ERROR;
+}
+
+/* Finishes the session's file and records it in the index. */
+int end_session(capture* c, const char* how) {
+  int rc;
+
+  rc = SUCCESS;
+  if (finish_format(c) != SUCCESS || output_flush(&c->out) != SUCCESS
+      || output_drain(&c->out) != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  /* Only --continuity keeps count, so otherwise nothing's known lost. */
+  if (checking_continuity()) {
+    c->session.gaps = c->continuity.gaps;
+    c->session.lost = continuity_lost(&c->continuity);
+  }
+  if (session_close(&c->session, c->name ? c->name : "device", c->out.bytes,
+      how) != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  c->out.fd = -1;
+  return rc;
+}
+
+/* Carries on in the next file once this one has reached --rotate_bytes.
+ * Checked between reports, so files end on a whole entry and run over by
+ * at most one report's worth. */
+int rotate_output(capture* c) {
+  char* path;
+  int rc;
+
+  if (c->out.bytes + c->out.len - c->file_start < FLAGS_rotate_bytes) {
+    return SUCCESS;
+  }
+  rc = SUCCESS;
+  if ((FLAGS_interpret && finish_format(c) != SUCCESS)
+      || output_flush(&c->out) != SUCCESS
+      || output_drain(&c->out) != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  close(c->out.fd);
+  c->rotations++;
+  path = (char*) malloc(strlen(c->path) + 22);
+  if (!path) {
+    perror("Failed to name output file");
+    return OUTPUT_ERROR;
+  }
+  sprintf(path, "%s.%llu", c->path, (unsigned long long) c->rotations);
+  c->out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (c->out.fd < 0) {
+    perror(path);
+    free(path);
+    return OUTPUT_ERROR;
+  }
+  free(path);
+  c->file_start = c->out.bytes;
+  if (FLAGS_interpret && start_format(c) != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  return rc;
+}
+
+int print_raw(capture* c, unsigned char* buf, int len) {
+  int i;
+  if (!FLAGS_binary) {
+    flockfile(stderr);
+    if (c->name) {
+      fprintf(stderr, "%s:", c->name);
+    }
+    for (i = 0; i < len; i++) {
+      fprintf(stderr, " %02x", buf[i]);
+    }
+    fprintf(stderr, "\n");
+    funlockfile(stderr);
+  } else if (output_write(&c->out, buf, len) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  c->out.records++;
+  return READ_AGAIN;
+}
+
+int checking_continuity() {
+  return FLAGS_continuity || FLAGS_mark_gaps;
+}
+
+/* Checks the entry follows on from the last, warning of and marking any gap
+ * before it. */
+int check_continuity(capture* c, const powerlog6s* log) {
+  continuity* k = &c->continuity;
+  powerlog6s gap;
+  uint32_t last;
+
+  last = k->last;
+  switch (continuity_add(k, log)) {
+    case CONTINUITY_GAP:
+      if (k->gaps + k->backwards <= MAX_CONTINUITY_WARNINGS) {
+        capture_warn(c, "%u entries lost between intervals %u and %u.\n",
+            k->gap_missing, last, log->interval);
+      }
+      if (FLAGS_mark_gaps && !decimating()) {
+        powerlog6s_gap(&gap, last, k->gap_missing);
+        return write_log(c, &gap);
+      }
+      return SUCCESS;
+    case CONTINUITY_BACKWARDS:
+      if (k->gaps + k->backwards <= MAX_CONTINUITY_WARNINGS) {
+        capture_warn(c, "Entry at interval %u came after %u.\n",
+            log->interval, last);
+      }
+      return SUCCESS;
+    default:
+      return SUCCESS;
+  }
+}
+
+void print_continuity(capture* c) {
+  continuity_print(&c->continuity, c->name, stderr);
+}
+
+/* Prints and then forgets the statistics of the log so far. */
+void print_stats(capture* c) {
+  stats_print(&c->stats, c->name, stderr);
+  stats_init(&c->stats);
+}
+
+void print_host_time(capture* c) {
+  const metric_histogram* h;
+  double ppm;
+
+  ppm = drift_ppm(&c->drift);
+  h = &c->drift.jitter;
+  if (c->drift.rate > 0) {
+    capture_warn(c, "The device's clock runs %.1f ppm %s of the host's, "
+        "fitted to %llu entries.\n", fabs(ppm), ppm < 0 ? "slow" : "fast",
+        (unsigned long long) c->drift.fitted);
+  } else if (c->drift.fitted > 0) {
+    capture_warn(c, "Too little of a log to tell how the device's clock "
+        "drifts, from %llu entries.\n", (unsigned long long) c->drift.fitted);
+  }
+  if (c->drift.fitted > 0) {
+    capture_warn(c, "Arrivals about the fit: p50 %.1f, p90 %.1f, p99 %.1f, "
+        "max %.1f us.\n", metric_quantile(h, 0.5) / 1e3,
+        metric_quantile(h, 0.9) / 1e3, metric_quantile(h, 0.99) / 1e3,
+        h->max / 1e3);
+  }
+  h = &c->latency;
+  capture_warn(c, "Latency from arriving to written of %llu entries: p50 "
+      "%.1f, p90 %.1f, p99 %.1f, max %.1f us.\n",
+      (unsigned long long) h->count, metric_quantile(h, 0.5) / 1e3,
+      metric_quantile(h, 0.9) / 1e3, metric_quantile(h, 0.99) / 1e3,
+      h->max / 1e3);
+}
+
+void print_read_stats(capture* c) {
+  struct _read_stats* stats = &c->read_stats;
+  double elapsed;
+  double cpu;
+
+  elapsed = timing_now() - c->start;
+  cpu = timing_cpu() - c->start_cpu;
+  capture_warn(c, "Read %llu reports in %llu wakeups (%.1f per wakeup, at "
+      "most %llu), %llu timeouts.\n", (unsigned long long) stats->reports,
+      (unsigned long long) stats->wakeups,
+      stats->wakeups ? (double) stats->reports / stats->wakeups : 0.0,
+      (unsigned long long) stats->max_batch,
+      (unsigned long long) stats->timeouts);
+  capture_warn(c, "%.3f s elapsed, %.3f s waiting for reports, %.3f s CPU "
+      "(%.2f%% of elapsed), %.1f us handling each report.\n",
+      elapsed, stats->waiting, cpu, elapsed > 0 ? 100 * cpu / elapsed : 0.0,
+      stats->reports ? stats->handling / stats->reports * 1e6 : 0.0);
+  if (FLAGS_threaded) {
+    capture_warn(c, "Ring of %llu reports peaked at %llu, %llu overruns.\n",
+        (unsigned long long) c->reports.size,
+        (unsigned long long) c->reports.high_water,
+        (unsigned long long) c->reports.overruns);
+  }
+}
+
+/* Sleeps until the device has something to say, then drains every queued
+ * report before going back to sleep. */
+int read_log(capture* c, int timeout,
+    int (*handle)(capture* c, unsigned char* buf, int len)) {
+  unsigned char buf[USB_BUF_LEN];
+  struct _read_stats* stats = &c->read_stats;
+  uint64_t batch;
+  double start;
+  double woke;
+  int len;
+  int rc;
+
+  if (!c->device) {
+    return DEVICE_MISSING;
+  }
+  metrics_poll();
+  start = timing_now();
+  len = device_read_timeout(c->device, buf, USB_BUF_LEN, timeout);
+  woke = timing_now();
+  stats->waiting += woke - start;
+  note_read(c, len, start);
+  if (len == 0) {
+    stats->timeouts++;
+    return READ_AGAIN;
+  }
+
+  stats->wakeups++;
+  batch = 0;
+  rc = READ_AGAIN;
+  while (len != 0 && rc == READ_AGAIN) {
+    if (len == -1) {
+      capture_warn(c, "Error reading from device: %ls\n",
+          device_error(c->device));
+      rc = DEVICE_ERROR;
+      break;
+    }
+    batch++;
+    rc = handle(c, buf, len);
+    if (rc == READ_AGAIN) {
+      start = metrics_on ? timing_now() : 0;
+      len = device_read_timeout(c->device, buf, USB_BUF_LEN, 0);
+      note_read(c, len, start);
+    }
+  }
+  stats->reports += batch;
+  if (batch > stats->max_batch) {
+    stats->max_batch = batch;
+  }
+  stats->handling += timing_now() - woke;
+  return rc;
+}
+
+/* Closes the device after it failed and looks for it again until it's back,
+ * waiting twice as long after each failed look. Then passes handle a report
+ * of type POWERLOG6S_GAP holding how long that took, which goes through the
+ * ring like any other so the marker lands in order. Returns what handle
+ * does, DEVICE_MISSING after --reconnect_attempts failed looks, or
+ * READ_AGAIN with c->device NULL if capture stopped first, as stopping on
+ * purpose isn't an error. */
+int reconnect(capture* c,
+    int (*handle)(capture* c, unsigned char* buf, int len)) {
+  unsigned char marker[USB_BUF_LEN];
+  log_device* device;
+  double lost;
+  double delay;
+  double offline;
+  uint32_t milliseconds;
+  uint64_t attempts;
+
+  lost = timing_now();
+  device_close(c->device);
+  c->device = NULL;
+  capture_warn(c, "Lost the device, looking for it again.\n");
+  delay = FLAGS_reconnect_delay / 1000.0;
+  for (attempts = 1; ; attempts++) {
+    /* A signal cuts the sleep short. */
+    timing_sleep(delay);
+    if (capture_interrupted
+        || __atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE)) {
+      return READ_AGAIN;
+    }
+    device = reopen_device(c->name);
+    if (device) {
+      break;
+    }
+    if (FLAGS_reconnect_attempts && attempts >= FLAGS_reconnect_attempts) {
+      capture_warn(c, "Gave up on the device after %llu looks over %.3f s.\n",
+          (unsigned long long) attempts, timing_now() - lost);
+      return DEVICE_MISSING;
+    }
+    delay *= 2;
+    if (delay > FLAGS_reconnect_max_delay / 1000.0) {
+      delay = FLAGS_reconnect_max_delay / 1000.0;
+    }
+  }
+  offline = timing_now() - lost;
+  c->device = device;
+  c->reconnects++;
+  c->offline += offline;
+  if (offline > c->max_offline) {
+    c->max_offline = offline;
+  }
+  metrics_count(METRIC_RECONNECTS, 1);
+  capture_warn(c, "Reconnected after %.3f s.\n", offline);
+
+  /* Laid out like a control message, with how long it took as x. */
+  milliseconds = offline * 1000 < UINT32_MAX ? offline * 1000 : UINT32_MAX;
+  memset(marker, 0, sizeof(marker));
+  marker[0] = 7;
+  marker[1] = POWERLOG6S_GAP;
+  memcpy(marker + 3, &milliseconds, sizeof(milliseconds));
+  c->arrival = metrics_on || FLAGS_host_time ? timing_now() : 0;
+  c->arrival_realtime = FLAGS_host_time ? timing_realtime() : 0;
+  return handle(c, marker, USB_BUF_LEN);
+}
+
+/* Writes a marker where the device was lost and found again, after the last
+ * entry before it. Decimation starts afresh, so nothing held back from
+ * before the gap is written after the marker. */
+int mark_reconnect(capture* c, unsigned char* buf) {
+  powerlog6s gap;
+  uint32_t milliseconds;
+
+  milliseconds = 0;
+  if (buf[0] >= 7) {
+    memcpy(&milliseconds, buf + 3, sizeof(milliseconds));
+  }
+  if (!writes_markers(c) || (sessions_enabled() && !c->session.open)) {
+    return READ_AGAIN;
+  }
+  if (decimating() && restart_decimation(c, 0) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  powerlog6s_reconnect(&gap, c->last_interval, milliseconds);
+  return write_log(c, &gap) == SUCCESS ? READ_AGAIN : OUTPUT_ERROR;
+}
+
+/* Counts a read that began at start, and notes when what it returned
+ * arrived, by both clocks with --host_time. */
+void note_read(capture* c, int len, double start) {
+  if (metrics_on) {
+    c->arrival = metrics_observe(METRIC_READ, start);
+    metrics_count(METRIC_READS, 1);
+    if (len == 0) {
+      metrics_count(METRIC_READ_EMPTY, 1);
+    } else if (len < 0) {
+      metrics_count(METRIC_READ_ERRORS, 1);
+    }
+  } else if (FLAGS_host_time && len > 0) {
+    c->arrival = timing_now();
+  }
+  if (FLAGS_host_time && len > 0) {
+    c->arrival_realtime = timing_realtime();
+  }
+}
+
+/* Handles a report as soon as it's read, without --threaded. */
+int decode_report(capture* c, unsigned char* buf, int len) {
+  return process_report(c, buf, len, c->arrival, c->arrival_realtime);
+}
+
+/* Interprets a report that arrived at arrival, or realtime by the realtime
+ * clock, timing it for --metrics, then rotates output if it's due. */
+int process_report(capture* c, unsigned char* buf, int len, double arrival,
+    double realtime) {
+  int rc;
+
+  c->stamp = arrival;
+  c->stamp_realtime = realtime;
+  if (!metrics_on) {
+    rc = interpret_report(c, buf, len);
+    c->offset += len;
+  } else {
+    rc = time_report(c, buf, len, arrival);
+  }
+  if (rc == READ_AGAIN && c->path && FLAGS_rotate_bytes > 0
+      && rotate_output(c) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  return rc;
+}
+
+/* Interprets a report, adding how long it took to --metrics. */
+int time_report(capture* c, unsigned char* buf, int len, double arrival) {
+  uint64_t records;
+  double start;
+  int rc;
+
+  records = c->records;
+  start = timing_now();
+  rc = interpret_report(c, buf, len);
+  c->offset += len;
+  metrics_observe(METRIC_DECODE, start);
+  metrics_count(METRIC_REPORTS, 1);
+  if (c->records != records) {
+    metrics_count(METRIC_RECORDS, 1);
+    /* Writing this entry may have forced out the ones before it. */
+    note_written(c);
+    if (c->unwritten == 0) {
+      c->unwritten = arrival;
+      c->unwritten_writes = c->out.writes;
+    }
+  }
+  return rc;
+}
+
+/* Once output has been written since the oldest entry waiting to be was
+ * buffered, counts how long that entry took from arriving to being
+ * written. */
+void note_written(capture* c) {
+  double now;
+  uint64_t i;
+
+  if (c->unwritten > 0 && c->out.writes != c->unwritten_writes) {
+    metrics_observe(METRIC_LATENCY, c->unwritten);
+    c->unwritten = 0;
+  }
+  if (c->npending > 0 && c->out.writes != c->pending_writes) {
+    now = timing_now();
+    for (i = 0; i < c->npending; i++) {
+      metric_histogram_add(&c->latency, now > c->pending[i]
+          ? (uint64_t) ((now - c->pending[i]) * 1e9) : 0);
+    }
+    c->npending = 0;
+  }
+}
+
+/* Notes when the entry just buffered arrived, for --host_time to count how
+ * long every entry takes to be written, after counting those written by
+ * buffering it. */
+int note_pending(capture* c) {
+  double* pending;
+  uint64_t cap;
+
+  note_written(c);
+  if (c->npending == c->pending_cap) {
+    cap = c->pending_cap ? 2 * c->pending_cap : 1024;
+    pending = (double*) realloc(c->pending, cap * sizeof(double));
+    if (!pending) {
+      perror("Failed to allocate arrival times");
+      return OUTPUT_ERROR;
+    }
+    c->pending = pending;
+    c->pending_cap = cap;
+  }
+  if (c->npending == 0) {
+    c->pending_writes = c->out.writes;
+  }
+  c->pending[c->npending++] = c->stamp;
+  return SUCCESS;
+}
+
+int interpret_report(capture* c, unsigned char* buf, int len) {
+  powerlog6s_base* base = (powerlog6s_base*) buf;
+  powerlog6s* log = (powerlog6s*) buf;
+  powerlog6s_ctl* ctl = (powerlog6s_ctl*) buf;
+  uint32_t lines;
+  uint32_t interval;
+
+  if (!FLAGS_interpret) {
+    return print_raw(c, buf, len);
+  } else if (base->len < 2) {
+    c->errors++;
+    metrics_count(METRIC_SHORT, 1);
+    capture_warn(c, "Unexpectedly short %u byte message.\n", base->len);
+    return READ_AGAIN;
+  } else if (base->type == POWERLOG6S_GAP) {
+    /* Only ever made by reconnect(), or replayed from a raw dump of it. */
+    return mark_reconnect(c, buf);
+  } else if (base->len >= 3 && base->type == POWERLOG6S_CONTROL) {
+    c->controls++;
+    metrics_count(METRIC_CONTROLS, 1);
+    switch (ctl->cmd) {
+      case POWERLOG6S_START:
+        /* A log that never saw its end still gets its summary. */
+        if (FLAGS_stats && c->stats.records > 0) {
+          print_stats(c);
+        }
+        if (checking_continuity() && c->continuity.entries > 0) {
+          print_continuity(c);
+        }
+        /* x is the number of lines to come and y the interval, each sent
+         * as 32 bits. */
+        lines = 0;
+        interval = 0;
+        if (ctl->len >= 7) {
+          memcpy(&lines, buf + 3, sizeof(lines));
+        }
+        if (ctl->len >= 11) {
+          memcpy(&interval, buf + 7, sizeof(interval));
+        }
+        if (decimating() && restart_decimation(c, lines) != SUCCESS) {
+          return OUTPUT_ERROR;
+        }
+        if (sessions_enabled()) {
+          if (c->session.open && end_session(c, "cut") != SUCCESS) {
+            return OUTPUT_ERROR;
+          }
+          if (begin_session(c) != SUCCESS) {
+            return OUTPUT_ERROR;
+          }
+          c->session.lines = lines;
+          c->session.interval = interval;
+        }
+        continuity_init(&c->continuity, lines, interval);
+        return READ_AGAIN;
+      case POWERLOG6S_MID:
+        /* x is the interval, which may not have come with the START. */
+        if (c->session.open && ctl->len >= 7) {
+          memcpy(&c->session.interval, buf + 3, sizeof(uint32_t));
+        }
+        return READ_AGAIN;
+      case POWERLOG6S_END:
+        if (FLAGS_stats) {
+          print_stats(c);
+        }
+        if (checking_continuity()) {
+          print_continuity(c);
+        }
+        if (decimating() && restart_decimation(c, 0) != SUCCESS) {
+          return OUTPUT_ERROR;
+        }
+        if (c->session.open && end_session(c, "end") != SUCCESS) {
+          return OUTPUT_ERROR;
+        }
+        continuity_init(&c->continuity, 0, 0);
+        if (sessions_enabled()) {
+          /* Keep going for the next session. */
+          return READ_AGAIN;
+        } else if (FLAGS_autoend) {
+          return SUCCESS;
+        } else {
+          return READ_AGAIN;
+        }
+      default:
+        c->errors++;
+        metrics_count(METRIC_UNEXPECTED_CONTROL, 1);
+        capture_warn(c, "Unexpected control line cmd 0x%02x len %u.\n",
+            ctl->cmd, ctl->len);
+        return READ_AGAIN;
+    }
+  } else if (base->len >= 2 && base->type != POWERLOG6S_ONLINE
+      && base->type != POWERLOG6S_OFFLINE) {
+    c->errors++;
+    metrics_count(METRIC_UNEXPECTED_TYPE, 1);
+    capture_warn(c, "Unexpected %u byte message of type %u.\n",
+        log->len, log->type);
+    return READ_AGAIN;
+  } else if (log->len != sizeof(powerlog6s)) {
+    c->errors++;
+    metrics_count(METRIC_BAD_LENGTH, 1);
+    capture_warn(c, "Expected %zu byte log entry but got %u bytes "
+        "(%u read).\n", sizeof(powerlog6s), log->len, len);
+    return BAD_MESSAGE_LENGTH;
+  } else if (sessions_enabled() && !c->session.open
+      && begin_session(c) != SUCCESS) {
+    /* Entries without a START, as when logging online, still get a
+     * session. */
+    return OUTPUT_ERROR;
+  } else {
+    return print_log(c, log);
+  }
+}
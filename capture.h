@@ -0,0 +1,131 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Capture of log data from one device: reading reports, interpreting them
+ * and writing the result out. Each capture has its own output and counters,
+ * so several can run side by side on their own threads.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "arrow.h"
+#include "colfile.h"
+#include "continuity.h"
+#include "decimate.h"
+#include "delta.h"
+#include "device.h"
+#include "drift.h"
+#include "flags.h"
+#include "flight.h"
+#include "frame.h"
+#include "live.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "ring.h"
+#include "session.h"
+#include "stats.h"
+
+#define USB_BUF_LEN 64
+
+/* Ways of writing out interpreted log entries, see --format. */
+#define FORMAT_CSV 0
+#define FORMAT_BINARY 1
+#define FORMAT_COLUMNAR 2
+#define FORMAT_DELTA 3
+#define FORMAT_ARROW 4
+#define FORMAT_FLIGHT 5 /* --flight_recorder rather than output */
+#define FORMAT_FRAMED 6
+
+DECLARE_bool(interpret);
+DECLARE_string(format);
+DECLARE_uint64(column_block);
+DECLARE_uint64(rotate_bytes);
+
+struct _read_stats {
+  uint64_t wakeups; /* waits that ended with a report */
+  uint64_t timeouts; /* waits that ended with nothing */
+  uint64_t reports;
+  uint64_t max_batch; /* most reports drained in one wakeup */
+  double waiting; /* seconds spent blocked waiting for reports */
+  double handling; /* seconds spent handling reports after waking */
+};
+
+struct _capture {
+  char* name; /* identifies the device in messages, NULL if there's only one */
+  log_device* device; /* replaced by --reconnect, NULL while it's lost */
+  int format;
+  output out;
+  colfile_writer columns; /* only used with FORMAT_COLUMNAR */
+  delta_encoder delta; /* only used with FORMAT_DELTA */
+  arrow_writer arrow; /* only used with FORMAT_ARROW */
+  flight flight; /* only used with FORMAT_FLIGHT */
+  frame_writer frames; /* only used with FORMAT_FRAMED */
+  live live; /* only used with --publish */
+  stats stats; /* of the current log, only kept with --stats */
+  decimator decimate; /* only used with --decimate */
+  continuity continuity; /* of the current log, only with --continuity */
+  session session; /* only used with --session_pattern */
+  struct _read_stats read_stats;
+  uint64_t records; /* log entries written out */
+  uint64_t controls; /* control messages seen */
+  uint64_t errors; /* malformed or unexpected messages */
+  uint64_t offset; /* bytes of reports handled */
+  char* path; /* of the output, if it can be rotated */
+  uint64_t file_start; /* out.bytes when the current file began */
+  uint64_t rotations;
+  uint32_t last_interval; /* of the last entry */
+  uint64_t reconnects; /* with --reconnect */
+  double offline; /* seconds spent reconnecting */
+  double max_offline;
+  double start;
+  double start_cpu;
+  int rc; /* result of capture_run() */
+
+  /* Only used with --metrics or --host_time. */
+  double arrival; /* when the report being handled was read */
+
+  /* Only used with --metrics. */
+  double unwritten; /* when the oldest entry not yet written arrived, or 0 */
+  uint64_t unwritten_writes; /* out.writes when that entry was buffered */
+
+  /* Only used with --host_time. */
+  double arrival_realtime; /* as arrival, by timing_realtime() */
+  double stamp; /* when the report being handled was read, by timing_now() */
+  double stamp_realtime;
+  drift drift;
+  double* pending; /* when each entry buffered since pending_writes arrived */
+  uint64_t npending;
+  uint64_t pending_cap;
+  uint64_t pending_writes; /* out.writes when they started being buffered */
+  metric_histogram latency; /* of each entry, from arriving to written */
+
+  /* Only used with --threaded. */
+  ring reports;
+  int reader_rc;
+  int stopping;
+};
+
+typedef struct _capture capture;
+
+/* Set from signal handlers to have every capture wind up cleanly. */
+extern volatile sig_atomic_t capture_interrupted;
+
+void fregister_capture();
+
+/* Prepares to capture from device into fd, writing the CSV header if
+ * needed. Returns SUCCESS or an error code from rc.h. */
+int capture_init(capture* c, char* name, log_device* device, int fd);
+/* Captures until the log ends, an error occurs or capture_interrupted is
+ * set. Returns, and also stores in c->rc, SUCCESS or an error code. */
+int capture_run(capture* c);
+void* capture_thread(void* c);
+/* Flushes output and prints any requested statistics. Doesn't close the
+ * device or the output's file descriptor. */
+void capture_finish(capture* c);
+void capture_summary(capture* c);
+
+#endif  /* CAPTURE_H_ */
@@ -0,0 +1,711 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Columnar capture files. Values are stored in host byte order, which is
+ * little endian everywhere powerup runs, the same as the device's own.
+ *
+ * Each block is summarized as it's written, while its columns are still in
+ * the cache, and the rest of the summary tree is built from those when the
+ * file is closed, as the index is kept until then anyway.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rc.h"
+
+#include "colfile.h"
+
+#define COLFILE_HEADER_LEN 16
+#define COLFILE_TRAILER_LEN 32
+#define PAD8(n) (((n) + 7) & ~(uint64_t) 7)
+/* Bytes before the nodes of the summary tree: fanout and levels. */
+#define COLFILE_SUMMARY_LEN 8
+
+/* Folds rows from up to to of column j, of the given type, into lo, hi and
+ * sum, in one tight loop per type. */
+#define SUMMARIZE(type) \
+  for (i = from; i < to; i++) { \
+    v = (int64_t) ((const type*) columns[j])[i]; \
+    lo = v < lo ? v : lo; \
+    hi = v > hi ? v : hi; \
+    sum += v; \
+  }
+
+/* Wrapping from above this back to below kWrapLow is taken as the 32 bit
+ * millisecond counter overflowing, rather than a new log starting. */
+const uint32_t kWrapHigh = 0xf0000000u;
+const uint32_t kWrapLow = 0x10000000u;
+
+const unsigned char kZeros[8] = { 0 };
+
+/* As in the CSV header, with the units as logged. */
+const char* kColfileNames[COL_COUNT] = {
+  "time",
+  "interval",
+  "type",
+  "state",
+  "current",
+  "voltage",
+  "energy",
+  "cell1",
+  "cell2",
+  "cell3",
+  "cell4",
+  "cell5",
+  "cell6",
+  "rpm",
+  "internal_temp",
+  "temp2",
+  "temp3",
+  "temp4",
+  "period",
+  "pulse"
+};
+
+const char* kColfileUnits[COL_COUNT] = {
+  "ms",
+  "ms",
+  NULL,
+  NULL,
+  "cA",
+  "cV",
+  "mAh",
+  "mV",
+  "mV",
+  "mV",
+  "mV",
+  "mV",
+  "mV",
+  NULL,
+  "ddC",
+  "ddC",
+  "ddC",
+  "ddC",
+  NULL,
+  NULL
+};
+
+uint64_t colfile_block_bytes(uint64_t count);
+int colfile_flush_block(colfile_writer* w);
+uint64_t colfile_tree_nodes(uint64_t blocks, uint32_t fanout,
+    uint32_t* levels);
+void colfile_build_tree(colfile_summary* nodes, uint64_t blocks,
+    uint32_t fanout);
+void colfile_set_levels(colfile* f, const colfile_summary* nodes);
+int colfile_open_summaries(colfile* f, const char* path, uint64_t offset);
+int colfile_build_summaries(colfile* f);
+uint64_t aggregate_node(const colfile* f, uint32_t level, uint64_t node,
+    uint64_t from, uint64_t to, colfile_summary* s);
+uint64_t match_node(const colfile* f, uint32_t level, uint64_t node,
+    uint64_t span, uint64_t block, colfile_match match, void* arg);
+
+size_t colfile_width(int column) {
+  switch (column) {
+    case COL_TIME:
+      return 8;
+    case COL_INTERVAL:
+    case COL_ENERGY:
+      return 4;
+    case COL_TYPE:
+    case COL_STATE:
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+int colfile_signed(int column) {
+  switch (column) {
+    case COL_CURRENT:
+    case COL_INTERNAL_TEMPERATURE:
+      return 1;
+    default:
+      return (column >= COL_CELL1 && column <= COL_CELL6)
+          || (column >= COL_TEMPERATURE1 && column <= COL_TEMPERATURE3);
+  }
+}
+
+void colfile_clock_init(colfile_clock* clock) {
+  memset(clock, 0, sizeof(colfile_clock));
+}
+
+uint64_t colfile_clock_time(colfile_clock* clock, uint32_t interval) {
+  if (clock->started && interval < clock->last) {
+    if (clock->last >= kWrapHigh && interval < kWrapLow) {
+      clock->base += (uint64_t) 1 << 32;
+    } else {
+      /* Restarted, so carry on from where the last log left off. */
+      clock->base += clock->last - interval;
+    }
+  }
+  clock->started = 1;
+  clock->last = interval;
+  return clock->base + interval;
+}
+
+int colfile_writer_init(colfile_writer* w, output* out, uint32_t block_size) {
+  unsigned char header[COLFILE_HEADER_LEN];
+  uint32_t version = COLFILE_VERSION;
+  int i;
+
+  memset(w, 0, sizeof(colfile_writer));
+  w->out = out;
+  w->block_size = block_size;
+  colfile_clock_init(&w->clock);
+  for (i = 0; i < COL_COUNT; i++) {
+    w->columns[i] = (unsigned char*) malloc(block_size * colfile_width(i));
+    if (!w->columns[i]) {
+      perror("Failed to allocate column buffers");
+      return OUTPUT_ERROR;
+    }
+  }
+
+  memcpy(header, COLFILE_MAGIC, 8);
+  memcpy(header + 8, &version, 4);
+  memcpy(header + 12, &block_size, 4);
+  w->offset = COLFILE_HEADER_LEN;
+  return output_write(out, header, COLFILE_HEADER_LEN);
+}
+
+int colfile_writer_add(colfile_writer* w, const powerlog6s* log) {
+  colfile_transpose(w->columns, w->count,
+      colfile_clock_time(&w->clock, log->interval), log);
+  w->records++;
+  if (++w->count == w->block_size) {
+    return colfile_flush_block(w);
+  }
+  return SUCCESS;
+}
+
+void colfile_transpose(unsigned char** columns, uint32_t n, uint64_t time,
+    const powerlog6s* log) {
+  int i;
+
+  ((uint64_t*) columns[COL_TIME])[n] = time;
+  ((uint32_t*) columns[COL_INTERVAL])[n] = log->interval;
+  columns[COL_TYPE][n] = log->type;
+  columns[COL_STATE][n] = log->state;
+  ((int16_t*) columns[COL_CURRENT])[n] = log->current;
+  ((uint16_t*) columns[COL_VOLTAGE])[n] = log->voltage;
+  ((uint32_t*) columns[COL_ENERGY])[n] = log->energy;
+  for (i = 0; i < 6; i++) {
+    ((int16_t*) columns[COL_CELL1 + i])[n] = log->cell[i];
+  }
+  ((uint16_t*) columns[COL_RPM])[n] = log->rpm;
+  ((int16_t*) columns[COL_INTERNAL_TEMPERATURE])[n] =
+      log->internal_temperature;
+  for (i = 0; i < 3; i++) {
+    ((int16_t*) columns[COL_TEMPERATURE1 + i])[n] = log->temperature[i];
+  }
+  ((uint16_t*) columns[COL_PERIOD])[n] = log->period;
+  ((uint16_t*) columns[COL_PULSE])[n] = log->pulse;
+}
+
+int colfile_writer_close(colfile_writer* w) {
+  unsigned char trailer[COLFILE_TRAILER_LEN];
+  unsigned char summary[COLFILE_SUMMARY_LEN];
+  colfile_summary* tree;
+  uint32_t fanout = COLFILE_FANOUT;
+  uint32_t levels;
+  uint64_t nodes;
+  int rc;
+  int i;
+
+  rc = SUCCESS;
+  if (w->count > 0) {
+    rc = colfile_flush_block(w);
+  }
+  nodes = colfile_tree_nodes(w->blocks, fanout, &levels);
+  if (rc == SUCCESS && nodes > w->blocks) {
+    tree = (colfile_summary*) realloc(w->summaries,
+        nodes * sizeof(colfile_summary));
+    if (!tree) {
+      perror("Failed to allocate summaries");
+      rc = OUTPUT_ERROR;
+    } else {
+      w->summaries = tree;
+      colfile_build_tree(w->summaries, w->blocks, fanout);
+    }
+  }
+  if (rc == SUCCESS) {
+    memcpy(summary, &fanout, 4);
+    memcpy(summary + 4, &levels, 4);
+    memcpy(trailer, &w->offset, 8);
+    memcpy(trailer + 8, &w->blocks, 8);
+    memcpy(trailer + 16, &w->records, 8);
+    memcpy(trailer + 24, COLFILE_MAGIC, 8);
+    rc = output_write(w->out, w->index,
+        w->blocks * sizeof(colfile_index_entry));
+  }
+  if (rc == SUCCESS) {
+    rc = output_write(w->out, summary, COLFILE_SUMMARY_LEN);
+  }
+  if (rc == SUCCESS) {
+    rc = output_write(w->out, w->summaries, nodes * sizeof(colfile_summary));
+  }
+  if (rc == SUCCESS) {
+    rc = output_write(w->out, trailer, COLFILE_TRAILER_LEN);
+  }
+  for (i = 0; i < COL_COUNT; i++) {
+    free(w->columns[i]);
+    w->columns[i] = NULL;
+  }
+  free(w->index);
+  w->index = NULL;
+  free(w->summaries);
+  w->summaries = NULL;
+  return rc;
+}
+
+int colfile_flush_block(colfile_writer* w) {
+  colfile_index_entry* entry;
+  colfile_index_entry* grown;
+  colfile_summary* summaries;
+  uint64_t bytes;
+  int i;
+
+  if (w->blocks == w->index_cap) {
+    w->index_cap = w->index_cap ? 2 * w->index_cap : 64;
+    grown = (colfile_index_entry*) realloc(w->index,
+        w->index_cap * sizeof(colfile_index_entry));
+    if (grown) {
+      w->index = grown;
+    }
+    summaries = (colfile_summary*) realloc(w->summaries,
+        w->index_cap * sizeof(colfile_summary));
+    if (summaries) {
+      w->summaries = summaries;
+    }
+    if (!grown || !summaries) {
+      perror("Failed to grow block index");
+      return OUTPUT_ERROR;
+    }
+  }
+  colfile_summary_init(&w->summaries[w->blocks]);
+  colfile_summarize((const void* const*) w->columns, 0, w->count,
+      &w->summaries[w->blocks]);
+  entry = &w->index[w->blocks++];
+  entry->offset = w->offset;
+  entry->count = w->count;
+  entry->first_time = ((uint64_t*) w->columns[COL_TIME])[0];
+  entry->last_time = ((uint64_t*) w->columns[COL_TIME])[w->count - 1];
+
+  for (i = 0; i < COL_COUNT; i++) {
+    bytes = w->count * colfile_width(i);
+    if (output_write(w->out, w->columns[i], bytes) != SUCCESS
+        || output_write(w->out, kZeros, PAD8(bytes) - bytes) != SUCCESS) {
+      return OUTPUT_ERROR;
+    }
+  }
+  w->offset += colfile_block_bytes(w->count);
+  w->count = 0;
+  return SUCCESS;
+}
+
+uint64_t colfile_block_bytes(uint64_t count) {
+  uint64_t bytes;
+  int i;
+
+  bytes = 0;
+  for (i = 0; i < COL_COUNT; i++) {
+    bytes += PAD8(count * colfile_width(i));
+  }
+  return bytes;
+}
+
+int colfile_open(colfile* f, const char* path) {
+  struct stat st;
+  const unsigned char* trailer;
+  uint64_t index_offset;
+  uint64_t i;
+  void* map;
+  int fd;
+
+  memset(f, 0, sizeof(colfile));
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return DEVICE_MISSING;
+  }
+  if (st.st_size < COLFILE_HEADER_LEN + COLFILE_TRAILER_LEN) {
+    fprintf(stderr, "%s is too short to be a columnar capture.\n", path);
+    close(fd);
+    return BAD_MESSAGE_LENGTH;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return DEVICE_ERROR;
+  }
+  f->map = (const unsigned char*) map;
+  f->size = st.st_size;
+
+  trailer = f->map + f->size - COLFILE_TRAILER_LEN;
+  memcpy(&index_offset, trailer, 8);
+  memcpy(&f->blocks, trailer + 8, 8);
+  memcpy(&f->records, trailer + 16, 8);
+  memcpy(&f->block_size, f->map + 12, 4);
+  if (memcmp(f->map, COLFILE_MAGIC, 8) != 0
+      || memcmp(trailer + 24, COLFILE_MAGIC, 8) != 0
+      || index_offset < COLFILE_HEADER_LEN || index_offset % 8 != 0
+      || index_offset > f->size - COLFILE_TRAILER_LEN
+      || f->blocks > (f->size - COLFILE_TRAILER_LEN - index_offset)
+          / sizeof(colfile_index_entry)) {
+    fprintf(stderr, "%s is not a complete columnar capture.\n", path);
+    colfile_close(f);
+    return BAD_MESSAGE_LENGTH;
+  }
+  f->index = (const colfile_index_entry*) (f->map + index_offset);
+  for (i = 0; i < f->blocks; i++) {
+    if (f->index[i].offset > index_offset
+        || f->index[i].count > index_offset
+        || colfile_block_bytes(f->index[i].count)
+            > index_offset - f->index[i].offset) {
+      fprintf(stderr, "%s has a corrupt block index.\n", path);
+      colfile_close(f);
+      return BAD_MESSAGE_LENGTH;
+    }
+  }
+  memcpy(&f->version, f->map + 8, 4);
+  if (f->version > COLFILE_VERSION) {
+    fprintf(stderr, "%s is a newer columnar capture than this reads.\n",
+        path);
+    colfile_close(f);
+    return BAD_MESSAGE_LENGTH;
+  }
+  return f->version >= 2 ? colfile_open_summaries(f, path,
+      index_offset + f->blocks * sizeof(colfile_index_entry))
+      : colfile_build_summaries(f);
+}
+
+/* Finds the summary tree written after the index, at offset. */
+int colfile_open_summaries(colfile* f, const char* path, uint64_t offset) {
+  uint32_t levels;
+  uint64_t nodes;
+  uint64_t room;
+
+  room = f->size - COLFILE_TRAILER_LEN - offset;
+  if (room >= COLFILE_SUMMARY_LEN) {
+    memcpy(&f->fanout, f->map + offset, 4);
+    memcpy(&f->levels, f->map + offset + 4, 4);
+    room -= COLFILE_SUMMARY_LEN;
+  }
+  nodes = f->fanout >= 2 ? colfile_tree_nodes(f->blocks, f->fanout, &levels)
+      : 0;
+  if (f->fanout < 2 || levels != f->levels
+      || nodes > room / sizeof(colfile_summary)) {
+    fprintf(stderr, "%s has a corrupt summary tree.\n", path);
+    colfile_close(f);
+    return BAD_MESSAGE_LENGTH;
+  }
+  colfile_set_levels(f, (const colfile_summary*) (f->map + offset
+      + COLFILE_SUMMARY_LEN));
+  return SUCCESS;
+}
+
+/* Summarizes every block of a file written before there were summaries. */
+int colfile_build_summaries(colfile* f) {
+  colfile_block b;
+  uint64_t nodes;
+  uint64_t i;
+
+  f->fanout = COLFILE_FANOUT;
+  nodes = colfile_tree_nodes(f->blocks, f->fanout, &f->levels);
+  if (nodes == 0) {
+    return SUCCESS;
+  }
+  f->built = (colfile_summary*) malloc(nodes * sizeof(colfile_summary));
+  if (!f->built) {
+    perror("Failed to allocate summaries");
+    colfile_close(f);
+    return USER_SUCKS;
+  }
+  for (i = 0; i < f->blocks; i++) {
+    colfile_block_at(f, i, &b);
+    colfile_summary_init(&f->built[i]);
+    colfile_summarize(b.columns, 0, b.count, &f->built[i]);
+  }
+  colfile_build_tree(f->built, f->blocks, f->fanout);
+  colfile_set_levels(f, f->built);
+  return SUCCESS;
+}
+
+void colfile_close(colfile* f) {
+  if (f->map) {
+    munmap((void*) f->map, f->size);
+  }
+  free(f->built);
+  memset(f, 0, sizeof(colfile));
+}
+
+void colfile_block_at(const colfile* f, uint64_t block, colfile_block* b) {
+  const unsigned char* p;
+  int i;
+
+  b->count = f->index[block].count;
+  p = f->map + f->index[block].offset;
+  for (i = 0; i < COL_COUNT; i++) {
+    b->columns[i] = p;
+    p += PAD8(b->count * colfile_width(i));
+  }
+}
+
+uint64_t colfile_find_block(const colfile* f, uint64_t time) {
+  uint64_t lo = 0;
+  uint64_t hi = f->blocks;
+  uint64_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (f->index[mid].last_time < time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+uint64_t colfile_find_record(const colfile_block* b, uint64_t time) {
+  const uint64_t* times = (const uint64_t*) b->columns[COL_TIME];
+  uint64_t lo = 0;
+  uint64_t hi = b->count;
+  uint64_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (times[mid] < time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void colfile_record(const colfile_block* b, uint64_t i, powerlog6s* log) {
+  int j;
+
+  log->len = sizeof(powerlog6s);
+  log->type = ((const uint8_t*) b->columns[COL_TYPE])[i];
+  log->interval = ((const uint32_t*) b->columns[COL_INTERVAL])[i];
+  log->state = ((const uint8_t*) b->columns[COL_STATE])[i];
+  log->current = ((const int16_t*) b->columns[COL_CURRENT])[i];
+  log->voltage = ((const uint16_t*) b->columns[COL_VOLTAGE])[i];
+  log->energy = ((const uint32_t*) b->columns[COL_ENERGY])[i];
+  for (j = 0; j < 6; j++) {
+    log->cell[j] = ((const int16_t*) b->columns[COL_CELL1 + j])[i];
+  }
+  log->rpm = ((const uint16_t*) b->columns[COL_RPM])[i];
+  log->internal_temperature =
+      ((const int16_t*) b->columns[COL_INTERNAL_TEMPERATURE])[i];
+  for (j = 0; j < 3; j++) {
+    log->temperature[j] =
+        ((const int16_t*) b->columns[COL_TEMPERATURE1 + j])[i];
+  }
+  log->period = ((const uint16_t*) b->columns[COL_PERIOD])[i];
+  log->pulse = ((const uint16_t*) b->columns[COL_PULSE])[i];
+}
+
+void colfile_summary_init(colfile_summary* s) {
+  int j;
+
+  s->count = 0;
+  for (j = 0; j < COL_COUNT; j++) {
+    s->min[j] = INT64_MAX;
+    s->max[j] = INT64_MIN;
+    s->sum[j] = 0;
+  }
+}
+
+void colfile_summarize(const void* const* columns, uint64_t from, uint64_t to,
+    colfile_summary* s) {
+  int64_t lo;
+  int64_t hi;
+  int64_t sum;
+  int64_t v;
+  uint64_t i;
+  int j;
+
+  if (from >= to) {
+    return;
+  }
+  for (j = 0; j < COL_COUNT; j++) {
+    lo = s->min[j];
+    hi = s->max[j];
+    sum = 0;
+    if (colfile_signed(j)) {
+      SUMMARIZE(int16_t)
+    } else if (colfile_width(j) == 8) {
+      SUMMARIZE(uint64_t)
+    } else if (colfile_width(j) == 4) {
+      SUMMARIZE(uint32_t)
+    } else if (colfile_width(j) == 2) {
+      SUMMARIZE(uint16_t)
+    } else {
+      SUMMARIZE(uint8_t)
+    }
+    s->min[j] = lo;
+    s->max[j] = hi;
+    s->sum[j] += sum;
+  }
+  s->count += to - from;
+}
+
+void colfile_summary_merge(colfile_summary* s, const colfile_summary* t) {
+  int j;
+
+  for (j = 0; j < COL_COUNT; j++) {
+    s->min[j] = t->min[j] < s->min[j] ? t->min[j] : s->min[j];
+    s->max[j] = t->max[j] > s->max[j] ? t->max[j] : s->max[j];
+    s->sum[j] += t->sum[j];
+  }
+  s->count += t->count;
+}
+
+/* Counts the nodes of every level of a tree over blocks, and the levels. */
+uint64_t colfile_tree_nodes(uint64_t blocks, uint32_t fanout,
+    uint32_t* levels) {
+  uint64_t nodes;
+  uint64_t n;
+
+  nodes = 0;
+  *levels = 0;
+  for (n = blocks; n > 0; n = (n + fanout - 1) / fanout) {
+    nodes += n;
+    (*levels)++;
+    if (n == 1) {
+      break;
+    }
+  }
+  return nodes;
+}
+
+/* Fills in every level above the first, which has a node per block. */
+void colfile_build_tree(colfile_summary* nodes, uint64_t blocks,
+    uint32_t fanout) {
+  colfile_summary* below;
+  colfile_summary* above;
+  uint64_t n;
+  uint64_t i;
+
+  below = nodes;
+  for (n = blocks; n > 1; n = (n + fanout - 1) / fanout) {
+    above = below + n;
+    for (i = 0; i < n; i++) {
+      if (i % fanout == 0) {
+        colfile_summary_init(&above[i / fanout]);
+      }
+      colfile_summary_merge(&above[i / fanout], &below[i]);
+    }
+    below = above;
+  }
+}
+
+void colfile_set_levels(colfile* f, const colfile_summary* nodes) {
+  uint64_t n;
+  uint32_t l;
+
+  n = f->blocks;
+  for (l = 0; l < f->levels; l++) {
+    f->level[l] = nodes;
+    f->nodes[l] = n;
+    nodes += n;
+    n = (n + f->fanout - 1) / f->fanout;
+  }
+}
+
+uint64_t colfile_aggregate(const colfile* f, uint64_t from, uint64_t to,
+    colfile_summary* s) {
+  if (f->levels == 0) {
+    return 0;
+  }
+  return aggregate_node(f, f->levels - 1, 0, from, to, s);
+}
+
+uint64_t aggregate_node(const colfile* f, uint32_t level, uint64_t node,
+    uint64_t from, uint64_t to, colfile_summary* s) {
+  const colfile_summary* n = &f->level[level][node];
+  colfile_block b;
+  uint64_t child;
+  uint64_t end;
+  uint64_t read;
+
+  if (n->count == 0 || (uint64_t) n->max[COL_TIME] < from
+      || (uint64_t) n->min[COL_TIME] > to) {
+    return 0;
+  } else if ((uint64_t) n->min[COL_TIME] >= from
+      && (uint64_t) n->max[COL_TIME] <= to) {
+    colfile_summary_merge(s, n);
+    return 0;
+  } else if (level == 0) {
+    colfile_block_at(f, node, &b);
+    colfile_summarize(b.columns, colfile_find_record(&b, from),
+        to == UINT64_MAX ? b.count : colfile_find_record(&b, to + 1), s);
+    return 1;
+  }
+  read = 0;
+  end = (node + 1) * f->fanout;
+  if (end > f->nodes[level - 1]) {
+    end = f->nodes[level - 1];
+  }
+  for (child = node * f->fanout; child < end; child++) {
+    read += aggregate_node(f, level - 1, child, from, to, s);
+  }
+  return read;
+}
+
+uint64_t colfile_next_match(const colfile* f, uint64_t block,
+    colfile_match match, void* arg) {
+  uint64_t span;
+  uint32_t l;
+
+  if (f->levels == 0 || block >= f->blocks) {
+    return f->blocks;
+  }
+  span = 1;
+  for (l = 1; l < f->levels; l++) {
+    span *= f->fanout;
+  }
+  return match_node(f, f->levels - 1, 0, span, block, match, arg);
+}
+
+/* Searches the blocks under a node, span of them, from block on. */
+uint64_t match_node(const colfile* f, uint32_t level, uint64_t node,
+    uint64_t span, uint64_t block, colfile_match match, void* arg) {
+  uint64_t child;
+  uint64_t end;
+  uint64_t found;
+
+  if ((node + 1) * span <= block || !match(arg, &f->level[level][node])) {
+    return f->blocks;
+  } else if (level == 0) {
+    return node;
+  }
+  span /= f->fanout;
+  child = node * f->fanout;
+  if (block / span > child) {
+    child = block / span;
+  }
+  end = (node + 1) * f->fanout;
+  if (end > f->nodes[level - 1]) {
+    end = f->nodes[level - 1];
+  }
+  for (; child < end; child++) {
+    found = match_node(f, level - 1, child, span, block, match, arg);
+    if (found < f->blocks) {
+      return found;
+    }
+  }
+  return f->blocks;
+}
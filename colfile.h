@@ -0,0 +1,186 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Columnar capture files. Records are stored in blocks, each block holding
+ * one array per field, so reading a single field never touches the others.
+ * The file ends with an index of the blocks keyed by time, so files can be
+ * memory mapped and any time range found and read in place without copying.
+ *
+ * Layout, all integers little endian:
+ *   header:  magic "PL6SCOL1", uint32 version, uint32 block size in records
+ *   blocks:  for each column in colfile_column order, count values of that
+ *            column's type, padded to a multiple of 8 bytes
+ *   index:   one colfile_index_entry per block
+ *   summary: uint32 fanout, uint32 levels, then a colfile_summary per node
+ *            of each level of the summary tree, from the blocks up
+ *   trailer: uint64 index offset, uint64 block count, uint64 record count,
+ *            magic "PL6SCOL1"
+ *
+ * The summary tree's first level has a node per block, and each level
+ * above a node per fanout nodes of the one below, up to a single root, so a
+ * query can skip or take whole any run of blocks its range covers, or that
+ * can't hold records it wants, reading records only where it must. Version
+ * 1 files, written before there were summaries, end their index at the
+ * trailer; the tree is built for them when they're opened.
+ *
+ * Time is the device's interval field made cumulative: it keeps increasing
+ * across the interval wrapping around or restarting with a new log.
+ */
+
+#ifndef COLFILE_H_
+#define COLFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "powerlog6s.h"
+
+#define COLFILE_MAGIC "PL6SCOL1"
+#define COLFILE_VERSION 2
+/* Nodes of one level of the summary tree under each of the next. */
+#define COLFILE_FANOUT 16
+/* Enough for 2^64 blocks, at the smallest fanout a file may have. */
+#define COLFILE_MAX_LEVELS 64
+
+enum colfile_column {
+  COL_TIME, /* uint64 cumulative milliseconds */
+  COL_INTERVAL, /* uint32 as logged */
+  COL_TYPE, /* uint8 */
+  COL_STATE, /* uint8 */
+  COL_CURRENT, /* int16 */
+  COL_VOLTAGE, /* uint16 */
+  COL_ENERGY, /* uint32 */
+  COL_CELL1, /* int16, and so on for the other five cells */
+  COL_CELL6 = COL_CELL1 + 5,
+  COL_RPM, /* uint16 */
+  COL_INTERNAL_TEMPERATURE, /* int16 */
+  COL_TEMPERATURE1, /* int16, and so on for the other two probes */
+  COL_TEMPERATURE3 = COL_TEMPERATURE1 + 2,
+  COL_PERIOD, /* uint16 */
+  COL_PULSE, /* uint16 */
+  COL_COUNT
+};
+
+struct _colfile_index_entry {
+  uint64_t offset; /* of the block from the start of the file */
+  uint64_t count; /* records in the block */
+  uint64_t first_time;
+  uint64_t last_time;
+};
+
+/* Aggregates of every column over a block, or over the blocks under a node
+ * of the summary tree, widened from the values as stored. The time column's
+ * are the first and last times. */
+struct _colfile_summary {
+  uint64_t count;
+  int64_t min[COL_COUNT];
+  int64_t max[COL_COUNT];
+  int64_t sum[COL_COUNT];
+};
+
+/* Turns the interval field into cumulative time. */
+struct _colfile_clock {
+  uint64_t base;
+  uint32_t last;
+  int started;
+};
+
+struct _colfile_writer {
+  output* out;
+  uint32_t block_size;
+  uint64_t offset; /* bytes written so far */
+  uint64_t records;
+  uint32_t count; /* records in the current block */
+  unsigned char* columns[COL_COUNT];
+  struct _colfile_clock clock;
+  struct _colfile_index_entry* index;
+  struct _colfile_summary* summaries; /* one per block, as for index */
+  uint64_t blocks;
+  uint64_t index_cap;
+};
+
+/* One block of a mapped file, pointing straight into the mapping. */
+struct _colfile_block {
+  uint64_t count;
+  const void* columns[COL_COUNT];
+};
+
+struct _colfile {
+  const unsigned char* map;
+  size_t size;
+  uint32_t block_size;
+  const struct _colfile_index_entry* index;
+  uint64_t blocks;
+  uint64_t records;
+  uint32_t version;
+  uint32_t fanout;
+  uint32_t levels;
+  const struct _colfile_summary* level[COLFILE_MAX_LEVELS]; /* blocks up */
+  uint64_t nodes[COLFILE_MAX_LEVELS]; /* in each level */
+  struct _colfile_summary* built; /* the tree of a version 1 file */
+};
+
+typedef struct _colfile_index_entry colfile_index_entry;
+typedef struct _colfile_summary colfile_summary;
+typedef struct _colfile_clock colfile_clock;
+typedef struct _colfile_writer colfile_writer;
+typedef struct _colfile_block colfile_block;
+typedef struct _colfile colfile;
+
+/* Each column's name, and its unit or NULL if it hasn't one. */
+extern const char* kColfileNames[COL_COUNT];
+extern const char* kColfileUnits[COL_COUNT];
+
+/* Bytes per value of a column. */
+size_t colfile_width(int column);
+/* Whether a column's values are signed. */
+int colfile_signed(int column);
+
+void colfile_clock_init(colfile_clock* clock);
+uint64_t colfile_clock_time(colfile_clock* clock, uint32_t interval);
+
+/* Stores log, at time, as row n of the arrays in columns, one per column of
+ * its width. */
+void colfile_transpose(unsigned char** columns, uint32_t n, uint64_t time,
+    const powerlog6s* log);
+
+/* Writing, in one pass with no seeking, so out may be a pipe. */
+int colfile_writer_init(colfile_writer* w, output* out, uint32_t block_size);
+int colfile_writer_add(colfile_writer* w, const powerlog6s* log);
+/* Writes the last partial block, index and trailer, and frees w. */
+int colfile_writer_close(colfile_writer* w);
+
+/* Reading, by memory mapping the whole file. */
+int colfile_open(colfile* f, const char* path);
+void colfile_close(colfile* f);
+void colfile_block_at(const colfile* f, uint64_t block, colfile_block* b);
+/* First block that could hold records at or after time, f->blocks if none. */
+uint64_t colfile_find_block(const colfile* f, uint64_t time);
+/* First record in b at or after time, b->count if none. */
+uint64_t colfile_find_record(const colfile_block* b, uint64_t time);
+/* Copies record i of b back into a struct, for callers wanting whole rows. */
+void colfile_record(const colfile_block* b, uint64_t i, powerlog6s* log);
+
+/* Summaries, which merge in any order. */
+void colfile_summary_init(colfile_summary* s);
+/* Adds rows from up to but not including to of columns, which are arrays
+ * laid out as in a block, to s. */
+void colfile_summarize(const void* const* columns, uint64_t from, uint64_t to,
+    colfile_summary* s);
+void colfile_summary_merge(colfile_summary* s, const colfile_summary* t);
+/* Adds every record with a time from from to to, inclusive, to s. Takes the
+ * summary of each node of the tree wholly in range, reading records only in
+ * the blocks at the ends. Returns how many blocks it read. */
+uint64_t colfile_aggregate(const colfile* f, uint64_t from, uint64_t to,
+    colfile_summary* s);
+
+/* Says whether the records under a summary might include some wanted. */
+typedef int (*colfile_match)(void* arg, const colfile_summary* s);
+/* First block from block on that match says might hold records wanted, as
+ * might every node above it, or f->blocks if there are none. Nodes that
+ * can't are skipped whole. */
+uint64_t colfile_next_match(const colfile* f, uint64_t block,
+    colfile_match match, void* arg);
+
+#endif  /* COLFILE_H_ */
@@ -0,0 +1,86 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Continuity of a log, from the intervals of its entries.
+ */
+
+#include <string.h>
+
+#include "continuity.h"
+
+void continuity_init(continuity* k, uint32_t declared, uint32_t step) {
+  memset(k, 0, sizeof(continuity));
+  k->declared = declared;
+  k->step = step;
+  k->declared_step = step != 0;
+}
+
+int continuity_add(continuity* k, const powerlog6s* log) {
+  int32_t delta;
+  uint32_t steps;
+
+  k->entries++;
+  if (k->entries == 1) {
+    k->last = log->interval;
+    return CONTINUITY_OK;
+  }
+  /* Intervals wrap at 32 bits, after 49 days. */
+  delta = (int32_t) (log->interval - k->last);
+  if (delta == 0) {
+    k->duplicates++;
+    return CONTINUITY_DUPLICATE;
+  } else if (delta < 0) {
+    /* More likely the log restarted without a START than an entry came
+     * late, so carry on from here rather than finding every entry after it
+     * out of order. */
+    k->backwards++;
+    k->last = log->interval;
+    return CONTINUITY_BACKWARDS;
+  }
+  k->last = log->interval;
+  if (!k->declared_step && (k->step == 0 || (uint32_t) delta < k->step)) {
+    k->step = delta;
+    return CONTINUITY_OK;
+  }
+  /* Allow half a step of jitter either way. */
+  if ((uint32_t) delta <= k->step + k->step / 2) {
+    return CONTINUITY_OK;
+  }
+  steps = ((uint32_t) delta + k->step / 2) / k->step;
+  k->gaps++;
+  k->gap_missing = steps - 1;
+  k->missing += steps - 1;
+  return CONTINUITY_GAP;
+}
+
+uint64_t continuity_lost(const continuity* k) {
+  uint64_t counted;
+
+  counted = k->entries - k->duplicates;
+  if (k->declared > counted + k->missing) {
+    return k->declared - counted;
+  }
+  return k->missing;
+}
+
+void continuity_print(const continuity* k, const char* name, FILE* f) {
+  uint64_t lost;
+  uint64_t expected;
+
+  lost = continuity_lost(k);
+  expected = k->entries - k->duplicates + lost;
+  flockfile(f);
+  if (name) {
+    fprintf(f, "%s: ", name);
+  }
+  fprintf(f, "%llu entries, %llu lost in %llu gaps (%.3f%%), %llu repeated, "
+      "%llu out of order", (unsigned long long) k->entries,
+      (unsigned long long) lost, (unsigned long long) k->gaps,
+      expected ? 100.0 * lost / expected : 0.0,
+      (unsigned long long) k->duplicates, (unsigned long long) k->backwards);
+  if (k->declared) {
+    fprintf(f, ", %u declared", k->declared);
+  }
+  fprintf(f, ", every %u ms.\n", k->step);
+  funlockfile(f);
+}
@@ -0,0 +1,48 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Checks a log is complete from the interval of each entry, which steps by
+ * a fixed number of milliseconds, and the number of entries a START control
+ * message declares. Finds entries lost between the device and the output,
+ * repeated, or arriving out of order.
+ */
+
+#ifndef CONTINUITY_H_
+#define CONTINUITY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "powerlog6s.h"
+
+/* What continuity_add() found. */
+#define CONTINUITY_OK 0
+#define CONTINUITY_GAP 1
+#define CONTINUITY_DUPLICATE 2
+#define CONTINUITY_BACKWARDS 3
+
+struct _continuity {
+  uint32_t step; /* milliseconds between entries, 0 until known */
+  int declared_step; /* step came from START rather than being learned */
+  uint32_t declared; /* entries declared by START, 0 if not known */
+  uint64_t entries;
+  uint32_t last; /* interval of the last entry */
+  uint64_t gaps;
+  uint64_t missing; /* entries lost in gaps */
+  uint64_t duplicates;
+  uint64_t backwards; /* entries with an interval before the last one's */
+  uint32_t gap_missing; /* entries lost in the gap last found */
+};
+
+typedef struct _continuity continuity;
+
+/* Starts checking a new log. declared and step come from START, 0 if there
+ * wasn't one; without a step the smallest seen is used. */
+void continuity_init(continuity* k, uint32_t declared, uint32_t step);
+/* Checks the next entry, returning one of CONTINUITY_*. */
+int continuity_add(continuity* k, const powerlog6s* log);
+/* Entries lost, counting both gaps and any short of the number declared. */
+uint64_t continuity_lost(const continuity* k);
+void continuity_print(const continuity* k, const char* name, FILE* f);
+
+#endif  /* CONTINUITY_H_ */
@@ -0,0 +1,595 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Offline conversion of binary captures into CSV, or an Arrow stream with
+ * --format=arrow. Chunk i is formatted into
+ * slot i % slots, so at most that many chunks are ever held in memory, and a
+ * worker wanting a slot whose last chunk hasn't been written yet waits for
+ * the writer. Workers and the writer only meet once per chunk, so the lock
+ * costs nothing next to formatting tens of thousands of records.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arrow.h"
+#include "capture.h"
+#include "decimate.h"
+#include "delta.h"
+#include "flags.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "timing.h"
+
+#include "convert.h"
+
+#define MAX_CONVERT_THREADS 256
+
+DEFINE_uint64(convert_threads, 0, "Threads formatting CSV when converting "
+    "dumps, 0 for one per processor");
+DEFINE_uint64(convert_chunk, 16384, "Records formatted as one piece of work "
+    "when converting dumps");
+DEFINE_bool(convert_stats, 0, "Print conversion throughput to stderr");
+
+void fregister_convert() {
+  REGISTER(convert_stats);
+  REGISTER(convert_chunk);
+  REGISTER(convert_threads);
+}
+
+struct _chunk_slot {
+  output out; /* formatted CSV, written straight from its buffer */
+  int done; /* formatted and waiting to be written */
+};
+
+struct _converter {
+  struct _dump* dumps;
+  int ndumps;
+  uint64_t chunks;
+  struct _chunk_slot* slots;
+  uint64_t nslots;
+
+  pthread_mutex_t lock;
+  pthread_cond_t formatted;
+  pthread_cond_t written;
+  int timed; /* the dumps carry --host_time times, for CSV columns */
+  uint64_t next; /* next chunk for a worker to take */
+  uint64_t flushed; /* chunks written out so far */
+  int stopping;
+};
+
+typedef struct _chunk_slot chunk_slot;
+typedef struct _converter converter;
+
+void find_chunk(converter* cv, uint64_t chunk, const powerlog6s** records,
+    const drift_record** times, uint64_t* count);
+void* format_chunks(void* arg);
+int write_chunks(converter* cv);
+int convert_parallel(converter* cv, uint64_t nthreads, int fd);
+int convert_decimated(converter* cv, uint64_t records, int fd);
+int format_entry(void* arg, const powerlog6s* log);
+int convert_arrow(converter* cv, uint64_t records, int fd);
+int add_arrow_entry(void* arg, const powerlog6s* log);
+int decode_dump(dump* d, const unsigned char* data, size_t len, char* path);
+int read_timed_dump(dump* d, const unsigned char* data, size_t len,
+    char* path);
+
+int convert_dumps(int count, char** paths, int fd) {
+  converter cv;
+  uint64_t nthreads;
+  uint64_t records;
+  double start;
+  double elapsed;
+  int untimed;
+  int timed;
+  int rc;
+  int i;
+
+  if (FLAGS_convert_chunk == 0) {
+    fprintf(stderr, "--convert_chunk must be at least 1.\n");
+    return USER_SUCKS;
+  }
+  if (strcmp(FLAGS_format, "arrow") == 0 && FLAGS_column_block == 0) {
+    fprintf(stderr, "--column_block must be at least 1.\n");
+    return USER_SUCKS;
+  }
+  nthreads = FLAGS_convert_threads;
+  if (nthreads == 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN) > 0
+        ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  }
+  if (nthreads > MAX_CONVERT_THREADS) {
+    nthreads = MAX_CONVERT_THREADS;
+  }
+
+  start = timing_now();
+  memset(&cv, 0, sizeof(converter));
+  cv.dumps = (dump*) calloc(count, sizeof(dump));
+  if (!cv.dumps) {
+    perror("Failed to allocate dumps");
+    return USER_SUCKS;
+  }
+  rc = SUCCESS;
+  records = 0;
+  for (cv.ndumps = 0; cv.ndumps < count && rc == SUCCESS; cv.ndumps++) {
+    rc = map_dump(&cv.dumps[cv.ndumps], paths[cv.ndumps]);
+    records += cv.dumps[cv.ndumps].count;
+    cv.chunks += (cv.dumps[cv.ndumps].count + FLAGS_convert_chunk - 1)
+        / FLAGS_convert_chunk;
+  }
+  /* Every line needs the same columns. Decimated and Arrow output have no
+   * room for the times, so go without. */
+  timed = 0;
+  untimed = 0;
+  for (i = 0; i < cv.ndumps; i++) {
+    if (cv.dumps[i].count > 0) {
+      timed += cv.dumps[i].times != NULL;
+      untimed += cv.dumps[i].times == NULL;
+    }
+  }
+  if (rc == SUCCESS && timed > 0 && untimed > 0) {
+    fprintf(stderr, "Captures with --host_time times and without can't be "
+        "converted together.\n");
+    rc = USER_SUCKS;
+  }
+  cv.timed = timed > 0;
+
+  /* Decimating is cheap next to formatting, and keeps few enough entries
+   * that it isn't worth spreading over threads. Nor is transposing into
+   * columns. */
+  if (rc == SUCCESS && strcmp(FLAGS_format, "arrow") == 0) {
+    nthreads = 1;
+    rc = convert_arrow(&cv, records, fd);
+  } else if (rc == SUCCESS && decimating()) {
+    nthreads = 1;
+    rc = convert_decimated(&cv, records, fd);
+  } else if (rc == SUCCESS) {
+    rc = convert_parallel(&cv, nthreads, fd);
+  }
+
+  if (rc == SUCCESS && FLAGS_convert_stats) {
+    elapsed = timing_now() - start;
+    fprintf(stderr, "Converted %llu records in %llu chunks on %llu threads "
+        "in %.3fs (%.0f records/s)\n", (unsigned long long) records,
+        (unsigned long long) cv.chunks, (unsigned long long) nthreads,
+        elapsed, elapsed > 0 ? records / elapsed : 0);
+  }
+  for (i = 0; i < cv.ndumps; i++) {
+    unmap_dump(&cv.dumps[i]);
+  }
+  free(cv.dumps);
+  return rc;
+}
+
+int write_header(int fd, int timed) {
+  const char* columns = powerlog6s_csv_columns();
+  output header;
+  int rc;
+
+  rc = output_open(&header, fd, strlen(columns) + strlen(DRIFT_CSV_COLUMNS));
+  if (rc == SUCCESS) {
+    /* The times go before the newline. */
+    rc = output_write(&header, columns, strlen(columns) - (timed ? 1 : 0));
+    if (rc == SUCCESS && timed) {
+      rc = output_write(&header, DRIFT_CSV_COLUMNS,
+          strlen(DRIFT_CSV_COLUMNS));
+    }
+    if (output_flush(&header) != SUCCESS) {
+      rc = OUTPUT_ERROR;
+    }
+    output_close(&header);
+  }
+  return rc;
+}
+
+int convert_parallel(converter* cv, uint64_t nthreads, int fd) {
+  pthread_t threads[MAX_CONVERT_THREADS];
+  uint64_t i;
+  int rc;
+
+  /* Enough slots to keep every thread busy while the writer catches up. */
+  cv->nslots = 2 * nthreads;
+  cv->slots = (chunk_slot*) calloc(cv->nslots, sizeof(chunk_slot));
+  if (!cv->slots) {
+    perror("Failed to allocate chunks");
+    return USER_SUCKS;
+  }
+  rc = SUCCESS;
+  for (i = 0; i < cv->nslots && rc == SUCCESS; i++) {
+    rc = output_open(&cv->slots[i].out, fd, FLAGS_convert_chunk
+        * (POWERLOG6S_CSV_MAX + (cv->timed ? DRIFT_CSV_MAX : 0)));
+  }
+  if (rc == SUCCESS) {
+    rc = write_header(fd, cv->timed);
+  }
+
+  if (rc == SUCCESS) {
+    pthread_mutex_init(&cv->lock, NULL);
+    pthread_cond_init(&cv->formatted, NULL);
+    pthread_cond_init(&cv->written, NULL);
+    for (i = 0; i < nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, format_chunks, cv) != 0) {
+        perror("Failed to start conversion thread");
+        exit(DEVICE_ERROR);
+      }
+    }
+    rc = write_chunks(cv);
+    for (i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&cv->written);
+    pthread_cond_destroy(&cv->formatted);
+    pthread_mutex_destroy(&cv->lock);
+  }
+
+  for (i = 0; i < cv->nslots; i++) {
+    /* Anything still here was cut short and would be out of order. */
+    cv->slots[i].out.len = 0;
+    output_close(&cv->slots[i].out);
+  }
+  free(cv->slots);
+  return rc;
+}
+
+/* Decimates the dumps as one log, on this thread. */
+int convert_decimated(converter* cv, uint64_t records, int fd) {
+  decimator d;
+  output out;
+  uint64_t i;
+  int rc;
+  int j;
+
+  rc = write_header(fd, 0);
+  if (rc != SUCCESS || output_open(&out, fd, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  rc = decimator_init(&d, records, format_entry, &out);
+  for (j = 0; j < cv->ndumps && rc == SUCCESS; j++) {
+    for (i = 0; i < cv->dumps[j].count && rc == SUCCESS; i++) {
+      /* Gap markers aren't entries to choose between. */
+      if (cv->dumps[j].records[i].type != POWERLOG6S_GAP) {
+        rc = decimator_add(&d, &cv->dumps[j].records[i]);
+      }
+    }
+  }
+  if (decimator_finish(&d) != SUCCESS && rc == SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  if (output_flush(&out) != SUCCESS && rc == SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  output_close(&out);
+  return rc;
+}
+
+/* Converts the dumps to an Arrow stream, decimating them as one log if
+ * asked to. */
+int convert_arrow(converter* cv, uint64_t records, int fd) {
+  arrow_writer w;
+  decimator d;
+  output out;
+  uint64_t i;
+  int started; /* whether d was initialized, so has to be finished */
+  int rc;
+  int j;
+
+  if (output_open(&out, fd, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  /* Both inits clear what they set up first, so whatever they allocated
+   * before failing is freed by closing or finishing. */
+  rc = arrow_writer_init(&w, &out, FLAGS_column_block);
+  started = rc == SUCCESS && decimating();
+  if (started) {
+    rc = decimator_init(&d, records, add_arrow_entry, &w);
+  }
+  for (j = 0; j < cv->ndumps && rc == SUCCESS; j++) {
+    for (i = 0; i < cv->dumps[j].count && rc == SUCCESS; i++) {
+      /* Gap markers aren't entries, and there's no column to mark them. */
+      if (cv->dumps[j].records[i].type == POWERLOG6S_GAP) {
+        continue;
+      }
+      rc = decimating() ? decimator_add(&d, &cv->dumps[j].records[i])
+          : arrow_writer_add(&w, &cv->dumps[j].records[i]);
+    }
+  }
+  if (started && decimator_finish(&d) != SUCCESS && rc == SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  if (arrow_writer_close(&w) != SUCCESS && rc == SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  if (output_flush(&out) != SUCCESS && rc == SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  output_close(&out);
+  return rc;
+}
+
+int add_arrow_entry(void* arg, const powerlog6s* log) {
+  return arrow_writer_add((arrow_writer*) arg, log);
+}
+
+int format_entry(void* arg, const powerlog6s* log) {
+  output* out = (output*) arg;
+  char* line;
+
+  line = output_reserve(out, POWERLOG6S_CSV_MAX);
+  if (!line) {
+    return OUTPUT_ERROR;
+  }
+  output_commit(out, powerlog6s_csv_format(log, line));
+  return SUCCESS;
+}
+
+int map_dump(dump* d, char* path) {
+  struct stat st;
+  void* map;
+  int rc;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return DEVICE_MISSING;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return SUCCESS;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return DEVICE_ERROR;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  if ((size_t) st.st_size >= DELTA_MAGIC_LEN
+      && memcmp(map, DELTA_MAGIC, DELTA_MAGIC_LEN) == 0) {
+    rc = decode_dump(d, (const unsigned char*) map, st.st_size, path);
+    munmap(map, st.st_size);
+    return rc;
+  }
+  if ((size_t) st.st_size >= DRIFT_MAGIC_LEN
+      && memcmp(map, DRIFT_MAGIC, DRIFT_MAGIC_LEN) == 0) {
+    rc = read_timed_dump(d, (const unsigned char*) map + DRIFT_MAGIC_LEN,
+        st.st_size - DRIFT_MAGIC_LEN, path);
+    munmap(map, st.st_size);
+    return rc;
+  }
+  if (st.st_size % sizeof(powerlog6s) != 0) {
+    fprintf(stderr, "%s ends with %llu bytes of a partial record, which are "
+        "ignored.\n", path,
+        (unsigned long long) (st.st_size % sizeof(powerlog6s)));
+  }
+  d->count = st.st_size / sizeof(powerlog6s);
+  if (d->count == 0) {
+    munmap(map, st.st_size);
+    return SUCCESS;
+  }
+  d->records = (const powerlog6s*) map;
+  d->size = st.st_size;
+  if (d->records[0].len != sizeof(powerlog6s)) {
+    fprintf(stderr, "%s doesn't look like a --binary capture.\n", path);
+    return BAD_MESSAGE_LENGTH;
+  }
+  return SUCCESS;
+}
+
+/* Decodes a --format=delta capture into memory, as the records it was
+ * encoded from. */
+int decode_dump(dump* d, const unsigned char* data, size_t len, char* path) {
+  delta_decoder decoder;
+  powerlog6s* records;
+  powerlog6s* grown;
+  uint64_t cap;
+  size_t consumed;
+  int count;
+
+  delta_decoder_init(&decoder);
+  records = NULL;
+  cap = 0;
+  d->count = 0;
+  while (len > 0) {
+    if (d->count + DELTA_FRAME > cap) {
+      cap = cap ? 2 * cap : 4096;
+      grown = (powerlog6s*) realloc(records, cap * sizeof(powerlog6s));
+      if (!grown) {
+        perror("Failed to allocate decoded records");
+        free(records);
+        d->count = 0;
+        return USER_SUCKS;
+      }
+      records = grown;
+    }
+    count = delta_decode(&decoder, data, len, records + d->count, &consumed);
+    if (count < 0) {
+      fprintf(stderr, "%s has a corrupt delta frame after %llu records.\n",
+          path, (unsigned long long) d->count);
+      free(records);
+      d->count = 0;
+      return BAD_MESSAGE_LENGTH;
+    } else if (consumed == 0) {
+      fprintf(stderr, "%s ends with %llu bytes of a partial frame, which are "
+          "ignored.\n", path, (unsigned long long) len);
+      break;
+    }
+    d->count += count;
+    data += consumed;
+    len -= consumed;
+  }
+  d->records = records;
+  d->size = 0;
+  return SUCCESS;
+}
+
+/* Reads a --host_time capture into memory, each record in it followed by
+ * its times, as an array of records and another of their times. */
+int read_timed_dump(dump* d, const unsigned char* data, size_t len,
+    char* path) {
+  const size_t stride = sizeof(powerlog6s) + sizeof(drift_record);
+  powerlog6s* records;
+  drift_record* times;
+  uint64_t i;
+
+  if (len % stride != 0) {
+    fprintf(stderr, "%s ends with %llu bytes of a partial record, which are "
+        "ignored.\n", path, (unsigned long long) (len % stride));
+  }
+  d->count = len / stride;
+  if (d->count == 0) {
+    return SUCCESS;
+  }
+  if (((const powerlog6s*) data)->len != sizeof(powerlog6s)) {
+    fprintf(stderr, "%s doesn't look like a --binary --host_time capture.\n",
+        path);
+    d->count = 0;
+    return BAD_MESSAGE_LENGTH;
+  }
+  records = (powerlog6s*) malloc(d->count * sizeof(powerlog6s));
+  times = (drift_record*) malloc(d->count * sizeof(drift_record));
+  if (!records || !times) {
+    perror("Failed to allocate timed records");
+    free(records);
+    free(times);
+    d->count = 0;
+    return USER_SUCKS;
+  }
+  for (i = 0; i < d->count; i++) {
+    memcpy(&records[i], data + i * stride, sizeof(powerlog6s));
+    memcpy(&times[i], data + i * stride + sizeof(powerlog6s),
+        sizeof(drift_record));
+  }
+  d->records = records;
+  d->times = times;
+  d->size = 0;
+  return SUCCESS;
+}
+
+void unmap_dump(dump* d) {
+  if (d->records && d->size) {
+    munmap((void*) d->records, d->size);
+  } else {
+    free((void*) d->records);
+  }
+  free((void*) d->times);
+  d->records = NULL;
+  d->times = NULL;
+}
+
+/* Finds the records making up a chunk, and their times if the dump has
+ * any. Chunks never span dumps. */
+void find_chunk(converter* cv, uint64_t chunk, const powerlog6s** records,
+    const drift_record** times, uint64_t* count) {
+  uint64_t chunks;
+  int i;
+
+  for (i = 0; i < cv->ndumps; i++) {
+    chunks = (cv->dumps[i].count + FLAGS_convert_chunk - 1)
+        / FLAGS_convert_chunk;
+    if (chunk < chunks) {
+      break;
+    }
+    chunk -= chunks;
+  }
+  *records = cv->dumps[i].records + chunk * FLAGS_convert_chunk;
+  *times = cv->dumps[i].times
+      ? cv->dumps[i].times + chunk * FLAGS_convert_chunk : NULL;
+  *count = cv->dumps[i].count - chunk * FLAGS_convert_chunk;
+  if (*count > FLAGS_convert_chunk) {
+    *count = FLAGS_convert_chunk;
+  }
+}
+
+void* format_chunks(void* arg) {
+  converter* cv = (converter*) arg;
+  const powerlog6s* records;
+  const drift_record* times;
+  chunk_slot* slot;
+  uint64_t chunk;
+  uint64_t count;
+  uint64_t i;
+  char* line;
+  int stopping;
+
+  for (;;) {
+    pthread_mutex_lock(&cv->lock);
+    chunk = cv->next++;
+    while (!cv->stopping && chunk >= cv->flushed + cv->nslots) {
+      pthread_cond_wait(&cv->written, &cv->lock);
+    }
+    stopping = cv->stopping;
+    pthread_mutex_unlock(&cv->lock);
+    if (stopping || chunk >= cv->chunks) {
+      return NULL;
+    }
+
+    slot = &cv->slots[chunk % cv->nslots];
+    find_chunk(cv, chunk, &records, &times, &count);
+    line = slot->out.buf;
+    if (times) {
+      for (i = 0; i < count; i++) {
+        line += drift_csv_format_entry(&records[i], &times[i], line);
+      }
+    } else {
+      for (i = 0; i < count; i++) {
+        line += powerlog6s_csv_format(&records[i], line);
+      }
+    }
+    output_commit(&slot->out, line - slot->out.buf);
+
+    pthread_mutex_lock(&cv->lock);
+    slot->done = 1;
+    pthread_cond_broadcast(&cv->formatted);
+    pthread_mutex_unlock(&cv->lock);
+  }
+}
+
+/* Writes out the chunks in order as they're formatted, until done or
+ * interrupted, which is an error as the output is cut short. */
+int write_chunks(converter* cv) {
+  chunk_slot* slot;
+  uint64_t chunk;
+  int rc;
+
+  rc = SUCCESS;
+  for (chunk = 0; chunk < cv->chunks && rc == SUCCESS && !capture_interrupted;
+      chunk++) {
+    slot = &cv->slots[chunk % cv->nslots];
+    pthread_mutex_lock(&cv->lock);
+    while (!slot->done) {
+      pthread_cond_wait(&cv->formatted, &cv->lock);
+    }
+    pthread_mutex_unlock(&cv->lock);
+
+    rc = output_flush(&slot->out);
+
+    pthread_mutex_lock(&cv->lock);
+    slot->done = 0;
+    cv->flushed++;
+    pthread_cond_broadcast(&cv->written);
+    pthread_mutex_unlock(&cv->lock);
+  }
+
+  pthread_mutex_lock(&cv->lock);
+  cv->stopping = 1;
+  pthread_cond_broadcast(&cv->written);
+  pthread_mutex_unlock(&cv->lock);
+  if (rc == SUCCESS && chunk < cv->chunks) {
+    fprintf(stderr, "Interrupted after %llu of %llu chunks, leaving the "
+        "output incomplete.\n", (unsigned long long) chunk,
+        (unsigned long long) cv->chunks);
+    rc = OUTPUT_ERROR;
+  }
+  return rc;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Offline conversion of binary captures (--binary) back into CSV. The dumps
+ * are memory mapped, or read into memory if they're --format=delta captures
+ * or carry --host_time times, and cut into chunks of whole records, which a
+ * pool of threads formats in parallel while the chunks are written out in
+ * order.
+ */
+
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drift.h"
+#include "flags.h"
+#include "powerlog6s.h"
+
+/* A memory mapped --binary capture, or a decoded --format=delta one, or
+ * one with --host_time times read apart from its records. */
+struct _dump {
+  const powerlog6s* records;
+  const drift_record* times; /* of each record, or NULL if there are none */
+  size_t size; /* of the mapping, 0 if the records were read into memory */
+  uint64_t count;
+};
+
+typedef struct _dump dump;
+
+DECLARE_uint64(convert_threads);
+DECLARE_uint64(convert_chunk);
+DECLARE_bool(convert_stats);
+
+void fregister_convert();
+
+/* Writes the CSV header and then every record of the count dumps at paths,
+ * in order, to fd. Returns SUCCESS or an error code from rc.h. */
+int convert_dumps(int count, char** paths, int fd);
+/* Maps the dump at path, leaving d->records NULL if it's empty, or decodes
+ * it if it starts with DELTA_MAGIC, or reads its records and times apart if
+ * it starts with DRIFT_MAGIC. Returns SUCCESS or an error code from rc.h,
+ * complaining of a partial record or frame at the end but keeping the
+ * whole ones before it. */
+int map_dump(dump* d, char* path);
+/* Unmaps or frees the dump's records and times. */
+void unmap_dump(dump* d);
+/* Writes the CSV header to fd, with the --host_time columns if timed. */
+int write_header(int fd, int timed);
+
+#endif  /* CONVERT_H_ */
@@ -0,0 +1,20 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * CRC32C (Castagnoli), the checksum of iSCSI and ext4, using the SSE4.2 or
+ * ARMv8 CRC instructions where the processor has them and a table where it
+ * doesn't. Every way gives the same result.
+ */
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Carries crc, 0 to start with, on over len bytes of data. */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+/* Name of the way crc32c() works here: sse4.2, armv8 or table. */
+const char* crc32c_kernel_name();
+
+#endif  /* CRC32C_H_ */
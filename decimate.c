@@ -0,0 +1,306 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Streaming decimation. LTTB picks from each bucket the entry making the
+ * largest triangle with the entry picked from the bucket before and the
+ * average of the bucket after, see Steinarsson, "Downsampling Time Series
+ * for Visual Representation" (2013).
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rc.h"
+
+#include "decimate.h"
+
+DEFINE_string(decimate, "none", "Keep only some entries, for plotting long "
+    "logs: none, minmax for the entries with the lowest and highest "
+    "--decimate_field in each bucket, or lttb for the one entry per bucket "
+    "that best keeps the shape of its plot");
+DEFINE_string(decimate_field, "current", "Field to decimate on: current, "
+    "voltage, energy, cell1 to cell6, rpm, internal_temperature or "
+    "temperature1 to temperature3");
+DEFINE_uint64(decimate_bucket, 100, "Entries per bucket when decimating");
+DEFINE_uint64(decimate_points, 0, "Aim for this many entries in all when "
+    "decimating, rather than a fixed --decimate_bucket. Only possible when "
+    "the length of the log is known up front, as when converting dumps or "
+    "downloading an offline log");
+
+void fregister_decimate() {
+  REGISTER(decimate_points);
+  REGISTER(decimate_bucket);
+  REGISTER(decimate_field);
+  REGISTER(decimate);
+}
+
+#define FIELD_U16 0
+#define FIELD_S16 1
+#define FIELD_U32 2
+
+struct _decimate_field {
+  const char* name;
+  size_t offset;
+  int kind;
+};
+
+const struct _decimate_field kDecimateFields[] = {
+  { "current", offsetof(powerlog6s, current), FIELD_S16 },
+  { "voltage", offsetof(powerlog6s, voltage), FIELD_U16 },
+  { "energy", offsetof(powerlog6s, energy), FIELD_U32 },
+  { "cell1", offsetof(powerlog6s, cell) + 0, FIELD_S16 },
+  { "cell2", offsetof(powerlog6s, cell) + 2, FIELD_S16 },
+  { "cell3", offsetof(powerlog6s, cell) + 4, FIELD_S16 },
+  { "cell4", offsetof(powerlog6s, cell) + 6, FIELD_S16 },
+  { "cell5", offsetof(powerlog6s, cell) + 8, FIELD_S16 },
+  { "cell6", offsetof(powerlog6s, cell) + 10, FIELD_S16 },
+  { "rpm", offsetof(powerlog6s, rpm), FIELD_U16 },
+  { "internal_temperature", offsetof(powerlog6s, internal_temperature),
+    FIELD_S16 },
+  { "temperature1", offsetof(powerlog6s, temperature) + 0, FIELD_S16 },
+  { "temperature2", offsetof(powerlog6s, temperature) + 2, FIELD_S16 },
+  { "temperature3", offsetof(powerlog6s, temperature) + 4, FIELD_S16 },
+  { NULL, 0, 0 }
+};
+
+double field_value(int field, const powerlog6s* log);
+int emit_entry(decimator* d, const decimate_entry* e);
+int minmax_add(decimator* d, const decimate_entry* e);
+int minmax_flush(decimator* d);
+int lttb_add(decimator* d, const decimate_entry* e);
+int lttb_choose(decimator* d, double next_time, double next_value);
+
+int decimating() {
+  return strcmp(FLAGS_decimate, "none") != 0;
+}
+
+int decimator_init(decimator* d, uint64_t total, decimate_emit emit,
+    void* arg) {
+  uint64_t buckets;
+  int i;
+
+  memset(d, 0, sizeof(decimator));
+  d->emit = emit;
+  d->arg = arg;
+  colfile_clock_init(&d->clock);
+  if (strcmp(FLAGS_decimate, "none") == 0) {
+    d->mode = DECIMATE_NONE;
+  } else if (strcmp(FLAGS_decimate, "minmax") == 0) {
+    d->mode = DECIMATE_MINMAX;
+  } else if (strcmp(FLAGS_decimate, "lttb") == 0) {
+    d->mode = DECIMATE_LTTB;
+  } else {
+    fprintf(stderr, "Unknown --decimate '%s'.\n", FLAGS_decimate);
+    return USER_SUCKS;
+  }
+  for (i = 0; kDecimateFields[i].name
+      && strcmp(kDecimateFields[i].name, FLAGS_decimate_field) != 0; i++) {
+  }
+  if (!kDecimateFields[i].name) {
+    fprintf(stderr, "Unknown --decimate_field '%s'.\n", FLAGS_decimate_field);
+    return USER_SUCKS;
+  }
+  d->field = i;
+
+  d->bucket = FLAGS_decimate_bucket;
+  if (FLAGS_decimate_points > 0 && total > 0) {
+    /* minmax keeps two entries a bucket, LTTB one plus the first and last
+     * entries. */
+    if (d->mode == DECIMATE_MINMAX) {
+      buckets = FLAGS_decimate_points / 2;
+    } else {
+      buckets = FLAGS_decimate_points > 2 ? FLAGS_decimate_points - 2 : 1;
+    }
+    buckets = buckets > 0 ? buckets : 1;
+    d->bucket = (total + buckets - 1) / buckets;
+  } else if (FLAGS_decimate_points > 0 && d->mode != DECIMATE_NONE) {
+    fprintf(stderr, "Length of the log isn't known, so decimating with "
+        "buckets of %llu entries rather than to %llu points.\n",
+        (unsigned long long) d->bucket,
+        (unsigned long long) FLAGS_decimate_points);
+  }
+  if (d->bucket == 0) {
+    fprintf(stderr, "--decimate_bucket must be at least 1.\n");
+    return USER_SUCKS;
+  }
+
+  if (d->mode == DECIMATE_LTTB) {
+    d->pending = (decimate_entry*) malloc(d->bucket * sizeof(decimate_entry));
+    d->filling = (decimate_entry*) malloc(d->bucket * sizeof(decimate_entry));
+    if (!d->pending || !d->filling) {
+      perror("Failed to allocate decimation buckets");
+      return USER_SUCKS;
+    }
+  }
+  return SUCCESS;
+}
+
+int decimator_add(decimator* d, const powerlog6s* log) {
+  decimate_entry e;
+
+  if (d->mode == DECIMATE_NONE) {
+    return d->emit(d->arg, log);
+  }
+  memcpy(&e.log, log, sizeof(powerlog6s));
+  e.time = (double) colfile_clock_time(&d->clock, log->interval);
+  e.value = field_value(d->field, log);
+  e.index = d->seen++;
+  if (d->mode == DECIMATE_MINMAX) {
+    return minmax_add(d, &e);
+  }
+  return lttb_add(d, &e);
+}
+
+int decimator_finish(decimator* d) {
+  int rc;
+
+  rc = SUCCESS;
+  if (d->mode == DECIMATE_MINMAX) {
+    rc = minmax_flush(d);
+  } else if (d->mode == DECIMATE_LTTB && d->seen > 0) {
+    /* The last bucket has no bucket after it, so is chosen against the
+     * last entry, which is then always kept. */
+    if (d->npending > 0 && d->nfilling > 0) {
+      rc = lttb_choose(d, d->sum_time / d->nfilling,
+          d->sum_value / d->nfilling);
+    } else if (d->npending > 0) {
+      rc = lttb_choose(d, d->last.time, d->last.value);
+    }
+    if (rc == SUCCESS && d->nfilling > 0) {
+      memcpy(d->pending, d->filling, d->nfilling * sizeof(decimate_entry));
+      d->npending = d->nfilling;
+      d->nfilling = 0;
+      rc = lttb_choose(d, d->last.time, d->last.value);
+    }
+    if (rc == SUCCESS && d->emitted != d->seen) {
+      rc = emit_entry(d, &d->last);
+    }
+  }
+  free(d->pending);
+  free(d->filling);
+  d->pending = NULL;
+  d->filling = NULL;
+  d->npending = 0;
+  d->nfilling = 0;
+  d->count = 0;
+  d->seen = 0;
+  return rc;
+}
+
+double field_value(int field, const powerlog6s* log) {
+  const unsigned char* p;
+  uint32_t u32;
+  uint16_t u16;
+  int16_t s16;
+
+  p = (const unsigned char*) log + kDecimateFields[field].offset;
+  switch (kDecimateFields[field].kind) {
+    case FIELD_U16:
+      memcpy(&u16, p, 2);
+      return u16;
+    case FIELD_S16:
+      memcpy(&s16, p, 2);
+      return s16;
+    default:
+      memcpy(&u32, p, 4);
+      return u32;
+  }
+}
+
+int emit_entry(decimator* d, const decimate_entry* e) {
+  d->emitted = e->index + 1;
+  return d->emit(d->arg, &e->log);
+}
+
+int minmax_add(decimator* d, const decimate_entry* e) {
+  if (d->count == 0 || e->value < d->low.value) {
+    d->low = *e;
+  }
+  if (d->count == 0 || e->value > d->high.value) {
+    d->high = *e;
+  }
+  if (++d->count == d->bucket) {
+    return minmax_flush(d);
+  }
+  return SUCCESS;
+}
+
+/* Emits the extremes of the bucket in the order they were logged. */
+int minmax_flush(decimator* d) {
+  int rc;
+
+  if (d->count == 0) {
+    return SUCCESS;
+  }
+  d->count = 0;
+  if (d->low.index == d->high.index) {
+    return emit_entry(d, &d->low);
+  } else if (d->low.index < d->high.index) {
+    rc = emit_entry(d, &d->low);
+    return rc == SUCCESS ? emit_entry(d, &d->high) : rc;
+  }
+  rc = emit_entry(d, &d->high);
+  return rc == SUCCESS ? emit_entry(d, &d->low) : rc;
+}
+
+int lttb_add(decimator* d, const decimate_entry* e) {
+  decimate_entry* swap;
+  int rc;
+
+  d->last = *e;
+  if (d->seen == 1) {
+    /* The first entry is always kept. */
+    d->chosen = *e;
+    return emit_entry(d, e);
+  }
+  d->filling[d->nfilling++] = *e;
+  d->sum_time += e->time;
+  d->sum_value += e->value;
+  if (d->nfilling < d->bucket) {
+    return SUCCESS;
+  }
+
+  rc = SUCCESS;
+  if (d->npending > 0) {
+    rc = lttb_choose(d, d->sum_time / d->nfilling,
+        d->sum_value / d->nfilling);
+  }
+  swap = d->pending;
+  d->pending = d->filling;
+  d->npending = d->nfilling;
+  d->filling = swap;
+  d->nfilling = 0;
+  d->sum_time = 0;
+  d->sum_value = 0;
+  return rc;
+}
+
+/* Emits the pending entry making the largest triangle with the last entry
+ * chosen and the point given. */
+int lttb_choose(decimator* d, double next_time, double next_value) {
+  const decimate_entry* a = &d->chosen;
+  const decimate_entry* b;
+  uint64_t best;
+  double best_area;
+  double area;
+  uint64_t i;
+
+  best = 0;
+  best_area = -1;
+  for (i = 0; i < d->npending; i++) {
+    b = &d->pending[i];
+    /* Twice the area, which picks the same entry. */
+    area = (a->time - next_time) * (b->value - a->value)
+        - (a->time - b->time) * (next_value - a->value);
+    area = area < 0 ? -area : area;
+    if (area > best_area) {
+      best_area = area;
+      best = i;
+    }
+  }
+  d->chosen = d->pending[best];
+  d->npending = 0;
+  return emit_entry(d, &d->chosen);
+}
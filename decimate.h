@@ -0,0 +1,82 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Streaming decimation of log entries, for logs too long to plot every
+ * entry of. Entries are grouped into buckets of a fixed number of entries,
+ * and from each bucket either the entries holding the lowest and highest
+ * value of a field are kept (minmax), or the one entry that best keeps the
+ * shape of the plot of that field (Largest-Triangle-Three-Buckets). Both run
+ * in one pass, holding at most two buckets of entries.
+ */
+
+#ifndef DECIMATE_H_
+#define DECIMATE_H_
+
+#include <stdint.h>
+
+#include "colfile.h"
+#include "flags.h"
+#include "powerlog6s.h"
+
+#define DECIMATE_NONE 0
+#define DECIMATE_MINMAX 1
+#define DECIMATE_LTTB 2
+
+DECLARE_string(decimate);
+
+/* Receives each entry kept, in order. Returns SUCCESS or an error code from
+ * rc.h, which stops decimation. */
+typedef int (*decimate_emit)(void* arg, const powerlog6s* log);
+
+struct _decimate_entry {
+  powerlog6s log;
+  uint64_t index; /* of the entry in the log */
+  double time; /* cumulative milliseconds */
+  double value; /* of the field decimated on */
+};
+
+struct _decimator {
+  int mode;
+  int field; /* index into the fields decimated on, see --decimate_field */
+  uint64_t bucket; /* entries per bucket */
+  decimate_emit emit;
+  void* arg;
+  struct _colfile_clock clock;
+  uint64_t seen; /* entries added */
+  uint64_t emitted; /* index, plus one, of the last entry emitted */
+
+  /* minmax: the extremes of the current bucket. */
+  uint64_t count;
+  struct _decimate_entry low;
+  struct _decimate_entry high;
+
+  /* LTTB: the bucket being chosen from waits for the next one to fill, as
+   * the choice depends on the next bucket's average. */
+  struct _decimate_entry* pending;
+  uint64_t npending;
+  struct _decimate_entry* filling;
+  uint64_t nfilling;
+  double sum_time; /* of filling */
+  double sum_value;
+  struct _decimate_entry chosen; /* last entry emitted */
+  struct _decimate_entry last; /* last entry added */
+};
+
+typedef struct _decimate_entry decimate_entry;
+typedef struct _decimator decimator;
+
+void fregister_decimate();
+
+/* Whether --decimate asks for anything. */
+int decimating();
+/* Sets up d from the flags to pass the entries it keeps to emit. total is
+ * how many entries are expected, for --decimate_points, or 0 if unknown.
+ * Returns SUCCESS or an error code from rc.h. */
+int decimator_init(decimator* d, uint64_t total, decimate_emit emit,
+    void* arg);
+int decimator_add(decimator* d, const powerlog6s* log);
+/* Emits whatever is still held back and frees d, which then needs
+ * decimator_init() again before more entries can be added. */
+int decimator_finish(decimator* d);
+
+#endif  /* DECIMATE_H_ */
@@ -0,0 +1,252 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Compact encoding of a stream of log entries. Differences are taken modulo
+ * each field's size, so every value round trips exactly, wrapping included.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "delta.h"
+
+struct _delta_field {
+  size_t offset;
+  int size; /* bytes */
+};
+
+/* Interval must stay first, it's the one stored as a difference of
+ * differences. len isn't stored at all, it's always the same. */
+const struct _delta_field kDeltaFields[DELTA_FIELDS] = {
+  { offsetof(powerlog6s, interval), 4 },
+  { offsetof(powerlog6s, type), 1 },
+  { offsetof(powerlog6s, state), 1 },
+  { offsetof(powerlog6s, current), 2 },
+  { offsetof(powerlog6s, voltage), 2 },
+  { offsetof(powerlog6s, energy), 4 },
+  { offsetof(powerlog6s, cell) + 0, 2 },
+  { offsetof(powerlog6s, cell) + 2, 2 },
+  { offsetof(powerlog6s, cell) + 4, 2 },
+  { offsetof(powerlog6s, cell) + 6, 2 },
+  { offsetof(powerlog6s, cell) + 8, 2 },
+  { offsetof(powerlog6s, cell) + 10, 2 },
+  { offsetof(powerlog6s, rpm), 2 },
+  { offsetof(powerlog6s, internal_temperature), 2 },
+  { offsetof(powerlog6s, temperature) + 0, 2 },
+  { offsetof(powerlog6s, temperature) + 2, 2 },
+  { offsetof(powerlog6s, temperature) + 4, 2 },
+  { offsetof(powerlog6s, period), 2 },
+  { offsetof(powerlog6s, pulse), 2 }
+};
+
+uint32_t delta_get(const powerlog6s* log, int field);
+void delta_set(powerlog6s* log, int field, uint32_t value);
+uint32_t delta_mask(int field);
+uint32_t zigzag(uint32_t value, int field);
+uint32_t unzigzag(uint32_t value, int field);
+
+void delta_encoder_init(delta_encoder* e) {
+  memset(e, 0, sizeof(delta_encoder));
+}
+
+int delta_encoder_add(delta_encoder* e, const powerlog6s* log) {
+  struct _delta_state* state = &e->state;
+  uint32_t* values = e->values[e->count];
+  uint32_t value;
+  uint32_t diff;
+  int i;
+
+  for (i = 0; i < DELTA_FIELDS; i++) {
+    value = delta_get(log, i);
+    diff = (value - state->prev[i]) & delta_mask(i);
+    state->prev[i] = value;
+    if (i == 0) {
+      values[i] = zigzag(diff - state->step, i);
+      state->step = diff;
+    } else {
+      values[i] = zigzag(diff, i);
+    }
+  }
+  return ++e->count == DELTA_FRAME;
+}
+
+size_t delta_encoder_frame(delta_encoder* e, unsigned char* out) {
+  unsigned char* p = out;
+  uint32_t used[DELTA_FIELDS];
+  uint8_t* widths;
+  uint64_t bits;
+  int pending;
+  uint32_t n;
+  int i;
+
+  if (e->count == 0) {
+    return 0;
+  }
+  *p++ = (unsigned char) e->count;
+  widths = p;
+  p += DELTA_FIELDS;
+
+  /* Each field gets as many bits as its largest value in the frame needs. */
+  memset(used, 0, sizeof(used));
+  for (n = 0; n < e->count; n++) {
+    for (i = 0; i < DELTA_FIELDS; i++) {
+      used[i] |= e->values[n][i];
+    }
+  }
+  for (i = 0; i < DELTA_FIELDS; i++) {
+    for (widths[i] = 0; used[i]; used[i] >>= 1) {
+      widths[i]++;
+    }
+  }
+
+  bits = 0;
+  pending = 0;
+  for (n = 0; n < e->count; n++) {
+    for (i = 0; i < DELTA_FIELDS; i++) {
+      bits |= (uint64_t) e->values[n][i] << pending;
+      pending += widths[i];
+      while (pending >= 8) {
+        *p++ = (unsigned char) bits;
+        bits >>= 8;
+        pending -= 8;
+      }
+    }
+  }
+  if (pending > 0) {
+    *p++ = (unsigned char) bits;
+  }
+  e->count = 0;
+  return p - out;
+}
+
+void delta_decoder_init(delta_decoder* d) {
+  memset(d, 0, sizeof(delta_decoder));
+}
+
+int delta_decode(delta_decoder* d, const unsigned char* data, size_t len,
+    powerlog6s* logs, size_t* consumed) {
+  struct _delta_state* state = &d->state;
+  const unsigned char* widths;
+  const unsigned char* p;
+  uint64_t frame_bits;
+  uint64_t bits;
+  uint32_t value;
+  int pending;
+  int count;
+  int n;
+  int i;
+
+  *consumed = 0;
+  if (!d->started) {
+    if (len < DELTA_MAGIC_LEN) {
+      return 0;
+    } else if (memcmp(data, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0) {
+      return -1;
+    }
+    d->started = 1;
+    *consumed = DELTA_MAGIC_LEN;
+    return 0;
+  }
+
+  if (len < 1 + DELTA_FIELDS) {
+    return 0;
+  }
+  count = data[0];
+  widths = data + 1;
+  if (count == 0 || count > DELTA_FRAME) {
+    return -1;
+  }
+  frame_bits = 0;
+  for (i = 0; i < DELTA_FIELDS; i++) {
+    if (widths[i] > 8 * kDeltaFields[i].size) {
+      return -1;
+    }
+    frame_bits += widths[i];
+  }
+  frame_bits *= count;
+  if (len < 1 + DELTA_FIELDS + (frame_bits + 7) / 8) {
+    return 0;
+  }
+
+  p = data + 1 + DELTA_FIELDS;
+  bits = 0;
+  pending = 0;
+  for (n = 0; n < count; n++) {
+    memset(&logs[n], 0, sizeof(powerlog6s));
+    logs[n].len = sizeof(powerlog6s);
+    for (i = 0; i < DELTA_FIELDS; i++) {
+      while (pending < widths[i]) {
+        bits |= (uint64_t) *p++ << pending;
+        pending += 8;
+      }
+      value = (uint32_t) (bits & (((uint64_t) 1 << widths[i]) - 1));
+      bits >>= widths[i];
+      pending -= widths[i];
+
+      if (i == 0) {
+        state->step = (state->step + unzigzag(value, i)) & delta_mask(i);
+        value = state->step;
+      } else {
+        value = unzigzag(value, i);
+      }
+      state->prev[i] = (state->prev[i] + value) & delta_mask(i);
+      delta_set(&logs[n], i, state->prev[i]);
+    }
+  }
+  *consumed = 1 + DELTA_FIELDS + (frame_bits + 7) / 8;
+  return count;
+}
+
+uint32_t delta_get(const powerlog6s* log, int field) {
+  const unsigned char* p = (const unsigned char*) log
+      + kDeltaFields[field].offset;
+  uint16_t u16;
+  uint32_t u32;
+
+  switch (kDeltaFields[field].size) {
+    case 1:
+      return *p;
+    case 2:
+      memcpy(&u16, p, 2);
+      return u16;
+    default:
+      memcpy(&u32, p, 4);
+      return u32;
+  }
+}
+
+void delta_set(powerlog6s* log, int field, uint32_t value) {
+  unsigned char* p = (unsigned char*) log + kDeltaFields[field].offset;
+  uint16_t u16;
+
+  switch (kDeltaFields[field].size) {
+    case 1:
+      *p = (unsigned char) value;
+      break;
+    case 2:
+      u16 = (uint16_t) value;
+      memcpy(p, &u16, 2);
+      break;
+    default:
+      memcpy(p, &value, 4);
+      break;
+  }
+}
+
+uint32_t delta_mask(int field) {
+  return kDeltaFields[field].size == 4 ? 0xffffffffu
+      : (1u << (8 * kDeltaFields[field].size)) - 1;
+}
+
+/* Maps small differences of either sign to small unsigned values: 0, -1, 1,
+ * -2, 2... become 0, 1, 2, 3, 4... */
+uint32_t zigzag(uint32_t value, int field) {
+  int shift = 32 - 8 * kDeltaFields[field].size;
+  int32_t sign = (int32_t) (value << shift) >> shift;
+
+  return (((uint32_t) sign << 1) ^ (uint32_t) (sign >> 31)) & delta_mask(field);
+}
+
+uint32_t unzigzag(uint32_t value, int field) {
+  return ((value >> 1) ^ (0 - (value & 1))) & delta_mask(field);
+}
@@ -0,0 +1,70 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Compact encoding of a stream of log entries. Consecutive entries differ
+ * very little, so each field is stored as the zigzag encoded difference from
+ * the previous entry (the difference of differences for interval, which
+ * steps regularly), and those are bit-packed a frame of entries at a time
+ * using only as many bits per field as the frame needs. Fields that don't
+ * change within a frame cost nothing.
+ *
+ * Stream: magic "PL6SDLT1", then frames of
+ *   uint8 number of entries (1 to DELTA_FRAME)
+ *   uint8 bit width of each of the DELTA_FIELDS fields
+ *   the packed values, entry by entry and field by field within an entry,
+ *   least significant bit first, padded to a whole byte
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "powerlog6s.h"
+
+#define DELTA_MAGIC "PL6SDLT1"
+#define DELTA_MAGIC_LEN 8
+#define DELTA_FRAME 128
+#define DELTA_FIELDS 19
+/* Largest possible encoded frame. */
+#define DELTA_FRAME_MAX (1 + DELTA_FIELDS + DELTA_FRAME * DELTA_FIELDS * 4)
+
+/* What both sides remember of the previous entry. */
+struct _delta_state {
+  uint32_t prev[DELTA_FIELDS];
+  uint32_t step; /* last difference between intervals */
+};
+
+struct _delta_encoder {
+  struct _delta_state state;
+  uint32_t count; /* entries in the frame being built */
+  uint32_t values[DELTA_FRAME][DELTA_FIELDS];
+};
+
+struct _delta_decoder {
+  struct _delta_state state;
+  int started; /* magic has been seen */
+};
+
+typedef struct _delta_encoder delta_encoder;
+typedef struct _delta_decoder delta_decoder;
+
+void delta_encoder_init(delta_encoder* e);
+/* Adds an entry to the current frame, returning 1 if the frame is now full
+ * and should be written out with delta_encoder_frame(). */
+int delta_encoder_add(delta_encoder* e, const powerlog6s* log);
+/* Writes out the entries added so far as one frame into out, which must
+ * have room for DELTA_FRAME_MAX bytes. Returns the bytes written, 0 if there
+ * were no entries. */
+size_t delta_encoder_frame(delta_encoder* e, unsigned char* out);
+
+void delta_decoder_init(delta_decoder* d);
+/* Decodes the magic or one frame from the len bytes at data into logs, which
+ * must have room for DELTA_FRAME entries. Returns the number of entries
+ * decoded and sets consumed to the bytes used up. Returns 0 with consumed 0 if
+ * more data is needed to make progress, or -1 if the data is corrupt. */
+int delta_decode(delta_decoder* d, const unsigned char* data, size_t len,
+    powerlog6s* logs, size_t* consumed);
+
+#endif  /* DELTA_H_ */
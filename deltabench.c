@@ -0,0 +1,210 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Measures the delta encoding (--format=delta): how small it makes a log and
+ * how fast it encodes and decodes. Logs come from binary captures
+ * (--binary) given as arguments, or are synthesized like the simulator's.
+ * Every decoded entry is checked against the original.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "flags.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "simdevice.h"
+#include "timing.h"
+
+DEFINE_uint64(records, 1000000, "Log entries to synthesize when no "
+    "captures are given");
+DEFINE_int64(passes, 5, "Times to encode and decode, taking the fastest");
+
+void fregister_deltabench() {
+  REGISTER(passes);
+  REGISTER(records);
+}
+
+powerlog6s* load_captures(int count, char** paths, size_t* n);
+powerlog6s* synthesize(size_t n);
+size_t encode(const powerlog6s* logs, size_t n, unsigned char* out);
+int decode(const unsigned char* data, size_t len, powerlog6s* logs,
+    size_t* n);
+
+int main(int argc, char** argv) {
+  powerlog6s* logs;
+  powerlog6s* decoded;
+  unsigned char* encoded;
+  double encode_time;
+  double decode_time;
+  double start;
+  double elapsed;
+  double raw_mb;
+  size_t bytes;
+  size_t n;
+  size_t m;
+  int pass;
+
+  fregister_deltabench();
+  fregister_simdevice();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (argc > 1) {
+    logs = load_captures(argc - 1, argv + 1, &n);
+  } else {
+    n = FLAGS_records;
+    logs = synthesize(n);
+  }
+  if (!logs || n == 0) {
+    fprintf(stderr, "No log entries to encode.\n");
+    return USER_SUCKS;
+  }
+  /* Worst case every frame is full width. */
+  encoded = (unsigned char*) malloc(DELTA_MAGIC_LEN
+      + (n / DELTA_FRAME + 1) * DELTA_FRAME_MAX);
+  decoded = (powerlog6s*) malloc((n + DELTA_FRAME) * sizeof(powerlog6s));
+  if (!encoded || !decoded) {
+    perror("Failed to allocate buffers");
+    return OUTPUT_ERROR;
+  }
+
+  encode_time = 0;
+  decode_time = 0;
+  bytes = 0;
+  for (pass = 0; pass < FLAGS_passes || pass == 0; pass++) {
+    start = timing_now();
+    bytes = encode(logs, n, encoded);
+    elapsed = timing_now() - start;
+    if (pass == 0 || elapsed < encode_time) {
+      encode_time = elapsed;
+    }
+    start = timing_now();
+    if (decode(encoded, bytes, decoded, &m) != SUCCESS) {
+      fprintf(stderr, "Encoded log failed to decode.\n");
+      return BAD_MESSAGE_LENGTH;
+    }
+    elapsed = timing_now() - start;
+    if (pass == 0 || elapsed < decode_time) {
+      decode_time = elapsed;
+    }
+  }
+  if (m != n || memcmp(logs, decoded, n * sizeof(powerlog6s)) != 0) {
+    fprintf(stderr, "Decoded log doesn't match the original.\n");
+    return BAD_MESSAGE_LENGTH;
+  }
+
+  raw_mb = n * sizeof(powerlog6s) / 1e6;
+  fprintf(stderr, "%zu entries, %zu bytes raw, %zu bytes encoded, "
+      "%.2f bits per entry, ratio %.1f:1\n", n, n * sizeof(powerlog6s), bytes,
+      8.0 * bytes / n, (double) n * sizeof(powerlog6s) / bytes);
+  fprintf(stderr, "encode %.1f MB/s (%.2f M entries/s), "
+      "decode %.1f MB/s (%.2f M entries/s), of raw data\n",
+      raw_mb / encode_time, n / encode_time / 1e6,
+      raw_mb / decode_time, n / decode_time / 1e6);
+  free(logs);
+  free(decoded);
+  free(encoded);
+  return SUCCESS;
+}
+
+/* Reads whole records out of binary captures, skipping anything that isn't
+ * one. */
+powerlog6s* load_captures(int count, char** paths, size_t* n) {
+  powerlog6s* logs;
+  powerlog6s* grown;
+  size_t cap;
+  FILE* f;
+  int i;
+
+  logs = NULL;
+  cap = 0;
+  *n = 0;
+  for (i = 0; i < count; i++) {
+    f = fopen(paths[i], "rb");
+    if (!f) {
+      perror(paths[i]);
+      free(logs);
+      return NULL;
+    }
+    for (;;) {
+      if (*n == cap) {
+        cap = cap ? 2 * cap : 65536;
+        grown = (powerlog6s*) realloc(logs, cap * sizeof(powerlog6s));
+        if (!grown) {
+          perror("Failed to allocate log entries");
+          fclose(f);
+          free(logs);
+          return NULL;
+        }
+        logs = grown;
+      }
+      if (fread(&logs[*n], sizeof(powerlog6s), 1, f) != 1) {
+        break;
+      }
+      if (logs[*n].len == sizeof(powerlog6s)
+          && (logs[*n].type == POWERLOG6S_ONLINE
+              || logs[*n].type == POWERLOG6S_OFFLINE)) {
+        (*n)++;
+      }
+    }
+    fclose(f);
+  }
+  return logs;
+}
+
+powerlog6s* synthesize(size_t n) {
+  powerlog6s* logs;
+  sim_synth synth;
+  size_t i;
+
+  logs = (powerlog6s*) malloc(n * sizeof(powerlog6s));
+  if (!logs) {
+    perror("Failed to allocate log entries");
+    return NULL;
+  }
+  sim_synth_init(&synth, POWERLOG6S_OFFLINE, 100);
+  for (i = 0; i < n; i++) {
+    sim_synth_record(&synth, &logs[i]);
+  }
+  return logs;
+}
+
+size_t encode(const powerlog6s* logs, size_t n, unsigned char* out) {
+  delta_encoder e;
+  unsigned char* p;
+  size_t i;
+
+  delta_encoder_init(&e);
+  memcpy(out, DELTA_MAGIC, DELTA_MAGIC_LEN);
+  p = out + DELTA_MAGIC_LEN;
+  for (i = 0; i < n; i++) {
+    if (delta_encoder_add(&e, &logs[i])) {
+      p += delta_encoder_frame(&e, p);
+    }
+  }
+  p += delta_encoder_frame(&e, p);
+  return p - out;
+}
+
+int decode(const unsigned char* data, size_t len, powerlog6s* logs,
+    size_t* n) {
+  delta_decoder d;
+  size_t consumed;
+  int count;
+
+  delta_decoder_init(&d);
+  *n = 0;
+  while (len > 0) {
+    count = delta_decode(&d, data, len, logs + *n, &consumed);
+    if (count < 0 || consumed == 0) {
+      return BAD_MESSAGE_LENGTH;
+    }
+    *n += count;
+    data += consumed;
+    len -= consumed;
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Source of raw reports, and the hidapi backend for it.
+ */
+
+#include <stdlib.h>
+
+#include "device.h"
+
+int hid_backend_read(log_device* device, unsigned char* buf, size_t len);
+int hid_backend_read_timeout(log_device* device, unsigned char* buf,
+    size_t len, int milliseconds);
+const wchar_t* hid_backend_error(log_device* device);
+void hid_backend_close(log_device* device);
+
+log_device_ops hid_backend_ops = {
+  "hidapi",
+  hid_backend_read,
+  hid_backend_read_timeout,
+  hid_backend_error,
+  hid_backend_close
+};
+
+log_device* device_from_hid(hid_device* hid) {
+  log_device* device;
+
+  if (!hid) {
+    return NULL;
+  }
+  device = (log_device*) malloc(sizeof(log_device));
+  if (!device) {
+    hid_close(hid);
+    return NULL;
+  }
+  device->ops = &hid_backend_ops;
+  device->impl = hid;
+  return device;
+}
+
+int device_read(log_device* device, unsigned char* buf, size_t len) {
+  return device->ops->read(device, buf, len);
+}
+
+int device_read_timeout(log_device* device, unsigned char* buf, size_t len,
+    int milliseconds) {
+  return device->ops->read_timeout(device, buf, len, milliseconds);
+}
+
+const wchar_t* device_error(log_device* device) {
+  return device->ops->error(device);
+}
+
+void device_close(log_device* device) {
+  device->ops->close(device);
+}
+
+int hid_backend_read(log_device* device, unsigned char* buf, size_t len) {
+  return hid_read((hid_device*) device->impl, buf, len);
+}
+
+int hid_backend_read_timeout(log_device* device, unsigned char* buf,
+    size_t len, int milliseconds) {
+  return hid_read_timeout((hid_device*) device->impl, buf, len, milliseconds);
+}
+
+const wchar_t* hid_backend_error(log_device* device) {
+  return hid_error((hid_device*) device->impl);
+}
+
+void hid_backend_close(log_device* device) {
+  hid_close((hid_device*) device->impl);
+  free(device);
+}
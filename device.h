@@ -0,0 +1,47 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Source of raw reports. Hides whether reports come from a real USB HID
+ * device through hidapi or from one of the alternative backends, such as the
+ * simulator, so the rest of powerup only ever deals with a log_device.
+ */
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+#include <stddef.h>
+#include <wchar.h>
+
+#include "hidapi.h"
+
+struct _log_device;
+
+/* Backend implementation. All functions follow hidapi's conventions: reads
+ * return the number of bytes read, 0 if nothing arrived in time and -1 on
+ * error, with error() describing the last error. */
+struct _log_device_ops {
+  char* name;
+  int (*read)(struct _log_device* device, unsigned char* buf, size_t len);
+  int (*read_timeout)(struct _log_device* device, unsigned char* buf,
+      size_t len, int milliseconds);
+  const wchar_t* (*error)(struct _log_device* device);
+  void (*close)(struct _log_device* device);
+};
+
+struct _log_device {
+  struct _log_device_ops* ops;
+  void* impl; /* backend specific state */
+};
+
+typedef struct _log_device log_device;
+typedef struct _log_device_ops log_device_ops;
+
+log_device* device_from_hid(hid_device* hid);
+
+int device_read(log_device* device, unsigned char* buf, size_t len);
+int device_read_timeout(log_device* device, unsigned char* buf, size_t len,
+    int milliseconds);
+const wchar_t* device_error(log_device* device);
+void device_close(log_device* device);
+
+#endif  /* DEVICE_H_ */
@@ -0,0 +1,108 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Measures how long finding and opening a device takes at startup, by
+ * enumerating every HID device as without --device_cache and by going
+ * straight to the path remembered in the cache. Needs a real device, picked
+ * with the usual --vendor, --product and --serial flags. The cache is a
+ * temporary file of its own, never one powerup uses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "flags.h"
+#include "hidselect.h"
+#include "rc.h"
+#include "simdevice.h"
+#include "timing.h"
+
+DEFINE_int64(passes, 20, "Times to find and open the device each way");
+
+/* The private cache, removed at exit however that comes. */
+char bench_cache[] = "/tmp/devicebench-XXXXXX";
+
+void fregister_devicebench() {
+  REGISTER(passes);
+}
+
+double time_open(double* fastest);
+void remove_cache();
+
+int main(int argc, char** argv) {
+  double enumerated;
+  double cached;
+  double fastest_enumerated;
+  double fastest_cached;
+  int64_t pass;
+  int fd;
+
+  fregister_devicebench();
+  fregister_hidselect();
+  fregister_simdevice();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (argc > 1 || FLAGS_passes < 1 || multiple_devices()
+      || FLAGS_device_cache) {
+    fprintf(stderr, "Usage: devicebench [--passes=N] [--vendor=...] "
+        "[--product=...] [--serial=...]\n");
+    return USER_SUCKS;
+  }
+  if (FLAGS_simulate) {
+    fprintf(stderr, "Simulated devices don't need finding.\n");
+    return USER_SUCKS;
+  }
+  fd = mkstemp(bench_cache);
+  if (fd < 0) {
+    perror(bench_cache);
+    return OUTPUT_ERROR;
+  }
+  close(fd);
+  FLAGS_device_cache = bench_cache;
+  atexit(remove_cache);
+  hidselect_verbose = 0;
+
+  enumerated = 0;
+  fastest_enumerated = 0;
+  for (pass = 0; pass < FLAGS_passes; pass++) {
+    unlink(FLAGS_device_cache);
+    enumerated += time_open(&fastest_enumerated);
+  }
+  /* The last pass left the cache filled in. */
+  cached = 0;
+  fastest_cached = 0;
+  for (pass = 0; pass < FLAGS_passes; pass++) {
+    cached += time_open(&fastest_cached);
+  }
+
+  printf("Enumerating: %.3f ms on average, %.3f ms at best\n",
+      enumerated / FLAGS_passes * 1e3, fastest_enumerated * 1e3);
+  printf("Cached:      %.3f ms on average, %.3f ms at best (%.1fx faster)\n",
+      cached / FLAGS_passes * 1e3, fastest_cached * 1e3,
+      cached > 0 ? enumerated / cached : 0.0);
+  return SUCCESS;
+}
+
+/* Finds, opens and closes the device, returning how long the first two
+ * took. open_device() exits if there's no device. */
+double time_open(double* fastest) {
+  log_device* device;
+  double start;
+  double elapsed;
+
+  start = timing_now();
+  device = open_device();
+  elapsed = timing_now() - start;
+  device_close(device);
+  if (*fastest == 0 || elapsed < *fastest) {
+    *fastest = elapsed;
+  }
+  return elapsed;
+}
+
+void remove_cache() {
+  unlink(bench_cache);
+}
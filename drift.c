@@ -0,0 +1,140 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Host timestamps, and fitting the device's clock to the host's.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "drift.h"
+
+/* Host seconds per device millisecond of a device keeping perfect time. */
+#define DRIFT_NOMINAL_RATE 0.001
+/* Milliseconds of a log, by the device's clock, before the fit's rate is
+ * taken as the device's drift. */
+#define DRIFT_MIN_SPAN_MS 10000
+
+DEFINE_bool(host_time, 0, "Stamp each entry with when its report was read, "
+    "and when the device logged it by the host's clock, correcting for the "
+    "device's clock drifting and the jitter of USB (see drift.h). Adds two "
+    "columns of microseconds since the epoch to CSV, or a 16 byte "
+    "drift_record after each binary record, which convert back into the "
+    "columns, and prints the drift and latency from arrival to being "
+    "written at exit");
+DEFINE_uint64(drift_window_ms, 600000, "Milliseconds of the device's time "
+    "over which --host_time forgets older entries when fitting its clock");
+
+void fregister_drift() {
+  REGISTER(drift_window_ms);
+  REGISTER(host_time);
+}
+
+char* format_microseconds(char* p, int64_t us);
+
+void drift_init(drift* d) {
+  memset(d, 0, sizeof(drift));
+}
+
+void drift_correct(drift* d, const powerlog6s* log, double arrival,
+    double realtime, drift_record* r) {
+  double decay;
+  double rate;
+  double host;
+  double dx;
+  double x;
+
+  r->arrived = (int64_t) (realtime * 1e6);
+  r->logged = 0;
+  if (log->type != POWERLOG6S_ONLINE) {
+    return;
+  }
+  if (d->entries == 0 || log->interval < d->last) {
+    /* A new log, with the interval starting again. */
+    d->first = log->interval;
+    d->last = log->interval;
+    d->entries = 0;
+    d->weight = 0;
+    d->var_x = 0;
+    d->cov_xy = 0;
+  }
+  x = (double) (log->interval - d->first);
+  decay = FLAGS_drift_window_ms
+      ? exp(-(double) (log->interval - d->last) / FLAGS_drift_window_ms) : 1;
+
+  /* Weighted running means and sums of deviations, updated as in West's
+   * algorithm so they keep their precision however long the log runs. */
+  d->weight = d->weight * decay + 1;
+  dx = x - d->mean_x;
+  d->mean_x += dx / d->weight;
+  d->mean_y += (arrival - d->mean_y) / d->weight;
+  d->var_x = d->var_x * decay + dx * (x - d->mean_x);
+  d->cov_xy = d->cov_xy * decay + dx * (arrival - d->mean_y);
+  d->last = log->interval;
+  d->entries++;
+  d->fitted++;
+  /* The fit of a few entries is rough, but good enough for their times.
+   * With just one, go by the last log's rate, or the nominal one. */
+  if (d->var_x > 0) {
+    rate = d->cov_xy / d->var_x;
+    if (x >= DRIFT_MIN_SPAN_MS) {
+      d->rate = rate;
+    }
+  } else {
+    rate = d->rate ? d->rate : DRIFT_NOMINAL_RATE;
+  }
+  host = d->mean_y + rate * (x - d->mean_x);
+  metric_histogram_add(&d->jitter, (uint64_t) (fabs(arrival - host) * 1e9));
+  r->logged = (int64_t) ((host + realtime - arrival) * 1e6);
+}
+
+double drift_ppm(const drift* d) {
+  return d->rate ? (DRIFT_NOMINAL_RATE / d->rate - 1) * 1e6 : 0;
+}
+
+size_t drift_csv_format(const drift_record* r, char* out) {
+  char* p = out;
+
+  *p++ = ',';
+  p = format_microseconds(p, r->arrived);
+  *p++ = ',';
+  if (r->logged) {
+    p = format_microseconds(p, r->logged);
+  }
+  return p - out;
+}
+
+size_t drift_csv_format_entry(const powerlog6s* log, const drift_record* r,
+    char* out) {
+  size_t len;
+
+  len = powerlog6s_csv_format(log, out);
+  /* The times go before the newline, but not on marker comments. */
+  if (r && log->type != POWERLOG6S_GAP) {
+    len += drift_csv_format(r, out + len - 1) - 1;
+    out[len++] = '\n';
+  }
+  return len;
+}
+
+char* format_microseconds(char* p, int64_t us) {
+  char digits[20];
+  uint64_t n;
+  int i;
+
+  if (us < 0) {
+    *p++ = '-';
+    n = -(uint64_t) us;
+  } else {
+    n = (uint64_t) us;
+  }
+  i = 0;
+  do {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  while (i) {
+    *p++ = digits[--i];
+  }
+  return p;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Host timestamps for each entry (--host_time), and a running fit of the
+ * device's clock against the host's to correct them with.
+ *
+ * Each report is stamped with CLOCK_MONOTONIC and CLOCK_REALTIME as the read
+ * that returned it comes back. That's when the host saw it, which is after
+ * the device logged it by however long it sat in USB and kernel queues, a
+ * wait that varies from one report to the next. The device only says when
+ * it logged an entry by its own clock, as the interval in milliseconds since
+ * the log began, and that clock runs fast or slow by however far its
+ * crystal is off.
+ *
+ * For entries logged live, the fit is a least squares line of arrival
+ * against interval over the current log, with older entries forgotten
+ * exponentially over --drift_window_ms of the device's time so it follows
+ * the crystal as it warms up. Reading the line at an entry's interval gives
+ * when it was logged, by the host's clock, less the jitter of delivery and
+ * the device's drift. What the fit can't tell apart from the device's own
+ * offset is the average delay of delivery, which stays in. Entries
+ * downloaded from the device's memory were logged long before they arrived,
+ * so have no such time.
+ */
+
+#ifndef DRIFT_H_
+#define DRIFT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flags.h"
+#include "metrics.h"
+#include "powerlog6s.h"
+
+/* What --host_time adds to each CSV line, and the most it writes there. */
+#define DRIFT_CSV_COLUMNS ",arrived (us),logged (us)\n"
+#define DRIFT_CSV_MAX 42
+
+/* What a --binary capture with --host_time starts with, to tell it from one
+ * of bare records. */
+#define DRIFT_MAGIC "PL6STIM1"
+#define DRIFT_MAGIC_LEN 8
+
+/* The times of an entry, written after it with --format=binary. Both are
+ * microseconds since the epoch by CLOCK_REALTIME. */
+struct _drift_record {
+  int64_t arrived; /* when the report holding it was read */
+  int64_t logged; /* when the fit says the device logged it, or 0 */
+};
+
+struct _drift {
+  uint32_t first; /* interval of the first entry of the current log */
+  uint32_t last; /* of the last one fitted */
+  uint64_t entries; /* fitted in the current log */
+  uint64_t fitted; /* ever */
+  double weight; /* of the entries fitted, decaying with the device's time */
+  double mean_x; /* weighted mean of interval - first, in milliseconds */
+  double mean_y; /* and of arrival, in seconds by timing_now() */
+  double var_x; /* weighted sums of squared deviations from the means */
+  double cov_xy;
+  double rate; /* host seconds per device millisecond, 0 till known */
+  metric_histogram jitter; /* of arrivals about the fit */
+};
+
+typedef struct _drift_record drift_record;
+typedef struct _drift drift;
+
+DECLARE_bool(host_time);
+
+void fregister_drift();
+
+void drift_init(drift* d);
+/* Fits an entry whose report was read at arrival, by timing_now(), and
+ * realtime, by timing_realtime(), and fills in its times. */
+void drift_correct(drift* d, const powerlog6s* log, double arrival,
+    double realtime, drift_record* r);
+/* How far the device's clock runs fast of the host's, in parts per
+ * million, or 0 till there's been enough of a log to tell. */
+double drift_ppm(const drift* d);
+/* Writes an entry's times as CSV columns, each starting with a comma, into
+ * out, which must have room for DRIFT_CSV_MAX bytes. Returns the number of
+ * bytes written. */
+size_t drift_csv_format(const drift_record* r, char* out);
+/* Writes an entry as a line of CSV with its times, if r isn't NULL, before
+ * the newline, into out, which must have room for POWERLOG6S_CSV_MAX +
+ * DRIFT_CSV_MAX bytes. Marker comments go without. Returns the number of
+ * bytes written. */
+size_t drift_csv_format_entry(const powerlog6s* log, const drift_record* r,
+    char* out);
+
+#endif  /* DRIFT_H_ */
@@ -0,0 +1,306 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Flight recorder files: a fixed number of slots, memory mapped and
+ * overwritten in a circle. See flight.h for the layout.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "rc.h"
+
+#include "flight.h"
+
+/* Zeros written at a time when allocating a new file. */
+#define FLIGHT_ALLOCATE_CHUNK (1 << 20)
+
+DEFINE_string(flight_recorder, NULL, "Rather than writing output, record "
+    "entries in a file of fixed size named by this, with %s replaced by the "
+    "device's serial number, overwriting the oldest once it's full. Picks up "
+    "after whatever an existing file holds. Read it with powerflight");
+DEFINE_uint64(flight_bytes, 64 << 20, "Size of a new --flight_recorder "
+    "file, which holds an entry per 64 bytes after a 4096 byte header");
+
+void fregister_flight() {
+  REGISTER(flight_bytes);
+  REGISTER(flight_recorder);
+}
+
+char* flight_path(const char* name);
+int flight_allocate(int fd, size_t len, const char* path);
+int flight_check(const flight* f, const char* path, size_t size);
+
+int flight_enabled() {
+  return FLAGS_flight_recorder != NULL;
+}
+
+int flight_check_pattern(int several) {
+  if (FLAGS_flight_bytes < FLIGHT_HEADER_SIZE + FLIGHT_SLOT_SIZE) {
+    fprintf(stderr, "--flight_bytes must be at least %d.\n",
+        FLIGHT_HEADER_SIZE + FLIGHT_SLOT_SIZE);
+    return USER_SUCKS;
+  }
+  if (several && !strstr(FLAGS_flight_recorder, "%s")) {
+    fprintf(stderr, "--flight_recorder must contain %%s to capture from "
+        "several devices.\n");
+    return USER_SUCKS;
+  }
+  return SUCCESS;
+}
+
+int flight_open(flight* f, const char* name) {
+  struct stat st;
+  char* path;
+  int created;
+  int rc;
+
+  memset(f, 0, sizeof(flight));
+  f->capacity = (FLAGS_flight_bytes - FLIGHT_HEADER_SIZE) / FLIGHT_SLOT_SIZE;
+  f->len = FLIGHT_HEADER_SIZE + f->capacity * FLIGHT_SLOT_SIZE;
+  path = flight_path(name);
+  if (!path) {
+    perror("Failed to name flight recorder file");
+    return OUTPUT_ERROR;
+  }
+  f->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    perror(path);
+    free(path);
+    return OUTPUT_ERROR;
+  }
+  created = st.st_size == 0;
+  rc = SUCCESS;
+  if (created) {
+    rc = flight_allocate(f->fd, f->len, path);
+  } else if ((uint64_t) st.st_size != f->len) {
+    fprintf(stderr, "%s is %llu bytes rather than the %llu of "
+        "--flight_bytes.\n", path, (unsigned long long) st.st_size,
+        (unsigned long long) f->len);
+    rc = USER_SUCKS;
+  }
+  if (rc == SUCCESS) {
+    f->header = (flight_header*) mmap(NULL, f->len, PROT_READ | PROT_WRITE,
+        MAP_SHARED, f->fd, 0);
+    if (f->header == MAP_FAILED) {
+      perror(path);
+      f->header = NULL;
+      rc = OUTPUT_ERROR;
+    } else {
+      f->slots = (flight_slot*) ((char*) f->header + FLIGHT_HEADER_SIZE);
+    }
+  }
+  if (rc == SUCCESS && created) {
+    memcpy(f->header->magic, FLIGHT_MAGIC, FLIGHT_MAGIC_LEN);
+    f->header->version = FLIGHT_VERSION;
+    f->header->slot_size = FLIGHT_SLOT_SIZE;
+    f->header->capacity = f->capacity;
+    f->header->head = 1;
+    f->header->tail = 1;
+  }
+  if (rc == SUCCESS) {
+    rc = flight_check(f, path, f->len);
+  }
+  free(path);
+  if (rc != SUCCESS) {
+    if (f->header) {
+      munmap(f->header, f->len);
+    }
+    close(f->fd);
+    return rc;
+  }
+  /* Take up after anything written since the header was last updated. */
+  flight_range(f, &f->tail, &f->head);
+  f->header->tail = f->tail;
+  f->header->head = f->head;
+  return SUCCESS;
+}
+
+void flight_add(flight* f, const powerlog6s* log) {
+  struct timeval now;
+  flight_slot* s;
+  uint64_t n;
+
+  n = f->head;
+  s = &f->slots[n % f->capacity];
+  if (n - f->tail >= f->capacity) {
+    f->tail = n - f->capacity + 1;
+    __atomic_store_n(&f->header->tail, f->tail, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&s->number, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  gettimeofday(&now, NULL);
+  s->time = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+  memcpy(&s->log, log, sizeof(powerlog6s));
+  __atomic_store_n(&s->number, n, __ATOMIC_RELEASE);
+  f->head = n + 1;
+  __atomic_store_n(&f->header->head, f->head, __ATOMIC_RELEASE);
+}
+
+int flight_close(flight* f) {
+  int rc;
+
+  rc = SUCCESS;
+  if (msync(f->header, f->len, MS_SYNC) != 0) {
+    perror("Failed to write back flight recorder");
+    rc = OUTPUT_ERROR;
+  }
+  munmap(f->header, f->len);
+  close(f->fd);
+  return rc;
+}
+
+int flight_map(flight* f, const char* path) {
+  struct stat st;
+  int rc;
+
+  memset(f, 0, sizeof(flight));
+  f->fd = open(path, O_RDONLY);
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    perror(path);
+    return OUTPUT_ERROR;
+  }
+  if (st.st_size < FLIGHT_HEADER_SIZE + FLIGHT_SLOT_SIZE) {
+    fprintf(stderr, "%s isn't a flight recorder file.\n", path);
+    close(f->fd);
+    return USER_SUCKS;
+  }
+  f->len = st.st_size;
+  f->header = (flight_header*) mmap(NULL, f->len, PROT_READ, MAP_SHARED,
+      f->fd, 0);
+  if (f->header == MAP_FAILED) {
+    perror(path);
+    close(f->fd);
+    return OUTPUT_ERROR;
+  }
+  f->slots = (flight_slot*) ((char*) f->header + FLIGHT_HEADER_SIZE);
+  f->capacity = f->header->capacity;
+  rc = flight_check(f, path, f->len);
+  if (rc != SUCCESS) {
+    flight_unmap(f);
+  }
+  return rc;
+}
+
+void flight_unmap(flight* f) {
+  munmap(f->header, f->len);
+  close(f->fd);
+}
+
+int flight_read(const flight* f, uint64_t n, flight_slot* slot) {
+  const flight_slot* s;
+
+  s = &f->slots[n % f->capacity];
+  if (__atomic_load_n(&s->number, __ATOMIC_ACQUIRE) != n) {
+    return 0;
+  }
+  memcpy(slot, s, sizeof(flight_slot));
+  /* Only whole if the writer didn't start on the slot while copying. */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&s->number, __ATOMIC_RELAXED) == n;
+}
+
+/* The header may lag behind the slots, or after a crash the slots lag
+ * behind the header, so both ends are checked against the slots' numbers. */
+void flight_range(const flight* f, uint64_t* tail, uint64_t* head) {
+  uint64_t h;
+  uint64_t t;
+  uint64_t i;
+
+  t = __atomic_load_n(&f->header->tail, __ATOMIC_ACQUIRE);
+  h = __atomic_load_n(&f->header->head, __ATOMIC_ACQUIRE);
+  for (i = 0; i < f->capacity && __atomic_load_n(
+      &f->slots[h % f->capacity].number, __ATOMIC_ACQUIRE) == h; i++) {
+    h++;
+  }
+  if (t == 0 || t > h) {
+    t = h;
+  }
+  if (h - t > f->capacity) {
+    t = h - f->capacity;
+  }
+  while (t < h && __atomic_load_n(&f->slots[t % f->capacity].number,
+      __ATOMIC_ACQUIRE) != t) {
+    t++;
+  }
+  /* Numbering starts at 1, even in a file torn before anything was. */
+  *tail = t > 0 ? t : 1;
+  *head = h > 0 ? h : 1;
+}
+
+/* Expands %s in --flight_recorder to the device's name, and %% to %. */
+char* flight_path(const char* name) {
+  const char* p;
+  char* path;
+  size_t len;
+
+  len = strlen(FLAGS_flight_recorder) * (strlen(name) + 1) + 1;
+  path = (char*) malloc(len);
+  if (!path) {
+    return NULL;
+  }
+  len = 0;
+  for (p = FLAGS_flight_recorder; *p; p++) {
+    if (p[0] == '%' && p[1] == 's') {
+      len += sprintf(path + len, "%s", name);
+      p++;
+    } else if (p[0] == '%' && p[1] == '%') {
+      path[len++] = '%';
+      p++;
+    } else {
+      path[len++] = *p;
+    }
+  }
+  path[len] = '\0';
+  return path;
+}
+
+/* Writes zeros over the whole of a new file, rather than leaving it sparse,
+ * so the disk can't run out of room for it later on, which would only show
+ * up as a SIGBUS on writing to the mapping. */
+int flight_allocate(int fd, size_t len, const char* path) {
+  char* zeros;
+  size_t done;
+  size_t n;
+  ssize_t written;
+
+  zeros = (char*) calloc(1, FLIGHT_ALLOCATE_CHUNK);
+  if (!zeros) {
+    perror("Failed to allocate flight recorder file");
+    return OUTPUT_ERROR;
+  }
+  for (done = 0; done < len; done += written) {
+    n = len - done < FLIGHT_ALLOCATE_CHUNK ? len - done
+        : FLIGHT_ALLOCATE_CHUNK;
+    written = pwrite(fd, zeros, n, done);
+    if (written <= 0) {
+      perror(path);
+      free(zeros);
+      return OUTPUT_ERROR;
+    }
+  }
+  free(zeros);
+  return SUCCESS;
+}
+
+int flight_check(const flight* f, const char* path, size_t size) {
+  const flight_header* h = f->header;
+
+  if (memcmp(h->magic, FLIGHT_MAGIC, FLIGHT_MAGIC_LEN) != 0
+      || h->slot_size != FLIGHT_SLOT_SIZE || h->capacity == 0
+      || size != FLIGHT_HEADER_SIZE + h->capacity * FLIGHT_SLOT_SIZE) {
+    fprintf(stderr, "%s isn't a flight recorder file.\n", path);
+    return USER_SUCKS;
+  }
+  if (h->version > FLIGHT_VERSION) {
+    fprintf(stderr, "%s is from a newer version, %u.\n", path, h->version);
+    return USER_SUCKS;
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Flight recorder: a file of fixed size, allocated up front and memory
+ * mapped, holding the most recent log entries in a circle, so unattended
+ * capture can run forever in bounded space. Adding an entry is a few stores
+ * to memory, with no system call; the kernel writes the pages back.
+ *
+ * The file is a header page, then capacity slots of FLIGHT_SLOT_SIZE bytes.
+ * Entries are numbered from 1 on, and entry n is in slot n % capacity, which
+ * also records n. The header's head and tail give the entries held, from
+ * tail up to but not including head. A slot is cleared before it's
+ * rewritten and numbered once it's whole, and head only moves on after, so
+ * whatever state a crash leaves the file in, slots whose number is wrong
+ * are simply skipped. Opening the file again picks up where it left off.
+ */
+
+#ifndef FLIGHT_H_
+#define FLIGHT_H_
+
+#include <stdint.h>
+
+#include "flags.h"
+#include "powerlog6s.h"
+
+#define FLIGHT_MAGIC "PL6SRING"
+#define FLIGHT_MAGIC_LEN 8
+#define FLIGHT_VERSION 1
+#define FLIGHT_HEADER_SIZE 4096
+#define FLIGHT_SLOT_SIZE 64
+
+struct _flight_header {
+  char magic[FLIGHT_MAGIC_LEN];
+  uint32_t version;
+  uint32_t slot_size;
+  uint64_t capacity; /* slots */
+  uint64_t head; /* number the next entry gets */
+  uint64_t tail; /* number of the oldest entry held */
+};
+
+struct _flight_slot {
+  uint64_t number; /* of the entry held, 0 while being written */
+  int64_t time; /* milliseconds since the epoch when it was recorded */
+  powerlog6s log;
+  unsigned char padding[FLIGHT_SLOT_SIZE - 16 - sizeof(powerlog6s)];
+};
+
+typedef struct _flight_header flight_header;
+typedef struct _flight_slot flight_slot;
+
+struct _flight {
+  flight_header* header;
+  flight_slot* slots;
+  uint64_t capacity;
+  uint64_t head; /* this writer's copies of the header's */
+  uint64_t tail;
+  size_t len; /* of the mapping */
+  int fd;
+};
+
+typedef struct _flight flight;
+
+DECLARE_string(flight_recorder);
+
+void fregister_flight();
+
+int flight_enabled();
+/* Checks --flight_recorder can name a file for each of several devices.
+ * Returns SUCCESS or USER_SUCKS. */
+int flight_check_pattern(int several);
+
+/* Opens or creates the flight recorder file for the device called name,
+ * picking up after whatever it already holds. Returns SUCCESS,
+ * OUTPUT_ERROR or USER_SUCKS if it doesn't match --flight_bytes. */
+int flight_open(flight* f, const char* name);
+/* Records an entry, overwriting the oldest if the file is full. */
+void flight_add(flight* f, const powerlog6s* log);
+/* Writes the file back to disk and unmaps it. Returns SUCCESS or
+ * OUTPUT_ERROR. */
+int flight_close(flight* f);
+
+/* Maps an existing file to read, as flight_open() would but without
+ * writing to it, so it can be read while still being recorded into. */
+int flight_map(flight* f, const char* path);
+void flight_unmap(flight* f);
+/* Copies entry number n into slot, returning 0 if it's been overwritten or
+ * is being written. */
+int flight_read(const flight* f, uint64_t n, flight_slot* slot);
+/* The entries currently held, from *tail up to *head. */
+void flight_range(const flight* f, uint64_t* tail, uint64_t* head);
+
+#endif  /* FLIGHT_H_ */
@@ -0,0 +1,128 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Writing and checking framed blocks of log entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "rc.h"
+#include "timing.h"
+
+#include "frame.h"
+
+uint32_t frame_crc(const frame_header* h, const unsigned char* records);
+
+int frame_writer_init(frame_writer* w, output* out, uint32_t max) {
+  memset(w, 0, sizeof(frame_writer));
+  w->out = out;
+  w->max = max;
+  w->records = (unsigned char*) malloc((size_t) max * sizeof(powerlog6s));
+  if (!w->records) {
+    perror("Failed to allocate frame");
+    return OUTPUT_ERROR;
+  }
+  return output_write(out, FRAME_MAGIC, FRAME_MAGIC_LEN);
+}
+
+int frame_writer_add(frame_writer* w, const powerlog6s* log) {
+  if (w->count == 0) {
+    w->started = timing_now();
+  }
+  memcpy(w->records + (size_t) w->count * sizeof(powerlog6s), log,
+      sizeof(powerlog6s));
+  if (++w->count == w->max) {
+    return frame_writer_seal(w);
+  }
+  return SUCCESS;
+}
+
+int frame_writer_seal(frame_writer* w) {
+  frame_header h;
+  char* block;
+  size_t len;
+
+  if (w->count == 0) {
+    return SUCCESS;
+  }
+  len = (size_t) w->count * sizeof(powerlog6s);
+  h.sync = FRAME_SYNC;
+  h.sequence = w->sequence++;
+  h.count = w->count;
+  h.reserved = 0;
+  h.crc = frame_crc(&h, w->records);
+  w->count = 0;
+  /* Small blocks go in one piece, big ones through output_write(). */
+  if (sizeof(h) + len <= w->out->cap) {
+    block = output_reserve(w->out, sizeof(h) + len);
+    if (!block) {
+      return OUTPUT_ERROR;
+    }
+    memcpy(block, &h, sizeof(h));
+    memcpy(block + sizeof(h), w->records, len);
+    output_commit(w->out, sizeof(h) + len);
+    return SUCCESS;
+  }
+  if (output_write(w->out, &h, sizeof(h)) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  return output_write(w->out, w->records, len);
+}
+
+int frame_writer_close(frame_writer* w) {
+  int rc;
+
+  rc = frame_writer_seal(w);
+  free(w->records);
+  w->records = NULL;
+  return rc;
+}
+
+size_t frame_block_at(const unsigned char* data, size_t len,
+    frame_header* h) {
+  size_t block;
+
+  if (len < sizeof(frame_header)) {
+    return 0;
+  }
+  memcpy(h, data, sizeof(frame_header));
+  if (h->sync != FRAME_SYNC || h->count == 0 || h->count > FRAME_MAX_RECORDS
+      || h->reserved != 0) {
+    return 0;
+  }
+  block = sizeof(frame_header) + (size_t) h->count * sizeof(powerlog6s);
+  if (block > len || frame_crc(h, data + sizeof(frame_header)) != h->crc) {
+    return 0;
+  }
+  return block;
+}
+
+size_t frame_next_sync(const unsigned char* data, size_t len, size_t from) {
+  const unsigned char* p;
+  uint32_t sync;
+
+  for (from++; from + sizeof(sync) <= len; from = p - data + 1) {
+    p = (const unsigned char*) memchr(data + from, FRAME_SYNC & 0xff,
+        len - from);
+    if (!p || (size_t) (p - data) + sizeof(sync) > len) {
+      break;
+    }
+    memcpy(&sync, p, sizeof(sync));
+    if (sync == FRAME_SYNC) {
+      return p - data;
+    }
+  }
+  return len;
+}
+
+/* Covers the header after crc, then the entries. */
+uint32_t frame_crc(const frame_header* h, const unsigned char* records) {
+  uint32_t crc;
+
+  crc = crc32c(0, &h->sequence, sizeof(frame_header)
+      - offsetof(frame_header, sequence));
+  return crc32c(crc, records, (size_t) h->count * sizeof(powerlog6s));
+}
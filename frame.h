@@ -0,0 +1,68 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Framed binary output: packed log entries grouped into blocks, each
+ * checksummed and numbered, so whatever a crash or power cut does to the
+ * end of a file, or a bad disk to the middle, every block left whole can be
+ * found and trusted.
+ *
+ * A file is FRAME_MAGIC, then blocks. Each block is a frame_header and
+ * count packed powerlog6s entries. The header starts with FRAME_SYNC, to
+ * find the next block from anywhere in a damaged file, and its crc is the
+ * CRC32C of everything in the block after it. Blocks are numbered from 0 in
+ * each file, so a reader can tell where whole blocks went missing.
+ */
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "powerlog6s.h"
+
+#define FRAME_MAGIC "PL6SFRM1"
+#define FRAME_MAGIC_LEN 8
+#define FRAME_SYNC 0x4b4c4246 /* "FBLK" */
+#define FRAME_MAX_RECORDS 65536
+
+struct _frame_header {
+  uint32_t sync; /* FRAME_SYNC */
+  uint32_t crc;
+  uint64_t sequence; /* blocks before this one in the file */
+  uint32_t count; /* entries in the block, 1 to FRAME_MAX_RECORDS */
+  uint32_t reserved; /* 0 */
+};
+
+typedef struct _frame_header frame_header;
+
+struct _frame_writer {
+  output* out;
+  unsigned char* records; /* the block being filled */
+  uint32_t count;
+  uint32_t max; /* entries per block */
+  uint64_t sequence; /* of the block being filled */
+  double started; /* when its first entry was added */
+};
+
+typedef struct _frame_writer frame_writer;
+
+/* Writes FRAME_MAGIC and prepares blocks of up to max entries. Returns
+ * SUCCESS or OUTPUT_ERROR. */
+int frame_writer_init(frame_writer* w, output* out, uint32_t max);
+/* Adds an entry, writing the block out once it's full. */
+int frame_writer_add(frame_writer* w, const powerlog6s* log);
+/* Writes out the block being filled, if it has anything in it. */
+int frame_writer_seal(frame_writer* w);
+/* Seals the last block and frees w. */
+int frame_writer_close(frame_writer* w);
+
+/* Length of the whole block at data, checked against its checksum, or 0 if
+ * there isn't one there among the len bytes. Copies its header into h. */
+size_t frame_block_at(const unsigned char* data, size_t len,
+    frame_header* h);
+/* Offset after from of the next place a block might start, or len. */
+size_t frame_next_sync(const unsigned char* data, size_t len, size_t from);
+
+#endif  /* FRAME_H_ */
@@ -4,40 +4,93 @@
  * Finds and opens the USB HID device from which to read log data.
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <wchar.h>
 
 #include "flags.h"
 #include "rc.h"
+#include "simdevice.h"
 
 #include "hidselect.h"
 
 #define MAX_PATH_LEN 512
+#define MAX_SERIAL_LEN 128
+
+/* Whether hidapi has hid_get_device_info(), from 0.13. */
+#if defined(HID_API_VERSION) && defined(HID_API_MAKE_VERSION)
+#if HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+#define HIDSELECT_DEVICE_INFO 1
+#endif
+#endif
+#ifndef HIDSELECT_DEVICE_INFO
+#define HIDSELECT_DEVICE_INFO 0
+#endif
 
 DEFINE_uint64(vendor, 0x0483, "Vendor ID of the USB device");
 DEFINE_uint64(product, 0x5750, "Product ID of the USB device");
-DEFINE_string(serial, NULL, "Serial number of the USB device");
+DEFINE_string(serial, NULL, "Serial number of the USB device. Several "
+    "devices can be captured at once by separating their serials with commas");
 DEFINE_string(device_path, NULL, "Path uniquely identifying the USB device, "
     "as an alternative to vendor/product/serial identification");
+DEFINE_bool(all_devices, 0, "Capture from every device matching --vendor and "
+    "--product at once, rather than just the first one found");
+DEFINE_string(device_cache, NULL, "File remembering the path each device "
+    "was last found at, by vendor, product and serial number, so it can be "
+    "opened straight away rather than after enumerating every HID device. "
+    "The device found there is checked by serial number, vendor and "
+    "product, and enumeration only happens if it's gone");
+
+int hidselect_verbose = 1;
+
+/* Paths of the devices pick_devices() found with no serial number, by the
+ * number in the "deviceN" names it gave them, where reopen_device() looks
+ * for them again. Only written before capture starts. */
+char* unnamed_paths[MAX_DEVICES];
+
+/* Held by cache_store(), which captures losing their devices at once may
+ * all call. */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void fregister_hidselect() {
+  REGISTER(device_cache);
+  REGISTER(all_devices);
   REGISTER(device_path);
   REGISTER(serial);
   REGISTER(product);
   REGISTER(vendor);
 }
 
+int cache_lookup(const char* key, char* path, char* serial);
+void cache_store(const char* key, const char* path, const char* serial);
+hid_device* open_cached(const char* key, char* serial);
+const char* unnamed_path(const char* name);
+int open_cached_devices(log_device** devices, char** names, int max);
+int matches_ids(struct hid_device_info* info);
+int opened_ids_match(hid_device* hid, const char* path, int checked);
 void list_devices();
-char* pick_device(char* path_buf);
+char* pick_device(char* path_buf, char* serial, const char* wanted,
+    int verbose);
+log_device* reopen_simulated(const char* name);
+int pick_devices(char** paths, char** names, int max);
 void print_device(struct hid_device_info* info);
-void strtowcs(char* str, wchar_t* buf);
+int serial_listed(const wchar_t* serial, const char* list);
+void wcstostr(const wchar_t* str, char* buf, size_t len);
 
-hid_device* open_device() {
-  hid_device* device;
+int multiple_devices() {
+  return FLAGS_all_devices || (FLAGS_serial && strchr(FLAGS_serial, ','))
+      || (FLAGS_simulate && strchr(FLAGS_simulate, ','));
+}
+
+log_device* open_device() {
+  log_device* device;
+  hid_device* hid;
   char path_buf[MAX_PATH_LEN];
+  char serial[MAX_SERIAL_LEN];
   char* path;
 
   if (FLAGS_serial && FLAGS_device_path) {
@@ -45,72 +98,469 @@ hid_device* open_device() {
         "--serial and --device_path, not both.\n");
     exit(USER_SUCKS);
   }
+  if (FLAGS_simulate) {
+    device = sim_open(FLAGS_simulate, 0);
+    if (!device) {
+      fprintf(stderr, "Failed to open simulated device %s.\n",
+          FLAGS_simulate);
+      exit(DEVICE_ERROR);
+    }
+    return device;
+  }
   path = FLAGS_device_path;
+  if (!path && FLAGS_device_cache) {
+    hid = open_cached(FLAGS_serial ? FLAGS_serial : "*", serial);
+    if (hid) {
+      return device_from_hid(hid);
+    }
+  }
   if (!path) {
-    path = pick_device(path_buf);
+    path = pick_device(path_buf, serial, FLAGS_serial, hidselect_verbose);
   }
   if (!path) {
-    fprintf(stderr, "PowerLog 6S not found. All detected devices:\n");
-    list_devices();
     exit(DEVICE_MISSING);
   }
-  device = hid_open_path(path);
+  device = device_from_hid(hid_open_path(path));
   if (!device) {
     fprintf(stderr, "Failed to open device %s.\n", path);
     exit(DEVICE_ERROR);
   }
+  if (FLAGS_device_cache && !FLAGS_device_path) {
+    cache_store(FLAGS_serial ? FLAGS_serial : "*", path, serial);
+  }
+  return device;
+}
+
+log_device* reopen_device(const char* name) {
+  char path_buf[MAX_PATH_LEN];
+  char serial[MAX_SERIAL_LEN];
+  const char* key;
+  hid_device* hid;
+  char* path;
+
+  if (FLAGS_simulate) {
+    return reopen_simulated(name);
+  } else if (FLAGS_device_path) {
+    return device_from_hid(hid_open_path(FLAGS_device_path));
+  }
+  /* Several devices are told apart by their serial numbers, which name
+   * them, or by where they were found if they have none. */
+  path = name ? (char*) unnamed_path(name) : NULL;
+  if (path) {
+    hid = hid_open_path(path);
+    if (hid && !opened_ids_match(hid, path, 0)) {
+      hid_close(hid);
+      hid = NULL;
+    }
+    return device_from_hid(hid);
+  }
+  key = name ? name : FLAGS_serial ? FLAGS_serial : "*";
+  if (FLAGS_device_cache) {
+    hid = open_cached(key, serial);
+    if (hid) {
+      return device_from_hid(hid);
+    }
+  }
+  path = pick_device(path_buf, serial, name ? name : FLAGS_serial, 0);
+  if (!path) {
+    return NULL;
+  }
+  hid = hid_open_path(path);
+  if (hid && FLAGS_device_cache) {
+    cache_store(key, path, serial);
+  }
+  return device_from_hid(hid);
+}
+
+/* Where the device pick_devices() named name was found, if it has no serial
+ * number, or NULL. */
+const char* unnamed_path(const char* name) {
+  int n;
+
+  if (strncmp(name, "device", 6) != 0) {
+    return NULL;
+  }
+  n = atoi(name + 6);
+  return n >= 1 && n <= MAX_DEVICES ? unnamed_paths[n - 1] : NULL;
+}
+
+/* Opens the simulated device called name again, the nth of --simulate for
+ * "simn". */
+log_device* reopen_simulated(const char* name) {
+  log_device* device;
+  char* sources;
+  char* source;
+  char* saved;
+  int unit;
+  int n;
+
+  if (!name) {
+    return sim_open(FLAGS_simulate, 0);
+  }
+  unit = atoi(name + 3);
+  n = unit;
+  sources = strdup(FLAGS_simulate);
+  for (source = strtok_r(sources, ",", &saved); source && n > 1;
+      source = strtok_r(NULL, ",", &saved)) {
+    n--;
+  }
+  device = source ? sim_open(source, unit) : NULL;
+  free(sources);
   return device;
 }
 
+int open_devices(log_device** devices, char** names, int max) {
+  char* paths[MAX_DEVICES];
+  char* source;
+  char* sources;
+  char* saved;
+  char name[32];
+  int n;
+  int i;
+
+  if (FLAGS_device_path) {
+    fprintf(stderr, "--device_path identifies a single device and can't be "
+        "combined with --all_devices or a list of --serial numbers.\n");
+    exit(USER_SUCKS);
+  }
+  if (max > MAX_DEVICES) {
+    max = MAX_DEVICES;
+  }
+
+  n = 0;
+  if (FLAGS_simulate) {
+    /* A comma separated list of simulated devices to open. */
+    sources = strdup(FLAGS_simulate);
+    for (source = strtok_r(sources, ",", &saved); source && n < max;
+        source = strtok_r(NULL, ",", &saved)) {
+      devices[n] = sim_open(source, n + 1);
+      if (!devices[n]) {
+        fprintf(stderr, "Failed to open simulated device %s.\n", source);
+        exit(DEVICE_ERROR);
+      }
+      snprintf(name, sizeof(name), "sim%d", n + 1);
+      names[n++] = strdup(name);
+    }
+    free(sources);
+    return n;
+  }
+
+  /* A list of serials can all come from the cache, but finding every
+   * device there is always needs enumeration. */
+  if (FLAGS_device_cache && FLAGS_serial && !FLAGS_all_devices) {
+    n = open_cached_devices(devices, names, max);
+    if (n > 0) {
+      return n;
+    }
+  }
+  n = pick_devices(paths, names, max);
+  if (n == 0) {
+    exit(DEVICE_MISSING);
+  }
+  for (i = 0; i < n; i++) {
+    devices[i] = device_from_hid(hid_open_path(paths[i]));
+    if (!devices[i]) {
+      fprintf(stderr, "Failed to open device %s.\n", paths[i]);
+      exit(DEVICE_ERROR);
+    }
+    if (FLAGS_device_cache && !FLAGS_all_devices) {
+      cache_store(names[i], paths[i], names[i]);
+    }
+    free(paths[i]);
+  }
+  return n;
+}
+
+/* Looks up the device last found for key, either a serial number or "*" for
+ * whichever device matched the vendor and product, filling in its path and
+ * serial number. Returns whether there was one. */
+int cache_lookup(const char* key, char* path, char* serial) {
+  char line[MAX_PATH_LEN + 2 * MAX_SERIAL_LEN + 32];
+  char entry_key[MAX_SERIAL_LEN];
+  unsigned int vendor;
+  unsigned int product;
+  int found;
+  FILE* f;
+
+  f = fopen(FLAGS_device_cache, "r");
+  if (!f) {
+    return 0;
+  }
+  found = 0;
+  while (!found && fgets(line, sizeof(line), f)) {
+    /* vendor product key serial path, with - for no serial. */
+    found = sscanf(line, "%x %x %127s %127s %511[^\n]", &vendor, &product,
+        entry_key, serial, path) == 5 && vendor == FLAGS_vendor
+        && product == FLAGS_product && strcmp(entry_key, key) == 0;
+  }
+  fclose(f);
+  if (found && strcmp(serial, "-") == 0) {
+    serial[0] = '\0';
+  }
+  return found;
+}
+
+/* Remembers where the device for key was found, replacing whatever was there
+ * before. The file is rewritten under a unique name and renamed into place,
+ * so never seen half written, and rewrites by other threads wait so none of
+ * their entries are lost. Failures only cost the next startup some time, so
+ * are ignored. */
+void cache_store(const char* key, const char* path, const char* serial) {
+  char line[MAX_PATH_LEN + 2 * MAX_SERIAL_LEN + 32];
+  char entry_key[MAX_SERIAL_LEN];
+  char* temp;
+  unsigned int vendor;
+  unsigned int product;
+  FILE* in;
+  FILE* out;
+  int fd;
+
+  if (strlen(key) >= MAX_SERIAL_LEN || strlen(path) >= MAX_PATH_LEN
+      || strchr(key, ' ') || strchr(serial, ' ')) {
+    return;
+  }
+  temp = (char*) malloc(strlen(FLAGS_device_cache) + 8);
+  if (!temp) {
+    return;
+  }
+  sprintf(temp, "%s.XXXXXX", FLAGS_device_cache);
+  pthread_mutex_lock(&cache_lock);
+  fd = mkstemp(temp);
+  out = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!out) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(temp);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(temp);
+    return;
+  }
+  in = fopen(FLAGS_device_cache, "r");
+  while (in && fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "%x %x %127s", &vendor, &product, entry_key) != 3
+        || vendor != FLAGS_vendor || product != FLAGS_product
+        || strcmp(entry_key, key) != 0) {
+      fputs(line, out);
+    }
+  }
+  if (in) {
+    fclose(in);
+  }
+  fprintf(out, "%04x %04x %s %s %s\n", (unsigned int) FLAGS_vendor,
+      (unsigned int) FLAGS_product, key, *serial ? serial : "-", path);
+  if (fclose(out) != 0 || rename(temp, FLAGS_device_cache) != 0) {
+    unlink(temp);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(temp);
+}
+
+/* Opens the device cached for key if it's still where it was, checked by
+ * serial number, which is filled in. */
+hid_device* open_cached(const char* key, char* serial) {
+  char path[MAX_PATH_LEN];
+  wchar_t actual[MAX_SERIAL_LEN];
+  hid_device* hid;
+
+  if (!cache_lookup(key, path, serial)) {
+    return NULL;
+  }
+  hid = hid_open_path(path);
+  if (!hid) {
+    return NULL;
+  }
+  /* Another device may have been plugged in where this one was. */
+  if ((*serial && (hid_get_serial_number_string(hid, actual, MAX_SERIAL_LEN)
+      != 0 || !serial_listed(actual, serial)))
+      || !opened_ids_match(hid, path, *serial != '\0')) {
+    hid_close(hid);
+    return NULL;
+  }
+  if (hidselect_verbose) {
+    fprintf(stderr, "Found cached device %s --device_path '%s'\n",
+        *serial ? serial : "with no serial number", path);
+  }
+  return hid;
+}
+
+/* Opens every device in --serial from the cache, or none of them if any
+ * can't be. */
+int open_cached_devices(log_device** devices, char** names, int max) {
+  char serial[MAX_SERIAL_LEN];
+  char* listed;
+  char* token;
+  char* saved;
+  hid_device* hid;
+  int n;
+
+  n = 0;
+  listed = strdup(FLAGS_serial);
+  for (token = strtok_r(listed, ",", &saved); token;
+      token = strtok_r(NULL, ",", &saved)) {
+    hid = n < max ? open_cached(token, serial) : NULL;
+    if (!hid) {
+      while (n > 0) {
+        n--;
+        device_close(devices[n]);
+        free(names[n]);
+      }
+      break;
+    }
+    devices[n] = device_from_hid(hid);
+    names[n++] = strdup(token);
+  }
+  free(listed);
+  return n;
+}
+
+int matches_ids(struct hid_device_info* info) {
+  return info->vendor_id == FLAGS_vendor && info->product_id == FLAGS_product;
+}
+
+/* Whether the device opened at path has --vendor and --product. hidapi
+ * from 0.13 says so straight away. Older ones can only tell by enumerating,
+ * if only the devices with those IDs, which is left out if the serial
+ * number has already been checked. */
+int opened_ids_match(hid_device* hid, const char* path, int checked) {
+#if HIDSELECT_DEVICE_INFO
+  struct hid_device_info* info;
+
+  (void) path;
+  (void) checked;
+  info = hid_get_device_info(hid);
+  return info && matches_ids(info);
+#else
+  struct hid_device_info* iter;
+  struct hid_device_info* curr;
+  int found;
+
+  (void) hid;
+  if (checked) {
+    return 1;
+  }
+  found = 0;
+  iter = hid_enumerate(FLAGS_vendor, FLAGS_product);
+  for (curr = iter; curr && !found; curr = curr->next) {
+    found = matches_ids(curr) && strcmp(curr->path, path) == 0;
+  }
+  hid_free_enumeration(iter);
+  return found;
+#endif
+}
+
+/* Lists every HID device, to help find the right IDs when none matched. */
 void list_devices() {
   struct hid_device_info* iter;
   struct hid_device_info* curr;
 
+  fprintf(stderr, "PowerLog 6S not found. All detected devices:\n");
   iter = hid_enumerate(0, 0);
-  curr = iter;
-  while (curr) {
+  for (curr = iter; curr; curr = curr->next) {
     print_device(curr);
-    curr = curr->next;
   }
   hid_free_enumeration(iter);
 }
 
-char* pick_device(char* path_buf) {
+/* Finds the device to capture from, one of the serials in wanted or any if
+ * it's NULL, filling in its path and serial number. Returns NULL, having
+ * listed what devices there are if verbose, if there isn't one. Only
+ * devices with --vendor and --product are enumerated. */
+char* pick_device(char* path_buf, char* serial, const char* wanted,
+    int verbose) {
   char* path;
-  wchar_t* sid;
   struct hid_device_info* iter;
   struct hid_device_info* curr;
 
   path = NULL;
-  if (FLAGS_serial) {
-    sid = (wchar_t*) malloc((strlen(FLAGS_serial) + 1) * sizeof(wchar_t));
-    strtowcs(FLAGS_serial, sid);
-  } else {
-    sid = NULL;
-  }
   iter = hid_enumerate(FLAGS_vendor, FLAGS_product);
-  curr = iter;
-  while (curr) {
-    if (!sid || (sid && wcscmp(curr->serial_number, sid) == 0)) {
-      if (path) {
+  for (curr = iter; curr; curr = curr->next) {
+    if (!matches_ids(curr) || (wanted
+        && !serial_listed(curr->serial_number, wanted))) {
+      continue;
+    }
+    if (path) {
+      if (verbose) {
         fprintf(stderr, "Ignoring extra device ");
-      } else {
-        fprintf(stderr, "Found ");
-        strncpy(path_buf, curr->path, MAX_PATH_LEN);
-        path = path_buf;
+        print_device(curr);
       }
+      continue;
+    }
+    strncpy(path_buf, curr->path, MAX_PATH_LEN - 1);
+    path_buf[MAX_PATH_LEN - 1] = '\0';
+    path = path_buf;
+    serial[0] = '\0';
+    if (curr->serial_number) {
+      wcstostr(curr->serial_number, serial, MAX_SERIAL_LEN);
+    }
+    if (verbose) {
+      fprintf(stderr, "Found ");
       print_device(curr);
     }
-    curr = curr->next;
   }
   hid_free_enumeration(iter);
-  if (sid) {
-    free(sid);
+  if (!path && verbose) {
+    list_devices();
   }
-
   return path;
 }
 
+/* Finds every device to capture from, either all of them or those listed in
+ * --serial. Paths and names are allocated, for the caller to free. */
+int pick_devices(char** paths, char** names, int max) {
+  struct hid_device_info* iter;
+  struct hid_device_info* curr;
+  char serial[MAX_SERIAL_LEN];
+  char* listed;
+  char* token;
+  char* saved;
+  int n;
+  int i;
+
+  n = 0;
+  iter = hid_enumerate(FLAGS_vendor, FLAGS_product);
+  for (curr = iter; curr; curr = curr->next) {
+    if (!matches_ids(curr) || (FLAGS_serial
+        && !serial_listed(curr->serial_number, FLAGS_serial))) {
+      continue;
+    }
+    if (n == max) {
+      fprintf(stderr, "Ignoring extra device ");
+    } else {
+      fprintf(stderr, "Found ");
+      if (curr->serial_number && *curr->serial_number != '\0') {
+        wcstostr(curr->serial_number, serial, sizeof(serial));
+      } else {
+        snprintf(serial, sizeof(serial), "device%d", n + 1);
+        unnamed_paths[n] = strdup(curr->path);
+      }
+      paths[n] = strdup(curr->path);
+      names[n++] = strdup(serial);
+    }
+    print_device(curr);
+  }
+  hid_free_enumeration(iter);
+  if (n == 0) {
+    list_devices();
+  }
+
+  /* Every serial asked for must have been found. */
+  if (FLAGS_serial) {
+    listed = strdup(FLAGS_serial);
+    for (token = strtok_r(listed, ",", &saved); token;
+        token = strtok_r(NULL, ",", &saved)) {
+      for (i = 0; i < n && strcmp(names[i], token) != 0; i++) {
+      }
+      if (i == n) {
+        fprintf(stderr, "No device found with serial '%s'.\n", token);
+        exit(DEVICE_MISSING);
+      }
+    }
+    free(listed);
+  }
+  return n;
+}
+
 void print_device(struct hid_device_info* info) {
   fprintf(stderr, "%ls, %ls\n",
       info->product_string, info->manufacturer_string);
@@ -122,8 +572,35 @@ void print_device(struct hid_device_info* info) {
   fprintf(stderr, "\n    --device_path '%s'\n", info->path);
 }
 
-void strtowcs(char *str, wchar_t* buf) {
-  while (*str) {
-    *buf++ = *str++;
+/* Whether serial is one of the comma separated serials in list, compared
+ * without converting either. */
+int serial_listed(const wchar_t* serial, const char* list) {
+  const char* p;
+  size_t i;
+
+  if (!serial) {
+    return 0;
+  }
+  p = list;
+  for (;;) {
+    for (i = 0; serial[i] && p[i] && p[i] != ','
+        && (wchar_t) p[i] == serial[i]; i++) {
+    }
+    if (!serial[i] && (p[i] == ',' || p[i] == '\0')) {
+      return 1;
+    }
+    p = strchr(p, ',');
+    if (!p) {
+      return 0;
+    }
+    p++;
+  }
+}
+
+void wcstostr(const wchar_t* str, char* buf, size_t len) {
+  while (*str && len > 1) {
+    *buf++ = (char) *str++;
+    len--;
   }
+  *buf = '\0';
 }
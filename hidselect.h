@@ -7,9 +7,26 @@
 #ifndef HIDSELECT_H_
 #define HIDSELECT_H_
 
-#include "hidapi.h"
+#include "device.h"
+#include "flags.h"
+
+#define MAX_DEVICES 64
+
+DECLARE_string(device_cache);
+
+/* Whether to say which device was found, on by default. */
+extern int hidselect_verbose;
 
 void fregister_hidselect();
-hid_device* open_device();
+log_device* open_device();
+/* Whether flags ask for more than one device to be captured from. */
+int multiple_devices();
+/* Opens every device asked for, storing them along with a short name for
+ * each in devices and names. Returns how many were opened. */
+int open_devices(log_device** devices, char** names, int max);
+/* Finds and opens a device again after losing it, by the name
+ * open_devices() gave it or, for a single device, however the flags picked
+ * it. Returns NULL, quietly, if it isn't back yet. */
+log_device* reopen_device(const char* name);
 
 #endif  /* HIDSELECT_H_ */
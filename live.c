@@ -0,0 +1,157 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Publishing log entries to shared memory. See livereader.h for the layout,
+ * and livereader.c for the reading side.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rc.h"
+
+#include "live.h"
+
+DEFINE_string(publish, NULL, "Also publish every entry written out to "
+    "local readers, such as powerwatch, through the POSIX shared memory "
+    "object of this name, with %s replaced by the device's serial number");
+DEFINE_uint64(publish_slots, 65536, "Entries the --publish ring holds, a "
+    "power of two. Readers further behind than this miss entries");
+
+void fregister_live() {
+  REGISTER(publish_slots);
+  REGISTER(publish);
+}
+
+char* live_name(const char* name);
+
+int live_enabled() {
+  return FLAGS_publish != NULL;
+}
+
+int live_check_name(int several) {
+  if (FLAGS_publish_slots == 0
+      || (FLAGS_publish_slots & (FLAGS_publish_slots - 1)) != 0) {
+    fprintf(stderr, "--publish_slots must be a power of two.\n");
+    return USER_SUCKS;
+  }
+  if (several && !strstr(FLAGS_publish, "%s")) {
+    fprintf(stderr, "--publish must contain %%s to capture from several "
+        "devices.\n");
+    return USER_SUCKS;
+  }
+  return SUCCESS;
+}
+
+int live_open(live* l, const char* name) {
+  struct stat st;
+  live_header* h;
+  char* path;
+  int fd;
+
+  memset(l, 0, sizeof(live));
+  l->len = LIVE_HEADER_SIZE + FLAGS_publish_slots * LIVE_SLOT_SIZE;
+  path = live_name(name);
+  if (!path) {
+    perror("Failed to name shared memory");
+    return OUTPUT_ERROR;
+  }
+  fd = shm_open(path, O_RDWR | O_CREAT, 0644);
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size != 0
+      && (size_t) st.st_size != l->len) {
+    /* Readers still mapping the old one keep it till they let go. */
+    close(fd);
+    shm_unlink(path);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    st.st_size = 0;
+  }
+  if (fd < 0 || (st.st_size == 0 && ftruncate(fd, l->len) != 0)) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(path);
+    return OUTPUT_ERROR;
+  }
+  h = (live_header*) mmap(NULL, l->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    perror(path);
+    free(path);
+    return OUTPUT_ERROR;
+  }
+  free(path);
+  if (memcmp(h->magic, LIVE_MAGIC, LIVE_MAGIC_LEN) != 0
+      || h->version != LIVE_VERSION || h->slot_size != LIVE_SLOT_SIZE
+      || h->capacity != FLAGS_publish_slots) {
+    memset(h, 0, l->len);
+    h->version = LIVE_VERSION;
+    h->slot_size = LIVE_SLOT_SIZE;
+    h->capacity = FLAGS_publish_slots;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, LIVE_MAGIC, LIVE_MAGIC_LEN);
+  }
+  l->header = h;
+  l->slots = (live_slot*) ((char*) h + LIVE_HEADER_SIZE);
+  l->mask = h->capacity - 1;
+  l->cursor = h->head;
+  __atomic_store_n(&h->publishing, 1, __ATOMIC_RELEASE);
+  return SUCCESS;
+}
+
+void live_publish(live* l, const powerlog6s* log) {
+  live_slot* s;
+  uint64_t n;
+
+  n = l->cursor;
+  s = &l->slots[n & l->mask];
+  __atomic_store_n(&s->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&s->log, log, sizeof(powerlog6s));
+  __atomic_store_n(&s->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+  l->cursor = n + 1;
+  __atomic_store_n(&l->header->head, l->cursor, __ATOMIC_RELEASE);
+}
+
+void live_close(live* l) {
+  __atomic_store_n(&l->header->publishing, 0, __ATOMIC_RELEASE);
+  munmap(l->header, l->len);
+  l->header = NULL;
+}
+
+/* Expands %s in --publish to the device's name, and %% to %, starting it
+ * with the / shared memory names need. */
+char* live_name(const char* name) {
+  const char* p;
+  char* path;
+  size_t len;
+
+  len = strlen(FLAGS_publish) * (strlen(name) + 1) + 2;
+  path = (char*) malloc(len);
+  if (!path) {
+    return NULL;
+  }
+  len = 0;
+  if (FLAGS_publish[0] != '/') {
+    path[len++] = '/';
+  }
+  for (p = FLAGS_publish; *p; p++) {
+    if (p[0] == '%' && p[1] == 's') {
+      len += sprintf(path + len, "%s", name);
+      p++;
+    } else if (p[0] == '%' && p[1] == '%') {
+      path[len++] = '%';
+      p++;
+    } else {
+      path[len++] = *p;
+    }
+  }
+  path[len] = '\0';
+  return path;
+}
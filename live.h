@@ -0,0 +1,35 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Publishing log entries through POSIX shared memory (--publish). The
+ * layout of the object, and the reading side that programs following it
+ * link, are in livereader.h.
+ */
+
+#ifndef LIVE_H_
+#define LIVE_H_
+
+#include "flags.h"
+#include "livereader.h"
+#include "powerlog6s.h"
+
+DECLARE_string(publish);
+
+void fregister_live();
+
+int live_enabled();
+/* Checks --publish can name an object for each of several devices.
+ * Returns SUCCESS or USER_SUCKS. */
+int live_check_name(int several);
+
+/* Creates the object --publish names for the device called name, or takes
+ * over an existing one of the same size, carrying on its numbering so
+ * attached readers follow on. Returns SUCCESS or OUTPUT_ERROR. */
+int live_open(live* l, const char* name);
+/* Publishes an entry, overwriting the oldest. Never blocks. */
+void live_publish(live* l, const powerlog6s* log);
+/* Marks the object as no longer being published to, and unmaps it. The
+ * object is left for readers to drain. */
+void live_close(live* l);
+
+#endif  /* LIVE_H_ */
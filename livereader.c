@@ -0,0 +1,146 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Reading log entries published to shared memory with --publish. Needs
+ * nothing but the C library, so other programs can link it in. See
+ * livereader.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rc.h"
+
+#include "livereader.h"
+
+/* How long live_wait() sleeps for. */
+#define LIVE_POLL_NS 1000000
+#define LIVE_NAME_MAX 256
+
+int live_overrun(live* l);
+
+int live_attach(live* l, const char* name, int oldest) {
+  char path[LIVE_NAME_MAX];
+  struct stat st;
+  live_header* h;
+  uint64_t head;
+  int fd;
+
+  memset(l, 0, sizeof(live));
+  /* Named as for --publish, with or without the leading /. */
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0 && errno == ENOENT) {
+    return DEVICE_MISSING;
+  }
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(name);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return OUTPUT_ERROR;
+  }
+  /* A publisher that has only just created it sizes it, then sets up the
+   * header, magic last. */
+  if (st.st_size == 0) {
+    close(fd);
+    return DEVICE_MISSING;
+  }
+  h = NULL;
+  if (st.st_size >= LIVE_HEADER_SIZE) {
+    h = (live_header*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (h && h != MAP_FAILED && h->magic[0] == '\0') {
+    munmap(h, st.st_size);
+    return DEVICE_MISSING;
+  }
+  if (!h || h == MAP_FAILED) {
+    fprintf(stderr, "%s isn't published to.\n", name);
+    return OUTPUT_ERROR;
+  }
+  l->len = st.st_size;
+  if (memcmp(h->magic, LIVE_MAGIC, LIVE_MAGIC_LEN) != 0
+      || h->version != LIVE_VERSION || h->slot_size != LIVE_SLOT_SIZE
+      || h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0
+      || l->len != LIVE_HEADER_SIZE + h->capacity * LIVE_SLOT_SIZE) {
+    fprintf(stderr, "%s isn't published to.\n", name);
+    munmap(h, l->len);
+    return OUTPUT_ERROR;
+  }
+  l->header = h;
+  l->slots = (live_slot*) ((char*) h + LIVE_HEADER_SIZE);
+  l->mask = h->capacity - 1;
+  head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  l->cursor = head;
+  if (oldest) {
+    l->cursor = head > h->capacity ? head - h->capacity + 1 : 0;
+  }
+  return SUCCESS;
+}
+
+int live_next(live* l, powerlog6s* log) {
+  const live_slot* s;
+  uint64_t before;
+  uint64_t after;
+  uint64_t head;
+  uint32_t publishing;
+
+  publishing = __atomic_load_n(&l->header->publishing, __ATOMIC_ACQUIRE);
+  head = __atomic_load_n(&l->header->head, __ATOMIC_ACQUIRE);
+  if (l->cursor >= head) {
+    return publishing ? LIVE_EMPTY : LIVE_CLOSED;
+  }
+  if (head - l->cursor > l->mask + 1) {
+    return live_overrun(l);
+  }
+  s = &l->slots[l->cursor & l->mask];
+  before = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+  if (before != 2 * l->cursor + 2) {
+    return before > 2 * l->cursor + 2 ? live_overrun(l) : LIVE_EMPTY;
+  }
+  memcpy(log, &s->log, sizeof(powerlog6s));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  after = __atomic_load_n(&s->sequence, __ATOMIC_RELAXED);
+  if (after != before) {
+    return live_overrun(l);
+  }
+  l->cursor++;
+  return LIVE_ENTRY;
+}
+
+void live_wait(live* l) {
+  struct timespec ts;
+
+  (void) l;
+  ts.tv_sec = 0;
+  ts.tv_nsec = LIVE_POLL_NS;
+  nanosleep(&ts, NULL);
+}
+
+void live_detach(live* l) {
+  munmap(l->header, l->len);
+  l->header = NULL;
+}
+
+/* Skips ahead of the entries overwritten, leaving a quarter of the ring
+ * between the reader and the publisher so it isn't overrun again at once. */
+int live_overrun(live* l) {
+  uint64_t head;
+  uint64_t next;
+
+  head = __atomic_load_n(&l->header->head, __ATOMIC_ACQUIRE);
+  next = head - (l->mask + 1) + (l->mask + 1) / 4;
+  if (head < l->mask + 1 || next <= l->cursor) {
+    next = l->cursor + 1;
+  }
+  l->lost += next - l->cursor;
+  l->cursor = next;
+  return LIVE_OVERRUN;
+}
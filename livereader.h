@@ -0,0 +1,87 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Reading the log entries powerup publishes through POSIX shared memory
+ * (--publish), for any number of local readers at once without copying
+ * through pipes. The publisher writes each entry into a ring of slots and
+ * never waits for anyone; each reader keeps its own place in the ring, and
+ * learns how many entries it missed if it falls more than the ring's length
+ * behind.
+ *
+ * The object is a header page, then capacity slots. Entry n, counted from
+ * 0, goes in slot n % capacity, guarded by a seqlock whose sequence also
+ * says which entry the slot holds: 2n + 1 while entry n is being written,
+ * 2n + 2 once it's whole. A reader copies the slot and checks the sequence
+ * is the same after as before. Readers map the object read only.
+ *
+ * This is the client library: include this header and link liblive.a,
+ * built from livereader.c, into a program to read what powerup publishes.
+ * powerwatch is an example.
+ */
+
+#ifndef LIVEREADER_H_
+#define LIVEREADER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "powerlog6s.h"
+
+#define LIVE_MAGIC "PL6SLIVE"
+#define LIVE_MAGIC_LEN 8
+#define LIVE_VERSION 1
+#define LIVE_HEADER_SIZE 4096
+#define LIVE_SLOT_SIZE 64
+
+/* Results of live_next(). */
+#define LIVE_ENTRY 0 /* an entry was read */
+#define LIVE_EMPTY 1 /* nothing new yet */
+#define LIVE_OVERRUN 2 /* entries were overwritten before being read */
+#define LIVE_CLOSED 3 /* nothing new, and the publisher has stopped */
+
+struct _live_header {
+  char magic[LIVE_MAGIC_LEN]; /* written last, once the rest is set up */
+  uint32_t version;
+  uint32_t slot_size;
+  uint64_t capacity; /* slots, a power of two */
+  uint64_t head; /* entries published, ever */
+  uint32_t publishing; /* 1 while a publisher has it open */
+  uint32_t reserved;
+};
+
+struct _live_slot {
+  uint64_t sequence;
+  powerlog6s log;
+  unsigned char padding[LIVE_SLOT_SIZE - 8 - sizeof(powerlog6s)];
+};
+
+typedef struct _live_header live_header;
+typedef struct _live_slot live_slot;
+
+/* Either end's view of the object. */
+struct _live {
+  live_header* header;
+  live_slot* slots;
+  uint64_t mask; /* capacity - 1 */
+  uint64_t cursor; /* the publisher's head, or the next entry to read */
+  uint64_t lost; /* entries a reader missed by being overrun */
+  size_t len; /* of the mapping */
+};
+
+typedef struct _live live;
+
+/* Maps the object called name to read, starting from the oldest entry it
+ * holds if oldest, else from the next one published. Returns SUCCESS,
+ * DEVICE_MISSING without complaint if nothing has been published under
+ * name yet, so callers can wait for a publisher, or OUTPUT_ERROR. */
+int live_attach(live* l, const char* name, int oldest);
+/* Reads the next entry into log, returning LIVE_ENTRY, or one of the other
+ * results above. After LIVE_OVERRUN, l->lost counts every entry missed so
+ * far, and the next call reads the oldest entry still held. */
+int live_next(live* l, powerlog6s* log);
+/* Sleeps until there may be something new, as after LIVE_EMPTY. Readers
+ * poll, so the publisher needn't wake anyone. */
+void live_wait(live* l);
+void live_detach(live* l);
+
+#endif  /* LIVEREADER_H_ */
@@ -0,0 +1,270 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Counters and latency histograms of the capture path.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rc.h"
+#include "timing.h"
+
+#include "metrics.h"
+
+DEFINE_string(metrics, "off", "Count events and time reads, decoding and "
+    "output of the capture path, printing the results on SIGUSR1 and at "
+    "exit: off, text or json");
+DEFINE_string(metrics_file, NULL, "Append metrics to this file rather than "
+    "printing them to stderr");
+
+void fregister_metrics() {
+  REGISTER(metrics_file);
+  REGISTER(metrics);
+}
+
+const char* kMetricCounterNames[METRIC_COUNTER_COUNT] = {
+  "reads",
+  "empty_reads",
+  "read_errors",
+  "reports",
+  "records",
+  "controls",
+  "short",
+  "unexpected_control",
+  "unexpected_type",
+  "bad_length",
+  "ring_overruns",
+  "flushes",
+  "bytes",
+  "reconnects",
+  "fsyncs"
+};
+
+const char* kMetricHistogramNames[METRIC_HISTOGRAM_COUNT] = {
+  "read",
+  "decode",
+  "output",
+  "latency",
+  "fsync"
+};
+
+const double kMetricQuantiles[] = { 0.5, 0.9, 0.99 };
+#define METRIC_QUANTILES 3
+
+int metrics_on = 0;
+volatile sig_atomic_t metrics_requested = 0;
+
+uint64_t metric_counters[METRIC_COUNTER_COUNT];
+metric_histogram metric_histograms[METRIC_HISTOGRAM_COUNT];
+double metrics_start;
+
+void metrics_snapshot(uint64_t* counters, metric_histogram* histograms);
+int metric_bucket(uint64_t ns);
+void metrics_print_text(FILE* f, double elapsed, const uint64_t* counters,
+    const metric_histogram* histograms);
+void metrics_print_json(FILE* f, double elapsed, const uint64_t* counters,
+    const metric_histogram* histograms);
+
+int metrics_init() {
+  if (strcmp(FLAGS_metrics, "off") == 0) {
+    metrics_on = 0;
+  } else if (strcmp(FLAGS_metrics, "text") == 0
+      || strcmp(FLAGS_metrics, "json") == 0) {
+    metrics_on = 1;
+  } else {
+    fprintf(stderr, "Unknown --metrics '%s'.\n", FLAGS_metrics);
+    return USER_SUCKS;
+  }
+  metrics_start = timing_now();
+  return SUCCESS;
+}
+
+void metrics_count(int counter, uint64_t n) {
+  if (metrics_on) {
+    __atomic_fetch_add(&metric_counters[counter], n, __ATOMIC_RELAXED);
+  }
+}
+
+double metrics_observe(int histogram, double start) {
+  metric_histogram* h = &metric_histograms[histogram];
+  uint64_t max;
+  uint64_t ns;
+  double now;
+  double elapsed;
+  int bucket;
+
+  now = timing_now();
+  elapsed = now - start;
+  ns = elapsed > 0 ? (uint64_t) (elapsed * 1e9) : 0;
+  bucket = metric_bucket(ns);
+  __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+  max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return now;
+}
+
+void metric_histogram_add(metric_histogram* h, uint64_t ns) {
+  h->buckets[metric_bucket(ns)]++;
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max) {
+    h->max = ns;
+  }
+}
+
+int metric_bucket(uint64_t ns) {
+  int bucket;
+
+  bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  return bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1;
+}
+
+void metrics_poll() {
+  if (metrics_requested
+      && __atomic_exchange_n(&metrics_requested, 0, __ATOMIC_RELAXED)) {
+    metrics_dump();
+  }
+}
+
+void metrics_dump() {
+  uint64_t counters[METRIC_COUNTER_COUNT];
+  metric_histogram histograms[METRIC_HISTOGRAM_COUNT];
+  double elapsed;
+  FILE* f;
+
+  if (!metrics_on) {
+    return;
+  }
+  metrics_snapshot(counters, histograms);
+  elapsed = timing_now() - metrics_start;
+  f = FLAGS_metrics_file ? fopen(FLAGS_metrics_file, "a") : stderr;
+  if (!f) {
+    perror(FLAGS_metrics_file);
+    return;
+  }
+  flockfile(f);
+  if (strcmp(FLAGS_metrics, "json") == 0) {
+    metrics_print_json(f, elapsed, counters, histograms);
+  } else {
+    metrics_print_text(f, elapsed, counters, histograms);
+  }
+  funlockfile(f);
+  if (f != stderr) {
+    fclose(f);
+  }
+}
+
+/* Copies out the metrics one value at a time. Other threads keep counting
+ * meanwhile, so the copy can be a few events out, but never torn. */
+void metrics_snapshot(uint64_t* counters, metric_histogram* histograms) {
+  uint64_t* src;
+  uint64_t* dst;
+  size_t i;
+
+  for (i = 0; i < METRIC_COUNTER_COUNT; i++) {
+    counters[i] = __atomic_load_n(&metric_counters[i], __ATOMIC_RELAXED);
+  }
+  src = (uint64_t*) metric_histograms;
+  dst = (uint64_t*) histograms;
+  for (i = 0; i < METRIC_HISTOGRAM_COUNT * sizeof(metric_histogram)
+      / sizeof(uint64_t); i++) {
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+/* Upper end of the bucket holding the value of rank p, or the largest value
+ * seen if that's lower. */
+uint64_t metric_quantile(const metric_histogram* h, double p) {
+  uint64_t rank;
+  uint64_t seen;
+  uint64_t upper;
+  int i;
+
+  if (h->count == 0) {
+    return 0;
+  }
+  rank = (uint64_t) (p * (h->count - 1));
+  seen = 0;
+  upper = h->max;
+  for (i = 0; i < METRIC_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      upper = i == 0 ? 0 : (1ULL << i) - 1;
+      break;
+    }
+  }
+  return upper < h->max ? upper : h->max;
+}
+
+void metrics_print_text(FILE* f, double elapsed, const uint64_t* counters,
+    const metric_histogram* histograms) {
+  const metric_histogram* h;
+  double minutes;
+  int i;
+  int j;
+
+  minutes = elapsed / 60;
+  fprintf(f, "Metrics after %.1fs:\n", elapsed);
+  for (i = 0; i < METRIC_COUNTER_COUNT; i++) {
+    fprintf(f, "  %-18s %12llu  %12.1f/min\n", kMetricCounterNames[i],
+        (unsigned long long) counters[i],
+        minutes > 0 ? counters[i] / minutes : 0.0);
+  }
+  fprintf(f, "  %-18s %12s %9s %9s %9s %9s %9s\n", "microseconds", "count",
+      "mean", "p50", "p90", "p99", "max");
+  for (i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+    h = &histograms[i];
+    fprintf(f, "  %-18s %12llu %9.1f", kMetricHistogramNames[i],
+        (unsigned long long) h->count,
+        h->count ? h->sum / 1e3 / h->count : 0.0);
+    for (j = 0; j < METRIC_QUANTILES; j++) {
+      fprintf(f, " %9.1f", metric_quantile(h, kMetricQuantiles[j]) / 1e3);
+    }
+    fprintf(f, " %9.1f\n", h->max / 1e3);
+  }
+}
+
+/* One object per line, with the nonzero buckets as [upper bound, count]
+ * pairs in nanoseconds. */
+void metrics_print_json(FILE* f, double elapsed, const uint64_t* counters,
+    const metric_histogram* histograms) {
+  const metric_histogram* h;
+  const char* separator;
+  int i;
+  int j;
+
+  fprintf(f, "{\"elapsed\":%.3f,\"counters\":{", elapsed);
+  for (i = 0; i < METRIC_COUNTER_COUNT; i++) {
+    fprintf(f, "%s\"%s\":%llu", i ? "," : "", kMetricCounterNames[i],
+        (unsigned long long) counters[i]);
+  }
+  fprintf(f, "},\"histograms\":{");
+  for (i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+    h = &histograms[i];
+    fprintf(f, "%s\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu",
+        i ? "," : "", kMetricHistogramNames[i],
+        (unsigned long long) h->count, (unsigned long long) h->sum,
+        (unsigned long long) h->max);
+    for (j = 0; j < METRIC_QUANTILES; j++) {
+      fprintf(f, ",\"p%g_ns\":%llu", kMetricQuantiles[j] * 100,
+          (unsigned long long) metric_quantile(h, kMetricQuantiles[j]));
+    }
+    fprintf(f, ",\"buckets\":[");
+    separator = "";
+    for (j = 0; j < METRIC_BUCKETS; j++) {
+      if (h->buckets[j]) {
+        fprintf(f, "%s[%llu,%llu]", separator,
+            (unsigned long long) (j ? (1ULL << j) - 1 : 0),
+            (unsigned long long) h->buckets[j]);
+        separator = ",";
+      }
+    }
+    fprintf(f, "]}");
+  }
+  fprintf(f, "}}\n");
+}
@@ -0,0 +1,90 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Counters and latency histograms of the capture path, for seeing why a
+ * capture stalls or drops reports without attaching a profiler. There is one
+ * set for the whole process, updated with relaxed atomics so several
+ * capture threads can share it without locking, and nothing is counted or
+ * timed unless --metrics asks for it. Dumped on SIGUSR1 and at exit.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "flags.h"
+
+/* Latencies are bucketed by their top bit in nanoseconds: bucket 0 holds
+ * zero and bucket i from 2^(i-1) up to 2^i, so each is within a factor of
+ * two and updating one is a single atomic add. */
+#define METRIC_BUCKETS 64
+
+DECLARE_string(metrics);
+
+enum metric_counter_id {
+  METRIC_READS, /* reads from the device */
+  METRIC_READ_EMPTY, /* reads that returned nothing, timed out or drained */
+  METRIC_READ_ERRORS,
+  METRIC_REPORTS,
+  METRIC_RECORDS, /* log entries decoded */
+  METRIC_CONTROLS, /* control messages */
+  METRIC_SHORT, /* reports too short to have a type */
+  METRIC_UNEXPECTED_CONTROL, /* control messages of unknown command */
+  METRIC_UNEXPECTED_TYPE, /* reports of unknown type */
+  METRIC_BAD_LENGTH, /* log entries of the wrong length */
+  METRIC_RING_OVERRUNS, /* reports dropped by a full --threaded ring */
+  METRIC_FLUSHES, /* writes of buffered output */
+  METRIC_BYTES, /* bytes of output written */
+  METRIC_RECONNECTS, /* devices found again by --reconnect */
+  METRIC_FSYNCS, /* output synced to disk */
+  METRIC_COUNTER_COUNT
+};
+
+enum metric_histogram_id {
+  METRIC_READ, /* each read from the device, including waiting */
+  METRIC_DECODE, /* interpreting and formatting a report */
+  METRIC_OUTPUT, /* each write of buffered output */
+  METRIC_LATENCY, /* from a report arriving to its entry being written */
+  METRIC_FSYNC, /* each fsync() of output */
+  METRIC_HISTOGRAM_COUNT
+};
+
+struct _metric_histogram {
+  uint64_t count;
+  uint64_t sum; /* nanoseconds */
+  uint64_t max;
+  uint64_t buckets[METRIC_BUCKETS];
+};
+
+typedef struct _metric_histogram metric_histogram;
+
+/* Whether --metrics asks for anything, set by metrics_init(). Checked before
+ * reading the clock for a histogram. */
+extern int metrics_on;
+/* Set from a signal handler to have the metrics dumped at the next chance. */
+extern volatile sig_atomic_t metrics_requested;
+
+void fregister_metrics();
+
+/* Checks the flags and starts the clock metrics are rated against. Returns
+ * SUCCESS or an error code from rc.h. */
+int metrics_init();
+void metrics_count(int counter, uint64_t n);
+/* Adds the time since start, from timing_now(), to a histogram. Returns the
+ * time now, to save reading the clock again. */
+double metrics_observe(int histogram, double start);
+/* Adds ns to a histogram of the caller's own, which only one thread may
+ * update, such as the ones --host_time keeps for each capture. */
+void metric_histogram_add(metric_histogram* h, uint64_t ns);
+/* Upper end of the bucket holding the value of rank p, from 0 to 1, in
+ * nanoseconds. */
+uint64_t metric_quantile(const metric_histogram* h, double p);
+/* Dumps the metrics if metrics_requested is set, from whichever thread gets
+ * there first. */
+void metrics_poll();
+/* Writes the metrics as --metrics says to --metrics_file. */
+void metrics_dump();
+
+#endif  /* METRICS_H_ */
@@ -0,0 +1,155 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Buffered output straight to a file descriptor.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "rc.h"
+#include "timing.h"
+
+#include "output.h"
+
+int output_open(output* out, int fd, size_t cap) {
+  memset(out, 0, sizeof(output));
+  out->fd = fd;
+  out->cap = cap;
+  out->buf = sink_alloc(cap);
+  if (!out->buf) {
+    perror("Failed to allocate output buffer");
+    return OUTPUT_ERROR;
+  }
+  sink_sync_init(&out->sync, 0, 0);
+  return SUCCESS;
+}
+
+void output_set_sync(output* out, uint64_t records, uint64_t milliseconds) {
+  sink_sync_init(&out->sync, records, milliseconds);
+}
+
+int output_start_async(output* out) {
+  out->sink = (sink*) malloc(sizeof(sink));
+  if (!out->sink) {
+    perror("Failed to allocate output sink");
+    return OUTPUT_ERROR;
+  }
+  free(out->buf);
+  out->buf = NULL;
+  if (sink_start(out->sink, out->cap, &out->sync, &out->buf) != SUCCESS) {
+    free(out->sink);
+    out->sink = NULL;
+    return OUTPUT_ERROR;
+  }
+  return SUCCESS;
+}
+
+void output_close(output* out) {
+  output_flush(out);
+  output_drain(out);
+  if (out->sink) {
+    sink_stop(out->sink);
+    free(out->sink);
+    out->sink = NULL;
+  }
+  free(out->buf);
+  out->buf = NULL;
+  out->cap = 0;
+}
+
+char* output_reserve(output* out, size_t n) {
+  if (out->cap - out->len < n && output_flush(out) != SUCCESS) {
+    return NULL;
+  }
+  return out->buf + out->len;
+}
+
+void output_commit(output* out, size_t n) {
+  out->len += n;
+}
+
+int output_write(output* out, const void* data, size_t n) {
+  const char* src = (const char*) data;
+  char* dst;
+  size_t chunk;
+
+  while (n > 0) {
+    chunk = n < out->cap ? n : out->cap;
+    dst = output_reserve(out, chunk);
+    if (!dst) {
+      return OUTPUT_ERROR;
+    }
+    memcpy(dst, src, chunk);
+    output_commit(out, chunk);
+    src += chunk;
+    n -= chunk;
+  }
+  return SUCCESS;
+}
+
+int output_flush(output* out) {
+  uint64_t records;
+  size_t done;
+  ssize_t n;
+  double start;
+  int rc;
+
+  if (out->len == 0) {
+    /* The writer thread keeps its own time. */
+    return out->sink ? SUCCESS : sink_sync_poll(&out->sync);
+  }
+  if (out->sink) {
+    out->bytes += out->len;
+    out->writes++;
+    rc = sink_submit(out->sink, out->fd, &out->buf, out->len, out->records);
+    out->len = 0;
+    out->records = 0;
+    return rc;
+  }
+  start = metrics_on ? timing_now() : 0;
+  done = 0;
+  while (done < out->len) {
+    n = write(out->fd, out->buf + done, out->len - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write output");
+      /* Drop what couldn't be written rather than retrying it forever. */
+      out->len = 0;
+      out->records = 0;
+      return OUTPUT_ERROR;
+    }
+    done += n;
+    out->bytes += n;
+    out->writes++;
+  }
+  if (metrics_on) {
+    metrics_count(METRIC_FLUSHES, 1);
+    metrics_count(METRIC_BYTES, done);
+    metrics_observe(METRIC_OUTPUT, start);
+  }
+  out->len = 0;
+  records = out->records;
+  out->records = 0;
+  return sink_sync_wrote(&out->sync, out->fd, records);
+}
+
+int output_idle(output* out) {
+  if (out->sink && out->len < out->cap / 2 && sink_busy(out->sink)) {
+    return SUCCESS;
+  }
+  return output_flush(out);
+}
+
+int output_drain(output* out) {
+  if (out->sink) {
+    return sink_drain(out->sink);
+  }
+  return sink_sync_now(&out->sync);
+}
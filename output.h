@@ -0,0 +1,63 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Buffered output straight to a file descriptor. Data is gathered in one
+ * large buffer, allocated up front, and handed to the kernel with a single
+ * write() per flush rather than going through stdio for every record. With
+ * output_start_async() flushing only hands the buffer to a writer thread
+ * (see sink.h), and output_set_sync() has it fsync()ed now and then.
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sink.h"
+
+struct _output {
+  int fd;
+  char* buf;
+  size_t len; /* bytes waiting in buf */
+  size_t cap;
+  uint64_t records; /* records in buf, counted by the caller if it syncs */
+  uint64_t bytes; /* bytes written to fd, or handed to the sink */
+  uint64_t writes; /* write() calls made, or buffers handed to the sink */
+  sink_sync sync; /* when not async */
+  sink* sink; /* NULL unless async */
+};
+
+typedef struct _output output;
+
+int output_open(output* out, int fd, size_t cap);
+/* Has output fsync()ed once records records have been written since it
+ * last was, or milliseconds after unsynced output was first written, 0 for
+ * no limit. Call before output_start_async(). */
+void output_set_sync(output* out, uint64_t records, uint64_t milliseconds);
+/* Writes out flushed buffers on a thread of their own. Returns SUCCESS or
+ * OUTPUT_ERROR. */
+int output_start_async(output* out);
+/* Flushes, drains and stops any writer thread, and frees the buffer. Doesn't
+ * close fd. */
+void output_close(output* out);
+
+/* Returns space for at least n bytes, flushing first if there isn't room, or
+ * NULL if flushing failed. Follow with output_commit() of the bytes used. */
+char* output_reserve(output* out, size_t n);
+void output_commit(output* out, size_t n);
+
+int output_write(output* out, const void* data, size_t n);
+/* Writes out what's buffered, or hands it to the writer thread. Flushing
+ * with nothing buffered still syncs output that's due to be. */
+int output_flush(output* out);
+/* Flushes when the caller is about to go quiet, unless a writer thread is
+ * still busy with earlier output and the buffer is less than half full, in
+ * which case it keeps gathering to hand over in bigger pieces. Then out->len
+ * is left non-zero, and it should be called again soon. */
+int output_idle(output* out);
+/* Waits for everything flushed to be written, and synced if there's a
+ * limit on when to, as before closing fd. */
+int output_drain(output* out);
+
+#endif  /* OUTPUT_H_ */
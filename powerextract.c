@@ -0,0 +1,92 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Extracts a time range from columnar capture files (--format=columnar) as
+ * CSV. Only the blocks overlapping the range are read, straight out of the
+ * memory mapped file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "colfile.h"
+#include "flags.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+
+DEFINE_uint64(from, 0, "Cumulative milliseconds of the first record to "
+    "extract");
+DEFINE_uint64(to, UINT64_MAX, "Cumulative milliseconds after which to stop "
+    "extracting");
+
+void fregister_powerextract() {
+  REGISTER(to);
+  REGISTER(from);
+}
+
+int extract(output* out, char* path);
+
+int main(int argc, char** argv) {
+  output out;
+  int rc;
+  int i;
+
+  fregister_powerextract();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [flags...] capture...\n", argv[0]);
+    exit(USER_SUCKS);
+  }
+  if (output_open(&out, STDOUT_FILENO, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  rc = output_write(&out, powerlog6s_csv_columns(),
+      strlen(powerlog6s_csv_columns()));
+  for (i = 1; i < argc && rc == SUCCESS; i++) {
+    rc = extract(&out, argv[i]);
+  }
+  output_close(&out);
+  return rc;
+}
+
+int extract(output* out, char* path) {
+  colfile f;
+  colfile_block b;
+  const uint64_t* times;
+  powerlog6s log;
+  uint64_t block;
+  uint64_t i;
+  char* line;
+  int rc;
+
+  rc = colfile_open(&f, path);
+  if (rc != SUCCESS) {
+    return rc;
+  }
+  for (block = colfile_find_block(&f, FLAGS_from); block < f.blocks
+      && f.index[block].first_time <= FLAGS_to; block++) {
+    colfile_block_at(&f, block, &b);
+    times = (const uint64_t*) b.columns[COL_TIME];
+    for (i = colfile_find_record(&b, FLAGS_from);
+        i < b.count && times[i] <= FLAGS_to; i++) {
+      colfile_record(&b, i, &log);
+      line = output_reserve(out, POWERLOG6S_CSV_MAX);
+      if (!line) {
+        colfile_close(&f);
+        return OUTPUT_ERROR;
+      }
+      output_commit(out, powerlog6s_csv_format(&log, line));
+    }
+  }
+  colfile_close(&f);
+  return SUCCESS;
+}
@@ -0,0 +1,136 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Extracts the entries a flight recorder file (--flight_recorder) holds, or
+ * the last few minutes of them, as CSV or as binary records. The file can
+ * be read while it's still being recorded into; entries overwritten while
+ * being read are left out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "flight.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+
+DEFINE_uint64(minutes, 0, "Extract only the entries recorded in this many "
+    "minutes up to the last, 0 for all of them");
+DEFINE_bool(binary, 0, "Write the packed records as sent by the device, as "
+    "powerup --format=binary would, rather than CSV");
+
+void fregister_powerflight() {
+  REGISTER(binary);
+  REGISTER(minutes);
+}
+
+int extract(output* out, char* path);
+uint64_t find_start(const flight* f, uint64_t tail, uint64_t head);
+
+int main(int argc, char** argv) {
+  output out;
+  int rc;
+  int i;
+
+  fregister_powerflight();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [flags...] recording...\n", argv[0]);
+    exit(USER_SUCKS);
+  }
+  if (output_open(&out, STDOUT_FILENO, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  rc = SUCCESS;
+  if (!FLAGS_binary) {
+    rc = output_write(&out, powerlog6s_csv_columns(),
+        strlen(powerlog6s_csv_columns()));
+  }
+  for (i = 1; i < argc && rc == SUCCESS; i++) {
+    rc = extract(&out, argv[i]);
+  }
+  output_close(&out);
+  return rc;
+}
+
+int extract(output* out, char* path) {
+  flight_slot slot;
+  flight f;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t start;
+  uint64_t lost;
+  uint64_t n;
+  char* line;
+  int rc;
+
+  rc = flight_map(&f, path);
+  if (rc != SUCCESS) {
+    return rc;
+  }
+  flight_range(&f, &tail, &head);
+  start = find_start(&f, tail, head);
+  lost = 0;
+  for (n = start; n < head && rc == SUCCESS; n++) {
+    if (!flight_read(&f, n, &slot)) {
+      lost++;
+    } else if (FLAGS_binary) {
+      rc = output_write(out, &slot.log, sizeof(powerlog6s));
+    } else {
+      line = output_reserve(out, POWERLOG6S_CSV_MAX);
+      if (!line) {
+        rc = OUTPUT_ERROR;
+      } else {
+        output_commit(out, powerlog6s_csv_format(&slot.log, line));
+      }
+    }
+  }
+  fprintf(stderr, "%s: %llu of %llu entries held", path,
+      (unsigned long long) (head - start - lost),
+      (unsigned long long) (head - tail));
+  if (lost > 0) {
+    fprintf(stderr, ", %llu torn or overwritten while reading",
+        (unsigned long long) lost);
+  }
+  fprintf(stderr, ".\n");
+  flight_unmap(&f);
+  return rc;
+}
+
+/* Finds the first entry of the last --minutes before the newest, by binary
+ * search over the times they were recorded. Entries that can't be read,
+ * having just been overwritten, are taken to be too old. */
+uint64_t find_start(const flight* f, uint64_t tail, uint64_t head) {
+  flight_slot slot;
+  int64_t since;
+  uint64_t low;
+  uint64_t high;
+  uint64_t mid;
+
+  if (FLAGS_minutes == 0 || tail == head
+      || !flight_read(f, head - 1, &slot)) {
+    return tail;
+  }
+  since = slot.time - (int64_t) FLAGS_minutes * 60000;
+  low = tail;
+  high = head - 1;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (flight_read(f, mid, &slot) && slot.time >= since) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
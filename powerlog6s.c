@@ -6,14 +6,123 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+
+#include "rc.h"
 
 #include "powerlog6s.h"
 
+DEFINE_string(csv_units, NULL, "Write these CSV columns in engineering "
+    "units, as decimal amps, volts, amp hours and degrees celsius, rather "
+    "than as logged: a comma separated list of current, voltage, energy, "
+    "cell1 to cell6, internal_temp and temp2 to temp4, or cells, temps or "
+    "all");
+
+void fregister_powerlog6s() {
+  REGISTER(csv_units);
+}
+
+/* "00" to "99", for converting two digits at a time. */
+const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+const char kHexDigits[] = "0123456789abcdef";
+
+const char kPowerlog6sCsvHeader[] =
+    "interval,state,current (cA),voltage (cV),energy (mAh),"
+    "cell1 (mV),cell2 (mV),cell3 (mV),cell4 (mV),cell5 (mV),cell6 (mV),"
+    "rpm,internal_temp (ddC),temp2 (ddC),temp3 (ddC),temp4 (ddC),"
+    "period,pulse\n";
+
+/* Columns that can be in engineering units, in CSV order, then names for
+ * several at once. */
+struct _powerlog6s_unit {
+  const char* name;
+  unsigned bits;
+  const char* raw; /* unit as logged */
+  const char* unit; /* engineering unit */
+};
+
+const struct _powerlog6s_unit kPowerlog6sUnits[] = {
+  { "current", POWERLOG6S_UNIT_CURRENT, "cA", "A" },
+  { "voltage", POWERLOG6S_UNIT_VOLTAGE, "cV", "V" },
+  { "energy", POWERLOG6S_UNIT_ENERGY, "mAh", "Ah" },
+  { "cell1", POWERLOG6S_UNIT_CELL1, "mV", "V" },
+  { "cell2", POWERLOG6S_UNIT_CELL1 << 1, "mV", "V" },
+  { "cell3", POWERLOG6S_UNIT_CELL1 << 2, "mV", "V" },
+  { "cell4", POWERLOG6S_UNIT_CELL1 << 3, "mV", "V" },
+  { "cell5", POWERLOG6S_UNIT_CELL1 << 4, "mV", "V" },
+  { "cell6", POWERLOG6S_UNIT_CELL1 << 5, "mV", "V" },
+  { "internal_temp", POWERLOG6S_UNIT_INTERNAL_TEMPERATURE, "ddC", "C" },
+  { "temp2", POWERLOG6S_UNIT_TEMPERATURE1, "ddC", "C" },
+  { "temp3", POWERLOG6S_UNIT_TEMPERATURE1 << 1, "ddC", "C" },
+  { "temp4", POWERLOG6S_UNIT_TEMPERATURE1 << 2, "ddC", "C" },
+  { "cells", POWERLOG6S_UNIT_CELLS, NULL, NULL },
+  { "temps", POWERLOG6S_UNIT_TEMPERATURES, NULL, NULL },
+  { "all", POWERLOG6S_UNIT_ALL, NULL, NULL },
+  { NULL, 0, NULL, NULL }
+};
+
+unsigned powerlog6s_units = 0;
+/* Header for powerlog6s_units, once they're chosen. Every engineering unit
+ * is named in fewer letters than the unit it replaces. */
+char powerlog6s_units_header[sizeof(kPowerlog6sCsvHeader)];
+
+char* format_uint(char* out, uint32_t value);
+char* format_int(char* out, int32_t value);
+char* format_hex(char* out, uint8_t value);
+char* format_fixed(char* out, uint32_t value, int places);
+char* format_fixed_int(char* out, int32_t value, int places);
+
+int powerlog6s_use_units(const char* spec) {
+  const struct _powerlog6s_unit* u;
+  const char* end;
+  unsigned units;
+  size_t len;
+  char* p;
+  int i;
+
+  units = 0;
+  while (*spec) {
+    end = strchr(spec, ',');
+    len = end ? (size_t) (end - spec) : strlen(spec);
+    for (u = kPowerlog6sUnits; u->name; u++) {
+      if (strlen(u->name) == len && strncmp(u->name, spec, len) == 0) {
+        break;
+      }
+    }
+    if (!u->name) {
+      fprintf(stderr, "No such column for --csv_units: %.*s\n", (int) len,
+          spec);
+      return USER_SUCKS;
+    }
+    units |= u->bits;
+    spec += end ? len + 1 : len;
+  }
+  powerlog6s_units = units;
+
+  p = powerlog6s_units_header;
+  p += sprintf(p, "interval,state,");
+  for (i = 0; kPowerlog6sUnits[i].raw; i++) {
+    u = &kPowerlog6sUnits[i];
+    p += sprintf(p, "%s (%s),", u->name,
+        powerlog6s_units & u->bits ? u->unit : u->raw);
+    if (u->bits == POWERLOG6S_UNIT_CELL1 << 5) {
+      p += sprintf(p, "rpm,");
+    }
+  }
+  sprintf(p, "period,pulse\n");
+  return SUCCESS;
+}
+
+const char* powerlog6s_csv_columns() {
+  return powerlog6s_units ? powerlog6s_units_header : kPowerlog6sCsvHeader;
+}
+
 void powerlog6s_csv_header() {
-  printf("interval,state,current (cA),voltage (cV),energy (mAh),");
-  printf("cell1 (mV),cell2 (mV),cell3 (mV),cell4 (mV),cell5 (mV),cell6 (mV),");
-  printf("rpm,internal_temp (ddC),temp2 (ddC),temp3 (ddC),temp4 (ddC),");
-  printf("period,pulse\n");
+  fputs(powerlog6s_csv_columns(), stdout);
 }
 
 void powerlog6s_csv_entry(powerlog6s* log) {
@@ -29,3 +138,174 @@ void powerlog6s_csv_entry(powerlog6s* log) {
   }
   printf("%u,%u\n", log->period, log->pulse);
 }
+
+size_t powerlog6s_csv_format(const powerlog6s* log, char* out) {
+  unsigned units = powerlog6s_units;
+  char* p = out;
+  int i;
+
+  if (log->type == POWERLOG6S_GAP
+      && log->state == POWERLOG6S_GAP_RECONNECT) {
+    memcpy(p, "# reconnected after ", 20);
+    p = format_uint(p + 20, log->energy);
+    memcpy(p, " ms, after interval ", 20);
+    p = format_uint(p + 20, log->interval);
+    *p++ = '\n';
+    return p - out;
+  } else if (log->type == POWERLOG6S_GAP) {
+    memcpy(p, "# gap of ", 9);
+    p = format_uint(p + 9, log->energy);
+    memcpy(p, " entries after interval ", 24);
+    p = format_uint(p + 24, log->interval);
+    *p++ = '\n';
+    return p - out;
+  }
+  p = format_uint(p, log->interval);
+  *p++ = ',';
+  p = format_hex(p, log->state);
+  *p++ = ',';
+  if (!units) {
+    /* As logged, the common case, with no tests for each column. */
+    p = format_int(p, log->current);
+    *p++ = ',';
+    p = format_uint(p, log->voltage);
+    *p++ = ',';
+    p = format_uint(p, log->energy);
+    *p++ = ',';
+    for (i = 0; i < 6; i++) {
+      p = format_int(p, log->cell[i]);
+      *p++ = ',';
+    }
+    p = format_uint(p, log->rpm);
+    *p++ = ',';
+    p = format_int(p, log->internal_temperature);
+    *p++ = ',';
+    for (i = 0; i < 3; i++) {
+      p = format_int(p, log->temperature[i]);
+      *p++ = ',';
+    }
+  } else {
+    p = units & POWERLOG6S_UNIT_CURRENT
+        ? format_fixed_int(p, log->current, 2) : format_int(p, log->current);
+    *p++ = ',';
+    p = units & POWERLOG6S_UNIT_VOLTAGE
+        ? format_fixed(p, log->voltage, 2) : format_uint(p, log->voltage);
+    *p++ = ',';
+    p = units & POWERLOG6S_UNIT_ENERGY
+        ? format_fixed(p, log->energy, 3) : format_uint(p, log->energy);
+    *p++ = ',';
+    for (i = 0; i < 6; i++) {
+      p = units & (POWERLOG6S_UNIT_CELL1 << i)
+          ? format_fixed_int(p, log->cell[i], 3) : format_int(p, log->cell[i]);
+      *p++ = ',';
+    }
+    p = format_uint(p, log->rpm);
+    *p++ = ',';
+    p = units & POWERLOG6S_UNIT_INTERNAL_TEMPERATURE
+        ? format_fixed_int(p, log->internal_temperature, 1)
+        : format_int(p, log->internal_temperature);
+    *p++ = ',';
+    for (i = 0; i < 3; i++) {
+      p = units & (POWERLOG6S_UNIT_TEMPERATURE1 << i)
+          ? format_fixed_int(p, log->temperature[i], 1)
+          : format_int(p, log->temperature[i]);
+      *p++ = ',';
+    }
+  }
+  p = format_uint(p, log->period);
+  *p++ = ',';
+  p = format_uint(p, log->pulse);
+  *p++ = '\n';
+  return p - out;
+}
+
+void powerlog6s_gap(powerlog6s* gap, uint32_t interval, uint32_t count) {
+  memset(gap, 0, sizeof(powerlog6s));
+  gap->len = sizeof(powerlog6s);
+  gap->type = POWERLOG6S_GAP;
+  gap->interval = interval;
+  gap->energy = count;
+}
+
+void powerlog6s_reconnect(powerlog6s* gap, uint32_t interval,
+    uint32_t milliseconds) {
+  powerlog6s_gap(gap, interval, milliseconds);
+  gap->state = POWERLOG6S_GAP_RECONNECT;
+}
+
+/* Writes the decimal digits of value to out, returning the end of them. */
+char* format_uint(char* out, uint32_t value) {
+  char digits[10];
+  char* p = digits + sizeof(digits);
+  size_t n;
+
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, kDigitPairs + 2 * (value % 100), 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, kDigitPairs + 2 * value, 2);
+  } else {
+    *--p = (char) ('0' + value);
+  }
+  n = digits + sizeof(digits) - p;
+  memcpy(out, p, n);
+  return out + n;
+}
+
+char* format_int(char* out, int32_t value) {
+  if (value < 0) {
+    *out++ = '-';
+    return format_uint(out, 0 - (uint32_t) value);
+  }
+  return format_uint(out, (uint32_t) value);
+}
+
+char* format_hex(char* out, uint8_t value) {
+  if (value >= 0x10) {
+    *out++ = kHexDigits[value >> 4];
+  }
+  *out++ = kHexDigits[value & 0xf];
+  return out;
+}
+
+/* Writes value divided by 10 to the power places, which is 1, 2 or 3, with
+ * exactly that many decimal places. The constant divisors become multiplies,
+ * and the fraction comes from the digit tables, so there's no floating point
+ * anywhere and no rounding. */
+char* format_fixed(char* out, uint32_t value, int places) {
+  uint32_t fraction;
+
+  switch (places) {
+    case 1:
+      out = format_uint(out, value / 10);
+      *out++ = '.';
+      *out++ = (char) ('0' + value % 10);
+      break;
+    case 2:
+      out = format_uint(out, value / 100);
+      *out++ = '.';
+      memcpy(out, kDigitPairs + 2 * (value % 100), 2);
+      out += 2;
+      break;
+    default:
+      out = format_uint(out, value / 1000);
+      fraction = value % 1000;
+      *out++ = '.';
+      *out++ = (char) ('0' + fraction / 100);
+      memcpy(out, kDigitPairs + 2 * (fraction % 100), 2);
+      out += 2;
+      break;
+  }
+  return out;
+}
+
+char* format_fixed_int(char* out, int32_t value, int places) {
+  if (value < 0) {
+    *out++ = '-';
+    return format_fixed(out, 0 - (uint32_t) value, places);
+  }
+  return format_fixed(out, (uint32_t) value, places);
+}
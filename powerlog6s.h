@@ -8,12 +8,19 @@
 #ifndef POWERLOG6S_H_
 #define POWERLOG6S_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "flags.h"
+
 /* Message types */
 #define POWERLOG6S_ONLINE 0x10 /* use powerlog6s */
 #define POWERLOG6S_OFFLINE 0x11 /* use powerlog6s */
 #define POWERLOG6S_CONTROL 0x20 /* use powerlog6s_ctl */
+#define POWERLOG6S_GAP 0x1f /* never sent, see powerlog6s_gap() */
+
+/* State of a POWERLOG6S_GAP made by powerlog6s_reconnect(). */
+#define POWERLOG6S_GAP_RECONNECT 0x01
 
 /* Command types for control messages */
 #define POWERLOG6S_START 0x20 /* x=lines, y=interval */
@@ -53,7 +60,54 @@ typedef struct _powerlog6s_base powerlog6s_base;
 typedef struct _powerlog6s powerlog6s;
 typedef struct _powerlog6s_ctl powerlog6s_ctl;
 
+/* Columns powerlog6s_csv_format() can write in engineering units rather
+ * than as logged, as bits of powerlog6s_units. */
+#define POWERLOG6S_UNIT_CURRENT 0x0001 /* amps, to 2 places */
+#define POWERLOG6S_UNIT_VOLTAGE 0x0002 /* volts, to 2 places */
+#define POWERLOG6S_UNIT_ENERGY 0x0004 /* amp hours, to 3 places */
+#define POWERLOG6S_UNIT_CELL1 0x0008 /* volts, to 3 places, and so on */
+#define POWERLOG6S_UNIT_CELLS 0x01f8 /* every cell */
+#define POWERLOG6S_UNIT_INTERNAL_TEMPERATURE 0x0200 /* celsius, to 1 place */
+#define POWERLOG6S_UNIT_TEMPERATURE1 0x0400 /* likewise, and so on */
+#define POWERLOG6S_UNIT_TEMPERATURES 0x1e00 /* internal and every probe */
+#define POWERLOG6S_UNIT_ALL 0x1fff
+
+/* Longest CSV line, newline included, powerlog6s_csv_format() writes. */
+#define POWERLOG6S_CSV_MAX 160
+
+DECLARE_string(csv_units);
+
+extern const char kPowerlog6sCsvHeader[];
+/* Which columns are in engineering units, set by powerlog6s_use_units(). */
+extern unsigned powerlog6s_units;
+
+void fregister_powerlog6s();
+
+/* Writes the columns named in spec, comma separated, in engineering units
+ * from now on, and the rest as logged. Names are those of the CSV header,
+ * or cells, temps or all for several at once. Returns SUCCESS, or
+ * USER_SUCKS if a name's unknown. */
+int powerlog6s_use_units(const char* spec);
+/* Header line, newline included, naming each column's unit as chosen. */
+const char* powerlog6s_csv_columns();
+
 void powerlog6s_csv_header();
 void powerlog6s_csv_entry(powerlog6s* log);
+/* Same line as powerlog6s_csv_entry() but written into out, which must have
+ * room for POWERLOG6S_CSV_MAX bytes, without going through stdio. Returns the
+ * number of bytes written. Gap markers become a comment line. Columns in
+ * engineering units are exact decimals of what was logged, made with integer
+ * arithmetic alone. */
+size_t powerlog6s_csv_format(const powerlog6s* log, char* out);
+
+/* Fills in a marker of count entries lost after the one at interval, for
+ * writing to captures in their place. It's laid out as a log entry, so
+ * --binary captures keep to fixed size records, with energy holding count. */
+void powerlog6s_gap(powerlog6s* gap, uint32_t interval, uint32_t count);
+/* Fills in a marker of the device being lost and found again after the
+ * entry at interval, milliseconds later. It's a gap of unknown length, with
+ * state POWERLOG6S_GAP_RECONNECT and energy holding milliseconds. */
+void powerlog6s_reconnect(powerlog6s* gap, uint32_t interval,
+    uint32_t milliseconds);
 
 #endif  /* POWERLOG6S_H_ */
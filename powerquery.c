@@ -0,0 +1,348 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Answers questions about a time range of columnar capture files
+ * (--format=columnar) from the summary tree at the end of each. Without
+ * --where, prints the minimum, maximum, mean and sum of every column over
+ * the range, reading records only in the blocks the range starts and ends
+ * part way through. With --where, extracts the records matching as CSV,
+ * reading only the blocks whose summaries say they might hold some.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "colfile.h"
+#include "flags.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "timing.h"
+
+#define MAX_CONDITIONS 16
+
+DEFINE_uint64(from, 0, "Cumulative milliseconds of the first record to "
+    "query");
+DEFINE_uint64(to, UINT64_MAX, "Cumulative milliseconds of the last record to "
+    "query");
+DEFINE_string(where, NULL, "Extract the records in the range for which "
+    "column<value holds, or >, <=, >= or =, or several of them separated by "
+    "commas which must all hold. Columns are named as in the CSV header, or "
+    "cells or temps for any one of them, and values are as logged");
+
+void fregister_powerquery() {
+  REGISTER(where);
+  REGISTER(to);
+  REGISTER(from);
+}
+
+/* Holds when any of columns first to last compares with value as op says. */
+struct _condition {
+  int first;
+  int last;
+  char op; /* '<', '>', '=', or 'l' and 'g' for <= and >= */
+  int64_t value;
+};
+
+struct _query {
+  struct _condition conditions[MAX_CONDITIONS];
+  int count;
+};
+
+typedef struct _condition condition;
+typedef struct _query query;
+
+int parse_where(query* q, const char* where);
+int parse_column(const char* name, size_t len, condition* c);
+int aggregate(char* path);
+int extract(output* out, const query* q, char* path, uint64_t* read,
+    uint64_t* blocks);
+int might_match(void* arg, const colfile_summary* s);
+int matches(const query* q, const colfile_block* b, uint64_t i);
+int64_t column_value(const colfile_block* b, int column, uint64_t i);
+
+int main(int argc, char** argv) {
+  output out;
+  query q;
+  uint64_t blocks;
+  uint64_t read;
+  double start;
+  int rc;
+  int i;
+
+  fregister_powerquery();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [flags...] capture...\n", argv[0]);
+    exit(USER_SUCKS);
+  }
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (!FLAGS_where) {
+    rc = SUCCESS;
+    for (i = 1; i < argc && rc == SUCCESS; i++) {
+      rc = aggregate(argv[i]);
+    }
+    return rc;
+  }
+
+  if (parse_where(&q, FLAGS_where) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (output_open(&out, STDOUT_FILENO, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  start = timing_now();
+  read = 0;
+  blocks = 0;
+  rc = output_write(&out, powerlog6s_csv_columns(),
+      strlen(powerlog6s_csv_columns()));
+  for (i = 1; i < argc && rc == SUCCESS; i++) {
+    rc = extract(&out, &q, argv[i], &read, &blocks);
+  }
+  output_close(&out);
+  fprintf(stderr, "Read %llu of %llu blocks in %.3f ms.\n",
+      (unsigned long long) read, (unsigned long long) blocks,
+      (timing_now() - start) * 1000);
+  return rc;
+}
+
+int parse_where(query* q, const char* where) {
+  const char* op;
+  char* end;
+  condition* c;
+
+  memset(q, 0, sizeof(query));
+  while (*where) {
+    if (q->count == MAX_CONDITIONS) {
+      fprintf(stderr, "--where can have at most %d conditions.\n",
+          MAX_CONDITIONS);
+      return USER_SUCKS;
+    }
+    c = &q->conditions[q->count++];
+    op = strpbrk(where, "<>=");
+    if (!op || parse_column(where, op - where, c) != SUCCESS) {
+      fprintf(stderr, "No column to compare in --where at %s\n", where);
+      return USER_SUCKS;
+    }
+    c->op = *op++;
+    if (*op == '=' && c->op != '=') {
+      c->op = c->op == '<' ? 'l' : 'g';
+      op++;
+    }
+    c->value = strtoll(op, &end, 10);
+    if (end == op || (*end && *end != ',')) {
+      fprintf(stderr, "No value to compare with in --where at %s\n", op);
+      return USER_SUCKS;
+    }
+    where = *end ? end + 1 : end;
+  }
+  return SUCCESS;
+}
+
+int parse_column(const char* name, size_t len, condition* c) {
+  int i;
+
+  if (len == 5 && strncmp(name, "cells", 5) == 0) {
+    c->first = COL_CELL1;
+    c->last = COL_CELL6;
+    return SUCCESS;
+  } else if (len == 5 && strncmp(name, "temps", 5) == 0) {
+    c->first = COL_INTERNAL_TEMPERATURE;
+    c->last = COL_TEMPERATURE3;
+    return SUCCESS;
+  }
+  for (i = 0; i < COL_COUNT; i++) {
+    if (strlen(kColfileNames[i]) == len
+        && strncmp(kColfileNames[i], name, len) == 0) {
+      c->first = i;
+      c->last = i;
+      return SUCCESS;
+    }
+  }
+  return USER_SUCKS;
+}
+
+/* Prints a table of every column over the range in one file. */
+int aggregate(char* path) {
+  colfile_summary s;
+  colfile f;
+  char name[32];
+  double start;
+  double elapsed;
+  uint64_t read;
+  int rc;
+  int i;
+
+  rc = colfile_open(&f, path);
+  if (rc != SUCCESS) {
+    return rc;
+  }
+  start = timing_now();
+  colfile_summary_init(&s);
+  read = colfile_aggregate(&f, FLAGS_from, FLAGS_to, &s);
+  elapsed = timing_now() - start;
+
+  printf("%s: %llu records", path, (unsigned long long) s.count);
+  if (s.count > 0) {
+    printf(" from %lld to %lld ms", (long long) s.min[COL_TIME],
+        (long long) s.max[COL_TIME]);
+  }
+  printf(", read %llu of %llu blocks in %.3f ms\n",
+      (unsigned long long) read, (unsigned long long) f.blocks,
+      elapsed * 1000);
+  for (i = 0; i < COL_COUNT && s.count > 0; i++) {
+    if (kColfileUnits[i]) {
+      snprintf(name, sizeof(name), "%s (%s)", kColfileNames[i],
+          kColfileUnits[i]);
+    } else {
+      snprintf(name, sizeof(name), "%s", kColfileNames[i]);
+    }
+    printf("%s: %-20s %12lld %12lld %14.3f %20lld\n", path, name,
+        (long long) s.min[i], (long long) s.max[i],
+        (double) s.sum[i] / s.count, (long long) s.sum[i]);
+  }
+  colfile_close(&f);
+  return SUCCESS;
+}
+
+int extract(output* out, const query* q, char* path, uint64_t* read,
+    uint64_t* blocks) {
+  const uint64_t* times;
+  colfile_block b;
+  powerlog6s log;
+  colfile f;
+  uint64_t block;
+  uint64_t i;
+  char* line;
+  int rc;
+
+  rc = colfile_open(&f, path);
+  if (rc != SUCCESS) {
+    return rc;
+  }
+  *blocks += f.blocks;
+  for (block = colfile_next_match(&f, 0, might_match, (void*) q);
+       block < f.blocks && rc == SUCCESS;
+       block = colfile_next_match(&f, block + 1, might_match, (void*) q)) {
+    colfile_block_at(&f, block, &b);
+    times = (const uint64_t*) b.columns[COL_TIME];
+    (*read)++;
+    for (i = colfile_find_record(&b, FLAGS_from);
+         i < b.count && times[i] <= FLAGS_to; i++) {
+      if (!matches(q, &b, i)) {
+        continue;
+      }
+      line = output_reserve(out, POWERLOG6S_CSV_MAX);
+      if (!line) {
+        rc = OUTPUT_ERROR;
+        break;
+      }
+      colfile_record(&b, i, &log);
+      output_commit(out, powerlog6s_csv_format(&log, line));
+    }
+  }
+  colfile_close(&f);
+  return rc;
+}
+
+/* Whether the records a summary covers could be in range and match every
+ * condition, from their minimums and maximums. */
+int might_match(void* arg, const colfile_summary* s) {
+  const query* q = (const query*) arg;
+  const condition* c;
+  int possible;
+  int i;
+  int j;
+
+  if (s->count == 0 || (uint64_t) s->max[COL_TIME] < FLAGS_from
+      || (uint64_t) s->min[COL_TIME] > FLAGS_to) {
+    return 0;
+  }
+  for (i = 0; i < q->count; i++) {
+    c = &q->conditions[i];
+    possible = 0;
+    for (j = c->first; j <= c->last && !possible; j++) {
+      switch (c->op) {
+        case '<':
+          possible = s->min[j] < c->value;
+          break;
+        case 'l':
+          possible = s->min[j] <= c->value;
+          break;
+        case '>':
+          possible = s->max[j] > c->value;
+          break;
+        case 'g':
+          possible = s->max[j] >= c->value;
+          break;
+        default:
+          possible = s->min[j] <= c->value && s->max[j] >= c->value;
+          break;
+      }
+    }
+    if (!possible) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int matches(const query* q, const colfile_block* b, uint64_t i) {
+  const condition* c;
+  int64_t v;
+  int holds;
+  int k;
+  int j;
+
+  for (k = 0; k < q->count; k++) {
+    c = &q->conditions[k];
+    holds = 0;
+    for (j = c->first; j <= c->last && !holds; j++) {
+      v = column_value(b, j, i);
+      switch (c->op) {
+        case '<':
+          holds = v < c->value;
+          break;
+        case 'l':
+          holds = v <= c->value;
+          break;
+        case '>':
+          holds = v > c->value;
+          break;
+        case 'g':
+          holds = v >= c->value;
+          break;
+        default:
+          holds = v == c->value;
+          break;
+      }
+    }
+    if (!holds) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int64_t column_value(const colfile_block* b, int column, uint64_t i) {
+  if (colfile_signed(column)) {
+    return ((const int16_t*) b->columns[column])[i];
+  }
+  switch (colfile_width(column)) {
+    case 8:
+      return (int64_t) ((const uint64_t*) b->columns[column])[i];
+    case 4:
+      return ((const uint32_t*) b->columns[column])[i];
+    case 2:
+      return ((const uint16_t*) b->columns[column])[i];
+    default:
+      return ((const uint8_t*) b->columns[column])[i];
+  }
+}
@@ -0,0 +1,183 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Salvages framed captures (--format=framed), however damaged: every block
+ * whose checksum holds is kept, as CSV, binary records or a clean framed
+ * file, and whatever lies between them is skipped over to the next place a
+ * block starts. Reports what was kept and lost of each file.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "frame.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+
+DEFINE_bool(binary, 0, "Write the packed records as sent by the device, as "
+    "powerup --format=binary would, rather than CSV");
+DEFINE_bool(framed, 0, "Write the blocks kept as a framed file, as they "
+    "were, rather than CSV");
+
+void fregister_powerrecover() {
+  REGISTER(framed);
+  REGISTER(binary);
+}
+
+int recover(output* out, char* path);
+int write_block(output* out, const unsigned char* block, size_t len,
+    const frame_header* h);
+
+int main(int argc, char** argv) {
+  output out;
+  int rc;
+  int i;
+
+  fregister_powerrecover();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [flags...] capture...\n", argv[0]);
+    exit(USER_SUCKS);
+  }
+  if (FLAGS_binary && FLAGS_framed) {
+    fprintf(stderr, "Pick one of --binary and --framed.\n");
+    exit(USER_SUCKS);
+  }
+  if (output_open(&out, STDOUT_FILENO, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  if (FLAGS_framed) {
+    rc = output_write(&out, FRAME_MAGIC, FRAME_MAGIC_LEN);
+  } else if (!FLAGS_binary) {
+    rc = output_write(&out, powerlog6s_csv_columns(),
+        strlen(powerlog6s_csv_columns()));
+  } else {
+    rc = SUCCESS;
+  }
+  for (i = 1; i < argc && rc == SUCCESS; i++) {
+    rc = recover(&out, argv[i]);
+  }
+  output_close(&out);
+  return rc;
+}
+
+int recover(output* out, char* path) {
+  const unsigned char* data;
+  frame_header h;
+  struct stat st;
+  uint64_t blocks;
+  uint64_t entries;
+  uint64_t damaged; /* stretches of bytes that weren't whole blocks */
+  uint64_t skipped; /* bytes in them */
+  uint64_t missing; /* blocks numbered between those kept */
+  uint64_t expected;
+  size_t offset;
+  size_t next;
+  size_t len;
+  int in_damage;
+  int rc;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    return OUTPUT_ERROR;
+  }
+  len = st.st_size;
+  data = NULL;
+  if (len > 0) {
+    data = (const unsigned char*) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd,
+        0);
+    if (data == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return OUTPUT_ERROR;
+    }
+  }
+  offset = len >= FRAME_MAGIC_LEN
+      && memcmp(data, FRAME_MAGIC, FRAME_MAGIC_LEN) == 0 ? FRAME_MAGIC_LEN : 0;
+  blocks = 0;
+  entries = 0;
+  damaged = 0;
+  skipped = 0;
+  missing = 0;
+  expected = 0;
+  in_damage = 0;
+  rc = SUCCESS;
+  while (offset < len && rc == SUCCESS) {
+    next = frame_block_at(data + offset, len - offset, &h);
+    if (next == 0) {
+      next = frame_next_sync(data, len, offset);
+      if (!in_damage) {
+        damaged++;
+      }
+      in_damage = 1;
+      skipped += next - offset;
+      offset = next;
+      continue;
+    }
+    in_damage = 0;
+    if (h.sequence > expected) {
+      missing += h.sequence - expected;
+    }
+    expected = h.sequence + 1;
+    blocks++;
+    entries += h.count;
+    rc = write_block(out, data + offset, next, &h);
+    offset += next;
+  }
+
+  fprintf(stderr, "%s: kept %llu blocks of %llu entries", path,
+      (unsigned long long) blocks, (unsigned long long) entries);
+  if (damaged > 0) {
+    fprintf(stderr, ", skipped %llu bytes in %llu damaged stretches",
+        (unsigned long long) skipped, (unsigned long long) damaged);
+  }
+  if (missing > 0) {
+    fprintf(stderr, ", %llu blocks missing", (unsigned long long) missing);
+  }
+  fprintf(stderr, ".\n");
+  if (data) {
+    munmap((void*) data, len);
+  }
+  close(fd);
+  return rc;
+}
+
+int write_block(output* out, const unsigned char* block, size_t len,
+    const frame_header* h) {
+  const unsigned char* p;
+  powerlog6s log;
+  uint32_t i;
+  char* line;
+
+  if (FLAGS_framed) {
+    return output_write(out, block, len);
+  } else if (FLAGS_binary) {
+    return output_write(out, block + sizeof(frame_header),
+        len - sizeof(frame_header));
+  }
+  p = block + sizeof(frame_header);
+  for (i = 0; i < h->count; i++, p += sizeof(powerlog6s)) {
+    line = output_reserve(out, POWERLOG6S_CSV_MAX);
+    if (!line) {
+      return OUTPUT_ERROR;
+    }
+    memcpy(&log, p, sizeof(powerlog6s));
+    output_commit(out, powerlog6s_csv_format(&log, line));
+  }
+  return SUCCESS;
+}
@@ -4,152 +4,297 @@
  * Main application for reading log data.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "capture.h"
+#include "convert.h"
 #include "flags.h"
-#include "hidapi.h"
+#include "device.h"
+#include "flight.h"
 #include "hidselect.h"
+#include "live.h"
+#include "metrics.h"
 #include "powerlog6s.h"
 #include "rc.h"
+#include "session.h"
+#include "simdevice.h"
 
-#define USB_BUF_LEN 64
-
-DEFINE_bool(autoend, 1, "Exit when the device indicates the end of a log."
-    " Only works when interpreting device data (see --interpret)");
-DEFINE_bool(binary, 0, "Dump data as raw binary rather than CSV if "
-    "interpreting the data, or hex if not");
-DEFINE_bool(interpret, 1, "Interpret the binary data being read to "
-    "output only log entires. If false, full buffers will be written");
+DEFINE_string(output_pattern, NULL, "Write output to files named by this "
+    "pattern rather than stdout, with %s replaced by the device's serial "
+    "number. Required when capturing from several devices");
 
 void fregister_powerup() {
-  REGISTER(interpret);
-  REGISTER(binary);
-  REGISTER(autoend);
+  REGISTER(output_pattern);
 }
 
-int print_log(powerlog6s* log);
-int print_raw(unsigned char* buf, int len);
-int read_log(hid_device* device);
+int capture_all();
+int capture_one();
+char* output_path(char* name);
+int open_output(char* name);
+void request_metrics(int sig);
 void terminate(int sig);
 
-hid_device* device;
-
 int main(int argc, char** argv) {
+  int rc;
   int i;
 
   fregister_powerup();
+  fregister_batch();
+  fregister_capture();
+  fregister_convert();
+  fregister_decimate();
+  fregister_drift();
+  fregister_flight();
+  fregister_live();
+  fregister_metrics();
+  fregister_session();
+  fregister_powerlog6s();
+  fregister_simdevice();
   fregister_hidselect();
   fregister_flags();
 
   parse_flags(&argc, &argv);
+  if (metrics_init() != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  signal(SIGINT, terminate);
+  signal(SIGUSR1, request_metrics);
+  if (batch_enabled() && argc < 2) {
+    fprintf(stderr, "--batch needs dumps, directories or patterns to "
+        "convert.\n");
+    exit(USER_SUCKS);
+  }
   if (argc > 1) {
-    fprintf(stderr, "I've got no idea what these args mean:\n");
+    /* Dumps to convert rather than a device to capture from. */
     for (i = 1; i < argc; i++) {
-      fprintf(stderr, "%s\n", argv[i]);
+      if (argv[i][0] == '-') {
+        fprintf(stderr, "I've got no idea what '%s' means.\n", argv[i]);
+        exit(USER_SUCKS);
+      }
+    }
+    if (FLAGS_host_time) {
+      fprintf(stderr, "--host_time stamps reports as they're read from a "
+          "device, so has nothing to stamp converting dumps. Dumps captured "
+          "with it are converted with their times regardless.\n");
+      exit(USER_SUCKS);
     }
+    if (batch_enabled()) {
+      rc = batch_run(argc - 1, argv + 1);
+    } else {
+      rc = convert_dumps(argc - 1, argv + 1, STDOUT_FILENO);
+    }
+    metrics_dump();
+    return rc;
+  }
+  if (FLAGS_output_pattern && !strstr(FLAGS_output_pattern, "%s")) {
+    fprintf(stderr, "--output_pattern must contain %%s.\n");
     exit(USER_SUCKS);
   }
+  if (FLAGS_rotate_bytes && (!FLAGS_output_pattern || sessions_enabled())) {
+    fprintf(stderr, "--rotate_bytes needs --output_pattern to name files, "
+        "and can't be combined with --session_pattern.\n");
+    exit(USER_SUCKS);
+  }
+  if (flight_enabled()) {
+    if (FLAGS_output_pattern || FLAGS_rotate_bytes || sessions_enabled()) {
+      fprintf(stderr, "--flight_recorder writes no output, so can't be "
+          "combined with --output_pattern, --rotate_bytes or "
+          "--session_pattern.\n");
+      exit(USER_SUCKS);
+    }
+    if (flight_check_pattern(multiple_devices()) != SUCCESS) {
+      exit(USER_SUCKS);
+    }
+  }
+  if (live_enabled()) {
+    if (!FLAGS_interpret) {
+      fprintf(stderr, "--publish needs --interpret to have entries to "
+          "publish.\n");
+      exit(USER_SUCKS);
+    }
+    if (live_check_name(multiple_devices()) != SUCCESS) {
+      exit(USER_SUCKS);
+    }
+  }
+  if (sessions_enabled()) {
+    if (!FLAGS_interpret) {
+      fprintf(stderr, "--session_pattern needs --interpret to see where "
+          "sessions start and end.\n");
+      exit(USER_SUCKS);
+    }
+    if (session_check_pattern(multiple_devices()) != SUCCESS) {
+      exit(USER_SUCKS);
+    }
+  }
 
-  signal(SIGINT, terminate);
-  device = open_device();
-  if (device) {
-    if (FLAGS_interpret && !FLAGS_binary) {
-      powerlog6s_csv_header();
-    }
-    do {
-      i = read_log(device);
-    } while (i == READ_AGAIN);
-    hid_close(device);
-    return i;
+  if (multiple_devices()) {
+    rc = capture_all();
   } else {
-    return DEVICE_MISSING;
+    rc = capture_one();
   }
+  metrics_dump();
+  return rc;
 }
 
-int print_log(powerlog6s* log) {
-  if (!FLAGS_binary) {
-    powerlog6s_csv_entry(log);
-  } else if (fwrite(log, sizeof(powerlog6s), 1, stdout) < 1) {
-    perror("Failed to write log entry");
+int capture_one() {
+  capture c;
+  log_device* device;
+  int fd;
+  int rc;
+
+  device = open_device();
+  if (!device) {
+    return DEVICE_MISSING;
+  }
+  fd = FLAGS_output_pattern ? open_output("device") : STDOUT_FILENO;
+  if (fd < 0) {
+    device_close(device);
     return OUTPUT_ERROR;
   }
-  return READ_AGAIN;
+  rc = capture_init(&c, NULL, device, fd);
+  if (rc == SUCCESS) {
+    c.path = FLAGS_rotate_bytes ? output_path("device") : NULL;
+    capture_run(&c);
+    capture_finish(&c);
+    output_close(&c.out);
+    free(c.path);
+    rc = c.rc;
+  }
+  /* --reconnect may have replaced it, or lost it. */
+  if (c.device) {
+    device_close(c.device);
+  }
+  return rc;
 }
 
-int print_raw(unsigned char* buf, int len) {
+/* Captures from every device on its own thread, each to its own output. */
+int capture_all() {
+  log_device* devices[MAX_DEVICES];
+  char* names[MAX_DEVICES];
+  capture* captures;
+  pthread_t* threads;
+  int fd;
+  int n;
   int i;
-  if (!FLAGS_binary) {
-    for (i = 0; i < len; i++) {
-      fprintf(stderr, " %02x", buf[i]);
+  int rc;
+
+  if (!FLAGS_output_pattern && !sessions_enabled() && !flight_enabled()) {
+    fprintf(stderr, "Capturing from several devices needs --output_pattern, "
+        "--session_pattern or --flight_recorder to name a file for each.\n");
+    exit(USER_SUCKS);
+  }
+  n = open_devices(devices, names, MAX_DEVICES);
+  captures = (capture*) calloc(n, sizeof(capture));
+  threads = (pthread_t*) calloc(n, sizeof(pthread_t));
+  if (!captures || !threads) {
+    perror("Failed to allocate captures");
+    exit(USER_SUCKS);
+  }
+  for (i = 0; i < n; i++) {
+    /* Sessions and flight recorders open their own files. */
+    fd = sessions_enabled() || flight_enabled() ? -1 : open_output(names[i]);
+    if (fd < 0 && !sessions_enabled() && !flight_enabled()) {
+      exit(OUTPUT_ERROR);
+    }
+    rc = capture_init(&captures[i], names[i], devices[i], fd);
+    if (rc != SUCCESS) {
+      exit(rc);
+    }
+    if (FLAGS_rotate_bytes) {
+      captures[i].path = output_path(names[i]);
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&threads[i], NULL, capture_thread, &captures[i])) {
+      perror("Failed to start capture thread");
+      exit(DEVICE_ERROR);
     }
-    fprintf(stderr, "\n");
-  } else if (fwrite(buf, len, 1, stdout) < 1) {
-    perror("Failed to write raw data");
-    return OUTPUT_ERROR;
   }
-  return READ_AGAIN;
+
+  /* Report the first failure, if any. */
+  rc = SUCCESS;
+  for (i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+    capture_finish(&captures[i]);
+    capture_summary(&captures[i]);
+    if (rc == SUCCESS) {
+      rc = captures[i].rc;
+    }
+    if (captures[i].device) {
+      device_close(captures[i].device);
+    }
+    output_close(&captures[i].out);
+    if (captures[i].out.fd >= 0) {
+      close(captures[i].out.fd);
+    }
+    free(captures[i].path);
+    free(names[i]);
+  }
+  free(threads);
+  free(captures);
+  return rc;
 }
 
-int read_log(hid_device* device) {
-  unsigned char buf[USB_BUF_LEN];
-  powerlog6s_base* base = (powerlog6s_base*) buf;
-  powerlog6s* log = (powerlog6s*) buf;
-  powerlog6s_ctl* ctl = (powerlog6s_ctl*) buf;
-  int len;
+/* Names the file --output_pattern gives a device, for the caller to free,
+ * or returns NULL on failure. */
+char* output_path(char* name) {
+  char* path;
+  char* split;
+  size_t prefix;
 
-  if (!device) {
-    return DEVICE_MISSING;
+  split = strstr(FLAGS_output_pattern, "%s");
+  prefix = split - FLAGS_output_pattern;
+  path = (char*) malloc(strlen(FLAGS_output_pattern) + strlen(name) + 1);
+  if (!path) {
+    return NULL;
   }
-  len = hid_read(device, buf, USB_BUF_LEN);
-  if (len == -1) {
-    fprintf(stderr, "Error reading from device: %ls\n", hid_error(device));
-    return DEVICE_ERROR;
-  } else if (len == 0) {
-    /* Nothing to read, make sure we don't get too busy. */
-    usleep(10);
-    return READ_AGAIN;
-  } else if (!FLAGS_interpret) {
-    return print_raw(buf, len);
-  } else if (base->len < 2) {
-    fprintf(stderr, "Unexpectedly short %u byte message.\n", base->len);
-    return READ_AGAIN;
-  } else if (base->len >= 3 && base->type == POWERLOG6S_CONTROL) {
-    switch (ctl->cmd) {
-      case POWERLOG6S_START:
-      case POWERLOG6S_MID:
-        /* Nothing interesting to do with start and mid. */
-        return READ_AGAIN;
-      case POWERLOG6S_END:
-        if (FLAGS_autoend) {
-          return SUCCESS;
-        } else {
-          return READ_AGAIN;
-        }
-      default:
-        fprintf(stderr, "Unexpected control line cmd 0x%02x len %u.\n",
-            ctl->cmd, ctl->len);
-        return READ_AGAIN;
-    }
-  } else if (base->len >= 2 && base->type != POWERLOG6S_ONLINE
-      && base->type != POWERLOG6S_OFFLINE) {
-    fprintf(stderr, "Unexpected %u byte message of type %u.\n",
-        log->len, log->type);
-    return READ_AGAIN;
-  } else if (log->len != sizeof(powerlog6s)) {
-    fprintf(stderr, "Expected %zu byte log entry but got %u bytes (%u read).\n",
-        sizeof(powerlog6s), log->len, len);
-    return BAD_MESSAGE_LENGTH;
-  } else {
-    return print_log(log);
+  memcpy(path, FLAGS_output_pattern, prefix);
+  strcpy(path + prefix, name);
+  strcat(path, split + 2);
+  return path;
+}
+
+/* Opens the file --output_pattern names for a device, returning its file
+ * descriptor or -1 on failure. */
+int open_output(char* name) {
+  char* path;
+  int fd;
+
+  path = output_path(name);
+  if (!path) {
+    return -1;
   }
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+  }
+  free(path);
+  return fd;
+}
+
+/* Has the metrics dumped by whichever capture next looks, which is within
+ * --read_timeout. */
+void request_metrics(int sig) {
+  (void) sig;
+  metrics_requested = 1;
 }
 
+/* Asks every capture to wind up, which they do within --read_timeout. A
+ * second signal gives up on that and exits straight away. */
 void terminate(int sig) {
-  if (device) {
-    hid_close(device);
+  if (capture_interrupted) {
+    _exit(0);
   }
-  exit(0);
+  capture_interrupted = 1;
 }
@@ -0,0 +1,120 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Example reader of the entries powerup publishes with --publish: follows
+ * them live as CSV, however many other readers there are, until the
+ * publisher stops. With --follow it carries on through restarts, and waits
+ * for anything to be published under the name if nothing has been yet.
+ * Warns when it falls so far behind it misses some.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "livereader.h"
+#include "output.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "timing.h"
+
+/* Seconds between looks for a name nothing's published under yet. */
+#define WATCH_ATTACH_POLL 0.1
+
+DEFINE_bool(oldest, 0, "Start from the oldest entry still held rather "
+    "than the next one published");
+DEFINE_bool(follow, 0, "Carry on waiting when the publisher stops, for it "
+    "to start again, and wait for anything to be published under the name "
+    "if nothing has been yet, rather than exiting. Either way, waits for a "
+    "publisher to start on what an earlier one left");
+
+void fregister_powerwatch() {
+  REGISTER(follow);
+  REGISTER(oldest);
+}
+
+int watch(output* out, live* l);
+
+int main(int argc, char** argv) {
+  output out;
+  live l;
+  int rc;
+
+  fregister_powerwatch();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  if (FLAGS_csv_units && powerlog6s_use_units(FLAGS_csv_units) != SUCCESS) {
+    exit(USER_SUCKS);
+  }
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s [flags...] name\n", argv[0]);
+    exit(USER_SUCKS);
+  }
+  rc = live_attach(&l, argv[1], FLAGS_oldest);
+  while (rc == DEVICE_MISSING && FLAGS_follow) {
+    timing_sleep(WATCH_ATTACH_POLL);
+    rc = live_attach(&l, argv[1], FLAGS_oldest);
+  }
+  if (rc == DEVICE_MISSING) {
+    fprintf(stderr, "Nothing is published as %s.\n", argv[1]);
+  }
+  if (rc != SUCCESS) {
+    return rc;
+  }
+  if (output_open(&out, STDOUT_FILENO, 1 << 20) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  rc = output_write(&out, powerlog6s_csv_columns(),
+      strlen(powerlog6s_csv_columns()));
+  if (rc == SUCCESS) {
+    rc = watch(&out, &l);
+  }
+  output_close(&out);
+  live_detach(&l);
+  return rc;
+}
+
+int watch(output* out, live* l) {
+  powerlog6s log;
+  uint64_t lost;
+  char* line;
+  int started; /* seen a publisher at work since attaching */
+  int next;
+
+  lost = 0;
+  started = 0;
+  for (;;) {
+    next = live_next(l, &log);
+    started |= next != LIVE_CLOSED;
+    if (next == LIVE_CLOSED && started && !FLAGS_follow) {
+      fprintf(stderr, "Publisher stopped at entry %llu, with %llu missed.\n",
+          (unsigned long long) l->cursor, (unsigned long long) l->lost);
+      return output_flush(out);
+    }
+    switch (next) {
+      case LIVE_ENTRY:
+        line = output_reserve(out, POWERLOG6S_CSV_MAX);
+        if (!line) {
+          return OUTPUT_ERROR;
+        }
+        output_commit(out, powerlog6s_csv_format(&log, line));
+        break;
+      case LIVE_OVERRUN:
+        fprintf(stderr, "Fell behind, missing %llu entries.\n",
+            (unsigned long long) (l->lost - lost));
+        lost = l->lost;
+        break;
+      default:
+        /* Caught up, so pass on what's been read before sleeping. */
+        if (output_flush(out) != SUCCESS) {
+          return OUTPUT_ERROR;
+        }
+        live_wait(l);
+        break;
+    }
+  }
+}
@@ -0,0 +1,137 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Lock-free single producer, single consumer ring of USB reports. Head and
+ * tail only ever increase, and are masked to find a slot. The mutex and
+ * condition variable are only touched when the consumer has run out of work
+ * and wants to sleep.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "rc.h"
+
+#include "ring.h"
+
+void ring_signal(ring* r);
+
+int ring_init(ring* r, uint64_t size) {
+  memset(r, 0, sizeof(ring));
+  if (size == 0 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "Ring size %llu is not a power of two.\n",
+        (unsigned long long) size);
+    return USER_SUCKS;
+  }
+  r->slots = (ring_slot*) calloc(size, sizeof(ring_slot));
+  if (!r->slots) {
+    perror("Failed to allocate ring");
+    return USER_SUCKS;
+  }
+  r->size = size;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  return SUCCESS;
+}
+
+void ring_destroy(ring* r) {
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+  free(r->slots);
+  r->slots = NULL;
+}
+
+int ring_push(ring* r, const unsigned char* buf, int len, double arrival,
+    double realtime) {
+  ring_slot* slot;
+  uint64_t used;
+
+  used = r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (used == r->size) {
+    r->overruns++;
+    return 0;
+  }
+  if (len > RING_REPORT_LEN) {
+    len = RING_REPORT_LEN;
+  }
+  slot = &r->slots[r->head & (r->size - 1)];
+  slot->len = len;
+  slot->arrival = arrival;
+  slot->realtime = realtime;
+  memcpy(slot->buf, buf, len);
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  if (used + 1 > r->high_water) {
+    r->high_water = used + 1;
+  }
+  ring_signal(r);
+  return 1;
+}
+
+int ring_full(ring* r) {
+  return r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size;
+}
+
+void ring_close(ring* r) {
+  __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+  ring_signal(r);
+}
+
+ring_slot* ring_peek(ring* r) {
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+    return NULL;
+  }
+  return &r->slots[r->tail & (r->size - 1)];
+}
+
+void ring_release(ring* r) {
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+int ring_closed(ring* r) {
+  return __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+}
+
+void ring_wait(ring* r, int milliseconds) {
+  struct timeval now;
+  struct timespec deadline;
+  int rc;
+
+  if (milliseconds >= 0) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + milliseconds / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000L + (milliseconds % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  pthread_mutex_lock(&r->lock);
+  /* Announce we're going to sleep before the final check for work, so that
+   * either we see the producer's report or it sees us waiting. */
+  __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  rc = 0;
+  while (rc != ETIMEDOUT && !ring_peek(r) && !ring_closed(r)) {
+    if (milliseconds >= 0) {
+      rc = pthread_cond_timedwait(&r->wake, &r->lock, &deadline);
+    } else {
+      pthread_cond_wait(&r->wake, &r->lock);
+    }
+  }
+  __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Wakes the consumer if it's asleep, otherwise costs no more than a load. */
+void ring_signal(ring* r) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
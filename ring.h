@@ -0,0 +1,65 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Lock-free single producer, single consumer ring of USB reports. Lets one
+ * thread keep pulling reports off the device while another decodes and
+ * writes them out at whatever pace the output allows.
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define RING_REPORT_LEN 64
+#define RING_CACHE_LINE 64
+
+struct _ring_slot {
+  int len;
+  double arrival; /* when the report was read, from timing_now() */
+  double realtime; /* and from timing_realtime(), with --host_time */
+  unsigned char buf[RING_REPORT_LEN];
+};
+
+struct _ring {
+  struct _ring_slot* slots;
+  uint64_t size; /* number of slots, a power of two */
+
+  /* Written by the producer only. */
+  uint64_t head __attribute__((aligned(RING_CACHE_LINE)));
+  uint64_t high_water; /* most slots ever in use at once */
+  uint64_t overruns; /* reports dropped because the ring was full */
+  int closed;
+
+  /* Written by the consumer only. */
+  uint64_t tail __attribute__((aligned(RING_CACHE_LINE)));
+  int waiting; /* consumer is, or is about to be, asleep in ring_wait() */
+
+  pthread_mutex_t lock __attribute__((aligned(RING_CACHE_LINE)));
+  pthread_cond_t wake;
+};
+
+typedef struct _ring_slot ring_slot;
+typedef struct _ring ring;
+
+int ring_init(ring* r, uint64_t size);
+void ring_destroy(ring* r);
+
+/* Producer side. ring_push() copies the report in, with the times it arrived,
+ * or counts an overrun and returns 0 if the ring is full, which ring_full()
+ * says beforehand. ring_close() says no more are coming. */
+int ring_push(ring* r, const unsigned char* buf, int len, double arrival,
+    double realtime);
+int ring_full(ring* r);
+void ring_close(ring* r);
+
+/* Consumer side. ring_peek() returns the oldest report, or NULL if the ring is
+ * empty, which stays valid until ring_release(). ring_wait() sleeps until a
+ * report arrives, the ring is closed or the timeout (-1 for none) passes. */
+ring_slot* ring_peek(ring* r);
+void ring_release(ring* r);
+int ring_closed(ring* r);
+void ring_wait(ring* r, int milliseconds);
+
+#endif  /* RING_H_ */
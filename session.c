@@ -0,0 +1,178 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Sessions: the logs between START and END control messages, each written
+ * to its own file, with a line per session in an index.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "rc.h"
+
+#include "session.h"
+
+DEFINE_string(session_pattern, NULL, "Run until interrupted, cutting the "
+    "log into sessions at START and END control messages and writing each "
+    "to its own file named by this pattern, with %d replaced by the "
+    "session's number and %s by the device's serial number. Numbers already "
+    "taken by files from before are skipped. Ignores --autoend");
+DEFINE_string(session_index, NULL, "Append a line per session to this "
+    "file, tab separated: device, session, file, start time, offset into "
+    "what the device sent, entries, entries declared, interval, bytes, how "
+    "the session ended, and with --continuity gaps and entries lost");
+
+void fregister_session() {
+  REGISTER(session_index);
+  REGISTER(session_pattern);
+}
+
+/* Shared by every capture, and so locked. */
+pthread_mutex_t session_index_lock = PTHREAD_MUTEX_INITIALIZER;
+FILE* session_index_file = NULL;
+
+char* session_path(const char* name, uint64_t number);
+int session_index_add(const session* s, const char* name, uint64_t bytes,
+    const char* how);
+
+int sessions_enabled() {
+  return FLAGS_session_pattern != NULL;
+}
+
+int session_check_pattern(int several) {
+  if (!strstr(FLAGS_session_pattern, "%d")) {
+    fprintf(stderr, "--session_pattern must contain %%d.\n");
+    return USER_SUCKS;
+  }
+  if (several && !strstr(FLAGS_session_pattern, "%s")) {
+    fprintf(stderr, "--session_pattern must contain %%s to capture from "
+        "several devices.\n");
+    return USER_SUCKS;
+  }
+  return SUCCESS;
+}
+
+int session_open(session* s, const char* name, uint64_t offset,
+    uint64_t bytes) {
+  struct timeval now;
+
+  /* Never overwrite a session kept from before, as when powerup is started
+   * again with the same pattern: skip to the next number free. */
+  do {
+    s->number++;
+    s->path = session_path(name, s->number);
+    if (!s->path) {
+      perror("Failed to name session file");
+      return OUTPUT_ERROR;
+    }
+    s->fd = open(s->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (s->fd < 0 && errno == EEXIST) {
+      free(s->path);
+      s->path = NULL;
+    }
+  } while (s->fd < 0 && errno == EEXIST);
+  if (s->fd < 0) {
+    perror(s->path);
+    free(s->path);
+    s->path = NULL;
+    return OUTPUT_ERROR;
+  }
+  gettimeofday(&now, NULL);
+  s->started = now.tv_sec + now.tv_usec / 1e6;
+  s->offset = offset;
+  s->first_byte = bytes;
+  s->records = 0;
+  s->lines = 0;
+  s->interval = 0;
+  s->gaps = 0;
+  s->lost = 0;
+  s->open = 1;
+  return SUCCESS;
+}
+
+int session_close(session* s, const char* name, uint64_t bytes,
+    const char* how) {
+  int rc;
+
+  rc = SUCCESS;
+  if (close(s->fd) != 0) {
+    perror(s->path);
+    rc = OUTPUT_ERROR;
+  }
+  if (FLAGS_session_index
+      && session_index_add(s, name, bytes, how) != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  free(s->path);
+  s->path = NULL;
+  s->fd = -1;
+  s->open = 0;
+  return rc;
+}
+
+/* Expands %d and %s in --session_pattern, and %% to %. */
+char* session_path(const char* name, uint64_t number) {
+  const char* p;
+  char* path;
+  size_t len;
+
+  /* Room for every % to become the longer of the two. */
+  len = strlen(FLAGS_session_pattern) * (strlen(name) + 21) + 1;
+  path = (char*) malloc(len);
+  if (!path) {
+    return NULL;
+  }
+  len = 0;
+  for (p = FLAGS_session_pattern; *p; p++) {
+    if (p[0] == '%' && p[1] == 'd') {
+      len += sprintf(path + len, "%llu", (unsigned long long) number);
+      p++;
+    } else if (p[0] == '%' && p[1] == 's') {
+      len += sprintf(path + len, "%s", name);
+      p++;
+    } else if (p[0] == '%' && p[1] == '%') {
+      path[len++] = '%';
+      p++;
+    } else {
+      path[len++] = *p;
+    }
+  }
+  path[len] = '\0';
+  return path;
+}
+
+/* Each line is written and flushed whole, so the index stays usable if
+ * capture is killed, missing only sessions still open. */
+int session_index_add(const session* s, const char* name, uint64_t bytes,
+    const char* how) {
+  int rc;
+
+  rc = SUCCESS;
+  pthread_mutex_lock(&session_index_lock);
+  if (!session_index_file) {
+    session_index_file = fopen(FLAGS_session_index, "a");
+    if (!session_index_file) {
+      perror(FLAGS_session_index);
+      pthread_mutex_unlock(&session_index_lock);
+      return OUTPUT_ERROR;
+    }
+  }
+  fprintf(session_index_file, "%s\t%llu\t%s\t%.3f\t%llu\t%llu\t%u\t%u\t%llu"
+      "\t%s\t%llu\t%llu\n", name, (unsigned long long) s->number, s->path,
+      s->started, (unsigned long long) s->offset,
+      (unsigned long long) s->records, s->lines, s->interval,
+      (unsigned long long) (bytes - s->first_byte), how,
+      (unsigned long long) s->gaps, (unsigned long long) s->lost);
+  if (fflush(session_index_file) != 0) {
+    perror(FLAGS_session_index);
+    rc = OUTPUT_ERROR;
+  }
+  pthread_mutex_unlock(&session_index_lock);
+  return rc;
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Sessions: the logs between START and END control messages, each written
+ * to its own file so a capture can run unattended for days, with a line per
+ * session in an index to find one without rescanning everything.
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+
+#include "flags.h"
+
+DECLARE_string(session_pattern);
+DECLARE_string(session_index);
+
+struct _session {
+  int open;
+  uint64_t number; /* counting from 1, skipping files that exist */
+  char* path;
+  int fd;
+  double started; /* seconds since the epoch */
+  uint64_t offset; /* bytes of reports read from the device before it */
+  uint64_t first_byte; /* bytes output before it, to tell its length */
+  uint64_t records;
+  uint32_t lines; /* entries declared by START, 0 if not known */
+  uint32_t interval; /* milliseconds declared by START or MID, 0 if not */
+  uint64_t gaps; /* found by --continuity */
+  uint64_t lost; /* entries lost, found by --continuity */
+};
+
+typedef struct _session session;
+
+void fregister_session();
+
+/* Whether --session_pattern asks for sessions. */
+int sessions_enabled();
+/* Checks --session_pattern makes a distinct name for every session, and for
+ * every device if there are several. Returns SUCCESS or USER_SUCKS. */
+int session_check_pattern(int several);
+/* Opens the file for the next session of the device called name, starting
+ * offset bytes into what the device has sent and bytes into all output.
+ * Returns SUCCESS or OUTPUT_ERROR. */
+int session_open(session* s, const char* name, uint64_t offset,
+    uint64_t bytes);
+/* Closes the session's file and adds it to --session_index, bytes being all
+ * output so far. how says how it ended: "end" for an END message, "cut" for
+ * a START without one, or "exit". Returns SUCCESS or OUTPUT_ERROR. */
+int session_close(session* s, const char* name, uint64_t bytes,
+    const char* how);
+
+#endif  /* SESSION_H_ */
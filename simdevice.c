@@ -0,0 +1,416 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Simulated PowerLog 6S. Reports become available at --sim_rate per second
+ * and queue up like they would in the kernel until read. Once more than
+ * --sim_queue are waiting the oldest are dropped, which is what happens to a
+ * real device when powerup can't keep up. A summary of throughput, CPU time
+ * and drops is printed when the device is closed. --sim_disconnect unplugs
+ * the device, failing reads and opens for --sim_outage, to try --reconnect,
+ * and opening it again carries on with the log where it left off.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "flags.h"
+#include "timing.h"
+
+#include "simdevice.h"
+
+#define SIM_REPORT_LEN 64
+
+#define SIM_ONLINE 1
+#define SIM_OFFLINE 2
+#define SIM_REPLAY 3
+
+/* Devices kept apart across opens, by the unit passed to sim_open(). */
+#define SIM_UNITS 65
+
+DEFINE_string(simulate, NULL, "Read from a simulated device instead of USB. "
+    "Either 'online' or 'offline' to synthesize messages of that kind, or the "
+    "path of a raw dump written with --interpret=0 --binary to replay");
+DEFINE_uint64(sim_rate, 0, "Reports per second produced by the simulated "
+    "device, 0 for as fast as they are read");
+DEFINE_uint64(sim_records, 100000, "Number of log records to synthesize, 0 "
+    "for no limit");
+DEFINE_uint64(sim_step, 100, "Milliseconds between synthesized log records");
+DEFINE_uint64(sim_queue, 64, "Reports the simulated device holds before "
+    "dropping the oldest");
+DEFINE_uint64(sim_disconnect, 0, "Unplug the simulated device each time it "
+    "has delivered this many more reports, 0 for never. Its log carries on "
+    "where it left off once it's opened again");
+DEFINE_uint64(sim_outage, 1000, "Milliseconds an unplugged simulated device "
+    "stays unplugged, failing to open");
+
+void fregister_simdevice() {
+  REGISTER(sim_outage);
+  REGISTER(sim_disconnect);
+  REGISTER(sim_queue);
+  REGISTER(sim_step);
+  REGISTER(sim_records);
+  REGISTER(sim_rate);
+  REGISTER(simulate);
+}
+
+struct _sim_device {
+  int mode;
+  int unit;
+  FILE* replay;
+  sim_synth synth;
+  uint64_t produced; /* reports produced, whether delivered or dropped */
+  uint64_t delivered;
+  uint64_t unplug_at; /* delivered, with --sim_disconnect */
+  int exhausted; /* produced all there is */
+  uint64_t records; /* log records among the delivered reports */
+  uint64_t dropped;
+  double latency; /* seconds reports spent queued, in total */
+  double max_latency;
+  double start;
+  struct rusage start_usage;
+  const wchar_t* error;
+};
+
+/* Where a unit's log had got to when it was last closed, for the next open
+ * to carry on from. */
+struct _sim_unit {
+  double unplugged_until; /* by timing_now() */
+  int closed; /* the rest is from an earlier open */
+  int exhausted;
+  sim_synth synth;
+  uint64_t produced;
+  uint64_t delivered;
+  long replay_offset;
+};
+
+typedef struct _sim_device sim_device;
+typedef struct _sim_unit sim_unit;
+
+/* Guarded by sim_units_lock, as each is read and written by its own
+ * capture thread. */
+sim_unit sim_units[SIM_UNITS];
+pthread_mutex_t sim_units_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int sim_read(log_device* device, unsigned char* buf, size_t len);
+int sim_read_timeout(log_device* device, unsigned char* buf, size_t len,
+    int milliseconds);
+const wchar_t* sim_error(log_device* device);
+void sim_close(log_device* device);
+
+int32_t sim_noise(sim_synth* synth, int32_t amplitude);
+uint64_t sim_pending(sim_device* sim, double now);
+int sim_produce(sim_device* sim, unsigned char* buf);
+void sim_summary(sim_device* sim);
+
+log_device_ops sim_ops = {
+  "simulator",
+  sim_read,
+  sim_read_timeout,
+  sim_error,
+  sim_close
+};
+
+log_device* sim_open(char* source, int unit) {
+  log_device* device;
+  sim_device* sim;
+  sim_unit last;
+
+  unit = unit < 0 || unit >= SIM_UNITS ? 0 : unit;
+  pthread_mutex_lock(&sim_units_lock);
+  last = sim_units[unit];
+  pthread_mutex_unlock(&sim_units_lock);
+  /* One that's run out stays unplugged. */
+  if (last.exhausted || timing_now() < last.unplugged_until) {
+    return NULL;
+  }
+  sim = (sim_device*) calloc(1, sizeof(sim_device));
+  device = (log_device*) malloc(sizeof(log_device));
+  if (!sim || !device) {
+    free(sim);
+    free(device);
+    return NULL;
+  }
+  if (strcmp(source, "online") == 0) {
+    sim->mode = SIM_ONLINE;
+    sim_synth_init(&sim->synth, POWERLOG6S_ONLINE, FLAGS_sim_step);
+  } else if (strcmp(source, "offline") == 0) {
+    sim->mode = SIM_OFFLINE;
+    sim_synth_init(&sim->synth, POWERLOG6S_OFFLINE, FLAGS_sim_step);
+  } else {
+    sim->mode = SIM_REPLAY;
+    sim->replay = fopen(source, "rb");
+    if (!sim->replay) {
+      perror(source);
+      free(sim);
+      free(device);
+      return NULL;
+    }
+  }
+  sim->unit = unit;
+  if (last.closed) {
+    sim->synth = last.synth;
+    sim->produced = last.produced;
+    sim->delivered = last.delivered;
+    if (sim->replay && fseek(sim->replay, last.replay_offset, SEEK_SET)) {
+      perror(source);
+      fclose(sim->replay);
+      free(sim);
+      free(device);
+      return NULL;
+    }
+  }
+  sim->unplug_at = sim->delivered + FLAGS_sim_disconnect;
+  fprintf(stderr, "Simulating PowerLog 6S from %s\n", source);
+
+  /* Reports due at --sim_rate carry on from those already produced. */
+  sim->start = timing_now()
+      - (FLAGS_sim_rate ? (double) sim->produced / FLAGS_sim_rate : 0);
+  getrusage(RUSAGE_SELF, &sim->start_usage);
+  device->ops = &sim_ops;
+  device->impl = sim;
+  return device;
+}
+
+int sim_read(log_device* device, unsigned char* buf, size_t len) {
+  return sim_read_timeout(device, buf, len, 0);
+}
+
+int sim_read_timeout(log_device* device, unsigned char* buf, size_t len,
+    int milliseconds) {
+  sim_device* sim = (sim_device*) device->impl;
+  unsigned char report[SIM_REPORT_LEN];
+  double now;
+  double deadline;
+  double wait;
+  int n;
+
+  if (sim->error) {
+    return -1;
+  }
+  if (FLAGS_sim_disconnect && sim->delivered >= sim->unplug_at) {
+    sim->error = L"Simulated device unplugged";
+    pthread_mutex_lock(&sim_units_lock);
+    sim_units[sim->unit].unplugged_until = timing_now()
+        + FLAGS_sim_outage / 1000.0;
+    pthread_mutex_unlock(&sim_units_lock);
+    return -1;
+  }
+  now = timing_now();
+  deadline = now + milliseconds / 1000.0;
+  while (!sim_pending(sim, now)) {
+    if (milliseconds == 0 || (milliseconds > 0 && now >= deadline)) {
+      return 0;
+    }
+    /* Sleep until the next report is due, or the timeout expires. */
+    wait = sim->start + (double) sim->produced / FLAGS_sim_rate - now;
+    if (milliseconds > 0 && deadline - now < wait) {
+      wait = deadline - now;
+    }
+    timing_sleep(wait);
+    now = timing_now();
+  }
+
+  n = sim_produce(sim, report);
+  sim->exhausted = n == 0;
+  if (n <= 0) {
+    sim->error = n == 0 ? L"Simulated device has no more data"
+        : L"Failed to read replay file";
+    return -1;
+  }
+  if ((size_t) n > len) {
+    n = (int) len;
+  }
+  memcpy(buf, report, n);
+  if (FLAGS_sim_rate) {
+    /* How long the report sat in the queue before being read. */
+    wait = now - sim->start - (double) (sim->produced - 1) / FLAGS_sim_rate;
+    sim->latency += wait;
+    if (wait > sim->max_latency) {
+      sim->max_latency = wait;
+    }
+  }
+  sim->delivered++;
+  if (n >= 2 && (report[1] == POWERLOG6S_ONLINE
+      || report[1] == POWERLOG6S_OFFLINE)) {
+    sim->records++;
+  }
+  return n;
+}
+
+const wchar_t* sim_error(log_device* device) {
+  return ((sim_device*) device->impl)->error;
+}
+
+void sim_close(log_device* device) {
+  sim_device* sim = (sim_device*) device->impl;
+  sim_unit* u = &sim_units[sim->unit];
+
+  sim_summary(sim);
+  pthread_mutex_lock(&sim_units_lock);
+  u->closed = 1;
+  u->exhausted = sim->exhausted;
+  u->synth = sim->synth;
+  u->produced = sim->produced;
+  u->delivered = sim->delivered;
+  u->replay_offset = sim->replay ? ftell(sim->replay) : 0;
+  pthread_mutex_unlock(&sim_units_lock);
+  if (sim->replay) {
+    fclose(sim->replay);
+  }
+  free(sim);
+  free(device);
+}
+
+void sim_synth_init(sim_synth* synth, uint8_t type, uint32_t step) {
+  memset(synth, 0, sizeof(sim_synth));
+  synth->type = type;
+  synth->step = step;
+  synth->seed = 6;
+}
+
+/* Fakes a 6 cell pack being discharged with the throttle sweeping up and
+ * down, sagging under load and slowly warming up. */
+void sim_synth_record(sim_synth* synth, powerlog6s* log) {
+  uint32_t phase;
+  uint32_t energy;
+  int32_t current;
+  int32_t rest;
+  int32_t sum;
+  int i;
+
+  memset(log, 0, sizeof(powerlog6s));
+  log->len = sizeof(powerlog6s);
+  log->type = synth->type;
+  log->interval = (uint32_t) (synth->index * synth->step);
+
+  phase = synth->index % 200;
+  current = 200 + 40 * (int32_t) (phase < 100 ? phase : 200 - phase)
+      + sim_noise(synth, 20);
+  synth->charge += (uint64_t) current * synth->step;
+  energy = (uint32_t) (synth->charge / 360000);
+  log->current = (int16_t) current;
+  log->energy = energy;
+
+  rest = 4200 - (int32_t) (energy > 5000 ? 5000 : energy) * 900 / 5000;
+  sum = 0;
+  for (i = 0; i < 6; i++) {
+    log->cell[i] = (int16_t) (rest - current / 20 + sim_noise(synth, 4) - i);
+    sum += log->cell[i];
+  }
+  log->voltage = (uint16_t) (sum / 10);
+
+  log->rpm = (uint16_t) (current * 3 + sim_noise(synth, 50));
+  log->internal_temperature = (int16_t) (250 + (synth->index < 30000
+      ? synth->index / 100 : 300));
+  log->temperature[0] = (int16_t) (log->internal_temperature + 50
+      + sim_noise(synth, 2));
+  log->temperature[1] = (int16_t) (log->internal_temperature + 20
+      + sim_noise(synth, 2));
+  log->period = 20000;
+  log->pulse = (uint16_t) (1000 + (current - 200) / 4);
+  synth->index++;
+}
+
+int32_t sim_noise(sim_synth* synth, int32_t amplitude) {
+  synth->seed = synth->seed * 1103515245 + 12345;
+  return (int32_t) ((synth->seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+/* Number of reports waiting to be read at time now, dropping the oldest if
+ * the queue has overflowed. */
+uint64_t sim_pending(sim_device* sim, double now) {
+  unsigned char scratch[SIM_REPORT_LEN];
+  uint64_t due;
+  uint64_t pending;
+
+  if (FLAGS_sim_rate == 0) {
+    return 1;
+  }
+  due = (uint64_t) ((now - sim->start) * FLAGS_sim_rate) + 1;
+  if (due <= sim->produced) {
+    return 0;
+  }
+  pending = due - sim->produced;
+  while (FLAGS_sim_queue && pending > FLAGS_sim_queue) {
+    if (sim_produce(sim, scratch) <= 0) {
+      /* Out of data, let the caller find out. */
+      return 1;
+    }
+    sim->dropped++;
+    pending--;
+  }
+  return pending;
+}
+
+/* Fills buf with the next report in the simulated stream. Returns its length,
+ * 0 once there are no more reports, or -1 on error. */
+int sim_produce(sim_device* sim, unsigned char* buf) {
+  powerlog6s_ctl* ctl = (powerlog6s_ctl*) buf;
+  uint64_t index = sim->produced;
+  uint32_t x;
+  uint32_t y;
+  size_t n;
+
+  memset(buf, 0, SIM_REPORT_LEN);
+  if (sim->mode == SIM_REPLAY) {
+    n = fread(buf, 1, SIM_REPORT_LEN, sim->replay);
+    if (n == 0) {
+      return ferror(sim->replay) ? -1 : 0;
+    }
+    sim->produced++;
+    return (int) n;
+  }
+
+  if (sim->mode == SIM_OFFLINE && index == 0) {
+    /* Start of a downloaded log: x is the number of lines, y the interval. */
+    ctl->len = 11;
+    ctl->type = POWERLOG6S_CONTROL;
+    ctl->cmd = POWERLOG6S_START;
+    x = (uint32_t) FLAGS_sim_records;
+    y = (uint32_t) FLAGS_sim_step;
+    memcpy(buf + 3, &x, sizeof(x));
+    memcpy(buf + 7, &y, sizeof(y));
+  } else if (FLAGS_sim_records
+      && sim->synth.index >= FLAGS_sim_records) {
+    /* Either log ends with END, after the START of an offline one. */
+    if (index > FLAGS_sim_records + (sim->mode == SIM_OFFLINE)) {
+      return 0;
+    }
+    ctl->len = 3;
+    ctl->type = POWERLOG6S_CONTROL;
+    ctl->cmd = POWERLOG6S_END;
+  } else {
+    sim_synth_record(&sim->synth, (powerlog6s*) buf);
+  }
+  sim->produced++;
+  return SIM_REPORT_LEN;
+}
+
+void sim_summary(sim_device* sim) {
+  struct rusage usage;
+  double elapsed;
+  double user;
+  double sys;
+
+  elapsed = timing_now() - sim->start;
+  getrusage(RUSAGE_SELF, &usage);
+  user = (usage.ru_utime.tv_sec - sim->start_usage.ru_utime.tv_sec)
+      + (usage.ru_utime.tv_usec - sim->start_usage.ru_utime.tv_usec) / 1e6;
+  sys = (usage.ru_stime.tv_sec - sim->start_usage.ru_stime.tv_sec)
+      + (usage.ru_stime.tv_usec - sim->start_usage.ru_stime.tv_usec) / 1e6;
+
+  fprintf(stderr, "Simulated %llu reports (%llu log records), %llu dropped.\n",
+      (unsigned long long) sim->delivered, (unsigned long long) sim->records,
+      (unsigned long long) sim->dropped);
+  fprintf(stderr, "%.3f s elapsed, %.3f s CPU (%.3f user, %.3f system), "
+      "%.0f records/s.\n", elapsed, user + sys, user, sys,
+      elapsed > 0 ? sim->records / elapsed : 0.0);
+  if (FLAGS_sim_rate && sim->delivered) {
+    fprintf(stderr, "Reports waited %.1f us on average, %.1f us at most, "
+        "between arriving and being read.\n",
+        sim->latency / sim->delivered * 1e6, sim->max_latency * 1e6);
+  }
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Simulated PowerLog 6S. Replays raw dumps (as written by --interpret=0
+ * --binary) or synthesizes log and control messages at a configurable rate,
+ * so powerup can be exercised and benchmarked without hardware.
+ */
+
+#ifndef SIMDEVICE_H_
+#define SIMDEVICE_H_
+
+#include <stdint.h>
+
+#include "device.h"
+#include "flags.h"
+#include "powerlog6s.h"
+
+DECLARE_string(simulate);
+
+/* State for synthesizing a plausible discharge log, one record at a time. */
+struct _sim_synth {
+  uint8_t type; /* POWERLOG6S_ONLINE or POWERLOG6S_OFFLINE */
+  uint32_t step; /* milliseconds between records */
+  uint64_t index; /* records synthesized so far */
+  uint32_t seed;
+  uint64_t charge; /* centiamp milliseconds drawn so far */
+};
+
+typedef struct _sim_synth sim_synth;
+
+void fregister_simdevice();
+/* Opens a simulated device reading from source, failing while the device
+ * numbered unit (from 1 for several devices, or 0) is unplugged. */
+log_device* sim_open(char* source, int unit);
+
+void sim_synth_init(sim_synth* synth, uint8_t type, uint32_t step);
+void sim_synth_record(sim_synth* synth, powerlog6s* log);
+
+#endif  /* SIMDEVICE_H_ */
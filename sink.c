@@ -0,0 +1,308 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Writer thread and fsync() policy for buffered output.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "rc.h"
+#include "timing.h"
+
+#include "sink.h"
+
+void* sink_thread(void* arg);
+void sink_wait(sink* s);
+int sink_write(int fd, struct iovec* iov, int n);
+
+char* sink_alloc(size_t cap) {
+  void* buf;
+
+  if (posix_memalign(&buf, SINK_ALIGN, cap) != 0) {
+    return NULL;
+  }
+  return (char*) buf;
+}
+
+void sink_sync_init(sink_sync* y, uint64_t records, uint64_t milliseconds) {
+  memset(y, 0, sizeof(sink_sync));
+  y->every_records = records;
+  y->every_seconds = milliseconds / 1000.0;
+  y->fd = -1;
+}
+
+int sink_sync_enabled(const sink_sync* y) {
+  return y->every_records > 0 || y->every_seconds > 0;
+}
+
+int sink_sync_wrote(sink_sync* y, int fd, uint64_t records) {
+  if (!sink_sync_enabled(y)) {
+    return SUCCESS;
+  }
+  /* Output moving on to another file takes what was written to the last
+   * with it. */
+  if (y->fd != fd && sink_sync_now(y) != SUCCESS) {
+    return OUTPUT_ERROR;
+  }
+  if (y->fd < 0) {
+    y->fd = fd;
+    y->since = timing_now();
+  }
+  y->records += records;
+  if (y->every_records > 0 && y->records >= y->every_records) {
+    return sink_sync_now(y);
+  }
+  return sink_sync_poll(y);
+}
+
+int sink_sync_poll(sink_sync* y) {
+  if (y->fd >= 0 && y->every_seconds > 0
+      && timing_now() - y->since >= y->every_seconds) {
+    return sink_sync_now(y);
+  }
+  return SUCCESS;
+}
+
+int sink_sync_now(sink_sync* y) {
+  double start;
+  int rc;
+
+  if (y->fd < 0) {
+    return SUCCESS;
+  }
+  start = metrics_on ? timing_now() : 0;
+  rc = SUCCESS;
+  /* Pipes and terminals can't be synced, and needn't be. */
+  if (fsync(y->fd) != 0 && errno != EINVAL && errno != ENOTSUP) {
+    perror("Failed to sync output");
+    rc = OUTPUT_ERROR;
+  }
+  if (metrics_on) {
+    metrics_count(METRIC_FSYNCS, 1);
+    metrics_observe(METRIC_FSYNC, start);
+  }
+  y->fd = -1;
+  y->records = 0;
+  return rc;
+}
+
+int sink_start(sink* s, size_t cap, const sink_sync* y, char** buf) {
+  int i;
+
+  memset(s, 0, sizeof(sink));
+  s->sync = *y;
+  for (i = 0; i < SINK_BUFFERS; i++) {
+    s->spares[i] = sink_alloc(cap);
+    if (!s->spares[i]) {
+      perror("Failed to allocate output buffers");
+      while (i > 0) {
+        free(s->spares[--i]);
+      }
+      return OUTPUT_ERROR;
+    }
+  }
+  s->spare_count = SINK_BUFFERS - 1;
+  *buf = s->spares[SINK_BUFFERS - 1];
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->done, NULL);
+  if (pthread_create(&s->thread, NULL, sink_thread, s) != 0) {
+    perror("Failed to start output thread");
+    for (i = 0; i < SINK_BUFFERS; i++) {
+      free(s->spares[i]);
+    }
+    return OUTPUT_ERROR;
+  }
+  return SUCCESS;
+}
+
+int sink_submit(sink* s, int fd, char** buf, size_t len, uint64_t records) {
+  sink_buffer* b;
+  int failed;
+
+  pthread_mutex_lock(&s->lock);
+  b = &s->queue[(s->head + s->count) % SINK_BUFFERS];
+  b->data = *buf;
+  b->len = len;
+  b->fd = fd;
+  b->records = records;
+  s->count++;
+  pthread_cond_signal(&s->work);
+  while (s->spare_count == 0) {
+    pthread_cond_wait(&s->done, &s->lock);
+  }
+  *buf = s->spares[--s->spare_count];
+  failed = s->failed;
+  s->failed = 0;
+  pthread_mutex_unlock(&s->lock);
+  return failed ? OUTPUT_ERROR : SUCCESS;
+}
+
+int sink_busy(sink* s) {
+  int busy;
+
+  pthread_mutex_lock(&s->lock);
+  busy = s->count > 0;
+  pthread_mutex_unlock(&s->lock);
+  return busy;
+}
+
+int sink_drain(sink* s) {
+  int failed;
+
+  pthread_mutex_lock(&s->lock);
+  s->sync_wanted = sink_sync_enabled(&s->sync);
+  pthread_cond_signal(&s->work);
+  while (s->count > 0 || s->sync_wanted) {
+    pthread_cond_wait(&s->done, &s->lock);
+  }
+  failed = s->failed;
+  s->failed = 0;
+  pthread_mutex_unlock(&s->lock);
+  return failed ? OUTPUT_ERROR : SUCCESS;
+}
+
+void sink_stop(sink* s) {
+  pthread_mutex_lock(&s->lock);
+  s->stopping = 1;
+  pthread_cond_signal(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->thread, NULL);
+  while (s->spare_count > 0) {
+    free(s->spares[--s->spare_count]);
+  }
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->work);
+  pthread_cond_destroy(&s->done);
+}
+
+/* Writes out queued buffers, each run of them for the same file in one go,
+ * and syncs them when due. */
+void* sink_thread(void* arg) {
+  sink* s = (sink*) arg;
+  struct iovec iov[SINK_BUFFERS];
+  sink_buffer* b;
+  uint64_t records;
+  int fd;
+  int n;
+  int rc;
+
+  pthread_mutex_lock(&s->lock);
+  while (s->count > 0 || s->sync_wanted || !s->stopping) {
+    if (s->count == 0 && !s->sync_wanted) {
+      sink_wait(s);
+      if (s->count == 0 && !s->sync_wanted) {
+        pthread_mutex_unlock(&s->lock);
+        rc = sink_sync_poll(&s->sync);
+        pthread_mutex_lock(&s->lock);
+        s->failed |= rc != SUCCESS;
+      }
+      continue;
+    } else if (s->count == 0) {
+      pthread_mutex_unlock(&s->lock);
+      rc = sink_sync_now(&s->sync);
+      pthread_mutex_lock(&s->lock);
+      s->failed |= rc != SUCCESS;
+      s->sync_wanted = 0;
+      pthread_cond_broadcast(&s->done);
+      continue;
+    }
+
+    fd = s->queue[s->head].fd;
+    records = 0;
+    for (n = 0; n < (int) s->count; n++) {
+      b = &s->queue[(s->head + n) % SINK_BUFFERS];
+      if (b->fd != fd) {
+        break;
+      }
+      iov[n].iov_base = b->data;
+      iov[n].iov_len = b->len;
+      records += b->records;
+    }
+    pthread_mutex_unlock(&s->lock);
+    rc = sink_write(fd, iov, n);
+    if (rc == SUCCESS) {
+      rc = sink_sync_wrote(&s->sync, fd, records);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->failed |= rc != SUCCESS;
+    while (n-- > 0) {
+      s->spares[s->spare_count++] = s->queue[s->head].data;
+      s->head = (s->head + 1) % SINK_BUFFERS;
+      s->count--;
+    }
+    pthread_cond_broadcast(&s->done);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/* Waits for work, or until unsynced output is due to be synced. */
+void sink_wait(sink* s) {
+  struct timespec deadline;
+  struct timeval now;
+  double wait;
+  double when;
+
+  if (s->sync.fd < 0 || s->sync.every_seconds <= 0) {
+    pthread_cond_wait(&s->work, &s->lock);
+    return;
+  }
+  wait = s->sync.since + s->sync.every_seconds - timing_now();
+  if (wait <= 0) {
+    return;
+  }
+  /* Condition variables time out by the wall clock. */
+  gettimeofday(&now, NULL);
+  when = now.tv_sec + now.tv_usec / 1e6 + wait;
+  deadline.tv_sec = (time_t) when;
+  deadline.tv_nsec = (long) ((when - deadline.tv_sec) * 1e9);
+  pthread_cond_timedwait(&s->work, &s->lock, &deadline);
+}
+
+/* Writes every byte of the n buffers in iov, as few writev()s as it
+ * takes. */
+int sink_write(int fd, struct iovec* iov, int n) {
+  size_t total;
+  ssize_t done;
+  double start;
+  int i;
+
+  start = metrics_on ? timing_now() : 0;
+  total = 0;
+  for (i = 0; i < n; i++) {
+    total += iov[i].iov_len;
+  }
+  while (n > 0) {
+    done = writev(fd, iov, n);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write output");
+      return OUTPUT_ERROR;
+    }
+    while (n > 0 && (size_t) done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*) iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  if (metrics_on) {
+    metrics_count(METRIC_FLUSHES, 1);
+    metrics_count(METRIC_BYTES, total);
+    metrics_observe(METRIC_OUTPUT, start);
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Where buffered output goes once it's flushed: a writer thread that takes
+ * whole buffers from output.c and writes everything queued for a file in a
+ * single writev(), so a slow disk or a full pipe holds up only that thread,
+ * never reads from the device. Also decides when output is fsync()ed, with
+ * or without the thread, trading durability for throughput.
+ */
+
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffers each sink has, one being filled and the rest queued or spare. */
+#define SINK_BUFFERS 4
+/* Buffers are aligned to pages, for the kernel to copy from cheaply. */
+#define SINK_ALIGN 4096
+
+/* When to fsync(). Without limits it never is, leaving it to the kernel. */
+struct _sink_sync {
+  uint64_t every_records; /* fsync() once this many are written, 0 if not */
+  double every_seconds; /* or once the oldest is this old, 0 if not */
+  int fd; /* written to since the last fsync(), or -1 */
+  uint64_t records; /* written to fd since the last fsync() */
+  double since; /* when fd was first written to since then */
+};
+
+typedef struct _sink_sync sink_sync;
+
+struct _sink_buffer {
+  char* data;
+  size_t len;
+  int fd;
+  uint64_t records;
+};
+
+typedef struct _sink_buffer sink_buffer;
+
+struct _sink {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* signalled when there's something to write */
+  pthread_cond_t done; /* signalled when a buffer has been written */
+  sink_buffer queue[SINK_BUFFERS]; /* oldest first, from head */
+  unsigned head;
+  unsigned count;
+  char* spares[SINK_BUFFERS];
+  unsigned spare_count;
+  sink_sync sync; /* only touched by the writer thread */
+  int sync_wanted; /* set by sink_drain() */
+  int failed; /* a write or fsync() failed since last reported */
+  int stopping;
+};
+
+typedef struct _sink sink;
+
+/* Allocates an aligned buffer of cap bytes, or returns NULL. */
+char* sink_alloc(size_t cap);
+
+/* Sets when to fsync(), milliseconds being 0 for no time limit and records
+ * 0 for no limit on records. */
+void sink_sync_init(sink_sync* y, uint64_t records, uint64_t milliseconds);
+/* Whether there's any limit, and so any need to fsync(). */
+int sink_sync_enabled(const sink_sync* y);
+/* Notes records written to fd, calling fsync() if that's now due. Returns
+ * SUCCESS or OUTPUT_ERROR. */
+int sink_sync_wrote(sink_sync* y, int fd, uint64_t records);
+/* Calls fsync() if unsynced output has got too old. */
+int sink_sync_poll(sink_sync* y);
+/* Calls fsync() if anything's been written since the last. */
+int sink_sync_now(sink_sync* y);
+
+/* Starts the writer thread with buffers of cap bytes, storing one to fill
+ * in buf. y says when to fsync(). Returns SUCCESS or OUTPUT_ERROR. */
+int sink_start(sink* s, size_t cap, const sink_sync* y, char** buf);
+/* Queues the len bytes in *buf, holding records records, to be written to
+ * fd, and swaps in an empty buffer, waiting for one if they're all queued.
+ * Returns OUTPUT_ERROR if an earlier write failed. */
+int sink_submit(sink* s, int fd, char** buf, size_t len, uint64_t records);
+/* Whether there's anything queued still to be written. */
+int sink_busy(sink* s);
+/* Waits for everything queued to be written, and fsync()ed if there are
+ * limits on when to. Returns SUCCESS or OUTPUT_ERROR. */
+int sink_drain(sink* s);
+/* Drains the sink and stops the thread, freeing every buffer but the one
+ * being filled. */
+void sink_stop(sink* s);
+
+#endif  /* SINK_H_ */
@@ -0,0 +1,298 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Running statistics. Mean and variance use Welford's method, which stays
+ * accurate over billions of entries. Everything is updated on the integers
+ * as logged, so the only division per value is the one Welford needs.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "stats.h"
+
+/* Steps in interval longer than this are taken as the log restarting or
+ * pausing, and aren't integrated over. */
+#define MAX_STEP_MS 60000
+
+const double kStatsQuantiles[STATS_QUANTILES] = { 0.05, 0.5, 0.95 };
+
+const char* kStatsSeriesNames[STAT_COUNT] = {
+  "current A",
+  "voltage V",
+  "power W",
+  "min cell V",
+  "imbalance V",
+  "rpm",
+  "internal C",
+  "temp1 C",
+  "temp2 C",
+  "temp3 C"
+};
+
+const double kStatsScales[STAT_COUNT] = {
+  0.01, 0.01, 0.0001, 0.001, 0.001, 1, 0.1, 0.1, 0.1, 0.1
+};
+
+int stat_bucket(uint32_t magnitude);
+double stat_bucket_middle(int bucket);
+
+void stat_series_init(stat_series* s, double scale) {
+  memset(s, 0, sizeof(stat_series));
+  s->scale = scale;
+}
+
+void stat_series_add(stat_series* s, int64_t value) {
+  double delta;
+
+  if (s->count == 0 || value < s->min) {
+    s->min = value;
+  }
+  if (s->count == 0 || value > s->max) {
+    s->max = value;
+  }
+  s->count++;
+  delta = value - s->mean;
+  s->mean += delta / s->count;
+  s->m2 += delta * (value - s->mean);
+  if (value < 0) {
+    s->negative[stat_bucket((uint32_t) -value)]++;
+  } else {
+    s->positive[stat_bucket((uint32_t) value)]++;
+  }
+}
+
+/* Combines means and squared differences as Chan et al. do, which is as
+ * accurate as Welford's method. */
+void stat_series_merge(stat_series* s, const stat_series* t) {
+  double delta;
+  double count;
+  int i;
+
+  if (t->count == 0) {
+    return;
+  } else if (s->count == 0) {
+    *s = *t;
+    return;
+  }
+  if (t->min < s->min) {
+    s->min = t->min;
+  }
+  if (t->max > s->max) {
+    s->max = t->max;
+  }
+  count = (double) s->count + t->count;
+  delta = t->mean - s->mean;
+  s->mean += delta * t->count / count;
+  s->m2 += t->m2 + delta * delta * s->count * t->count / count;
+  s->count += t->count;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    s->negative[i] += t->negative[i];
+    s->positive[i] += t->positive[i];
+  }
+}
+
+double stat_series_mean(const stat_series* s) {
+  return s->mean * s->scale;
+}
+
+double stat_series_stddev(const stat_series* s) {
+  return s->count > 1 ? sqrt(s->m2 / (s->count - 1)) * s->scale : 0;
+}
+
+/* Walks the histogram from the most negative value up to the bucket holding
+ * the value of rank p, giving the middle of it. */
+double stat_series_quantile(const stat_series* s, double p) {
+  uint64_t rank;
+  uint64_t seen;
+  double value;
+  int i;
+
+  if (s->count == 0) {
+    return 0;
+  }
+  rank = (uint64_t) floor(p * (s->count - 1) + 0.5);
+  seen = 0;
+  value = s->max;
+  for (i = STATS_BUCKETS - 1; i >= 0; i--) {
+    seen += s->negative[i];
+    if (seen > rank) {
+      value = -stat_bucket_middle(i);
+      break;
+    }
+  }
+  for (i = 0; i < STATS_BUCKETS && seen <= rank; i++) {
+    seen += s->positive[i];
+    if (seen > rank) {
+      value = stat_bucket_middle(i);
+    }
+  }
+  /* The ends are known exactly. */
+  if (value < s->min) {
+    value = s->min;
+  } else if (value > s->max) {
+    value = s->max;
+  }
+  return value * s->scale;
+}
+
+int stat_bucket(uint32_t magnitude) {
+  int top;
+
+  if (magnitude < STATS_LINEAR) {
+    return magnitude;
+  }
+  /* STATS_LINEAR is 1 << 6, and 32 sub-buckets are the next 5 bits. */
+  top = 31 - __builtin_clz(magnitude);
+  return STATS_LINEAR + (top - 6) * STATS_SUB_BUCKETS
+      + ((magnitude >> (top - 5)) & (STATS_SUB_BUCKETS - 1));
+}
+
+double stat_bucket_middle(int bucket) {
+  int top;
+  int sub;
+
+  if (bucket < STATS_LINEAR) {
+    return bucket;
+  }
+  top = (bucket - STATS_LINEAR) / STATS_SUB_BUCKETS + 6;
+  sub = (bucket - STATS_LINEAR) % STATS_SUB_BUCKETS;
+  return ldexp(STATS_SUB_BUCKETS + sub + 0.5, top - 5);
+}
+
+void stats_init(stats* st) {
+  int i;
+
+  memset(st, 0, sizeof(stats));
+  for (i = 0; i < STAT_COUNT; i++) {
+    stat_series_init(&st->series[i], kStatsScales[i]);
+  }
+}
+
+void stats_add(stats* st, const powerlog6s* log) {
+  int32_t power;
+  int16_t low;
+  int16_t high;
+  uint32_t step;
+  double dt;
+  int cells;
+  int i;
+
+  power = (int32_t) log->current * log->voltage;
+  stat_series_add(&st->series[STAT_CURRENT], log->current);
+  stat_series_add(&st->series[STAT_VOLTAGE], log->voltage);
+  stat_series_add(&st->series[STAT_POWER], power);
+
+  /* Unconnected cells read zero. */
+  cells = 0;
+  low = 0;
+  high = 0;
+  for (i = 0; i < 6; i++) {
+    if (log->cell[i] > 0) {
+      if (cells == 0 || log->cell[i] < low) {
+        low = log->cell[i];
+      }
+      if (cells == 0 || log->cell[i] > high) {
+        high = log->cell[i];
+      }
+      cells++;
+    }
+  }
+  if (cells > 0) {
+    stat_series_add(&st->series[STAT_MIN_CELL], low);
+    stat_series_add(&st->series[STAT_IMBALANCE], high - low);
+  }
+
+  stat_series_add(&st->series[STAT_RPM], log->rpm);
+  stat_series_add(&st->series[STAT_INTERNAL_TEMPERATURE],
+      log->internal_temperature);
+  for (i = 0; i < 3; i++) {
+    stat_series_add(&st->series[STAT_TEMPERATURE1 + i], log->temperature[i]);
+  }
+
+  /* Trapezoidal integration over the logged time, which wraps at 32 bits. */
+  if (st->records == 0) {
+    st->first_energy = log->energy;
+    st->first_interval = log->interval;
+    st->first_current = log->current;
+    st->first_power = power;
+  } else {
+    step = log->interval - st->last_interval;
+    if (step <= MAX_STEP_MS) {
+      dt = step / 3600000.0;
+      st->seconds += step / 1000.0;
+      st->amp_hours += (log->current + st->last_current) * 0.01 / 2 * dt;
+      st->watt_hours += (power + st->last_power) * 0.0001 / 2 * dt;
+    }
+  }
+  st->last_energy = log->energy;
+  st->last_interval = log->interval;
+  st->last_current = log->current;
+  st->last_power = power;
+  st->records++;
+}
+
+void stats_print(const stats* st, const char* name, FILE* f) {
+  const stat_series* s;
+  const char* prefix;
+  const char* separator;
+  int i;
+  int j;
+
+  prefix = name ? name : "";
+  separator = name ? ": " : "";
+  flockfile(f);
+  fprintf(f, "%s%s%llu records over %.1fs, %.3f Ah and %.3f Wh integrated, "
+      "%u mAh logged\n", prefix, separator, (unsigned long long) st->records,
+      st->seconds, st->amp_hours, st->watt_hours,
+      st->last_energy - st->first_energy);
+  fprintf(f, "%s%s%-12s %9s %9s %9s %9s %9s %9s %9s\n", prefix, separator,
+      "", "min", "p5", "p50", "p95", "max", "mean", "stddev");
+  for (i = 0; i < STAT_COUNT; i++) {
+    s = &st->series[i];
+    if (s->count == 0) {
+      continue;
+    }
+    fprintf(f, "%s%s%-12s %9.3f", prefix, separator, kStatsSeriesNames[i],
+        s->min * s->scale);
+    for (j = 0; j < STATS_QUANTILES; j++) {
+      fprintf(f, " %9.3f", stat_series_quantile(s, kStatsQuantiles[j]));
+    }
+    fprintf(f, " %9.3f %9.3f %9.3f\n", s->max * s->scale,
+        stat_series_mean(s), stat_series_stddev(s));
+  }
+  funlockfile(f);
+}
+
+void stats_merge(stats* st, const stats* next) {
+  uint32_t step;
+  double dt;
+  int i;
+
+  if (next->records == 0) {
+    return;
+  } else if (st->records == 0) {
+    *st = *next;
+    return;
+  }
+  for (i = 0; i < STAT_COUNT; i++) {
+    stat_series_merge(&st->series[i], &next->series[i]);
+  }
+  /* The step between the two is integrated just as any other. */
+  step = next->first_interval - st->last_interval;
+  if (step <= MAX_STEP_MS) {
+    dt = step / 3600000.0;
+    st->seconds += step / 1000.0;
+    st->amp_hours += (next->first_current + st->last_current) * 0.01 / 2
+        * dt;
+    st->watt_hours += (next->first_power + st->last_power) * 0.0001 / 2 * dt;
+  }
+  st->seconds += next->seconds;
+  st->amp_hours += next->amp_hours;
+  st->watt_hours += next->watt_hours;
+  st->last_energy = next->last_energy;
+  st->last_interval = next->last_interval;
+  st->last_current = next->last_current;
+  st->last_power = next->last_power;
+  st->records += next->records;
+}
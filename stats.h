@@ -0,0 +1,90 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Running statistics over a log, updated in constant time and space per
+ * entry so summaries come for free during capture rather than needing
+ * another pass over the output.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "powerlog6s.h"
+
+/* Quantiles come from a histogram of the values as logged, in buckets
+ * exact below STATS_LINEAR and then STATS_SUB_BUCKETS to each power of two,
+ * so within about 3% and with no arithmetic beyond finding the top bit. */
+#define STATS_QUANTILES 3
+#define STATS_LINEAR 64
+#define STATS_SUB_BUCKETS 32
+#define STATS_BUCKETS (STATS_LINEAR + (32 - 6) * STATS_SUB_BUCKETS)
+
+extern const double kStatsQuantiles[STATS_QUANTILES];
+
+/* Values are kept as logged, in units of scale, and only scaled when
+ * printed. */
+struct _stat_series {
+  double scale;
+  uint64_t count;
+  double mean;
+  double m2; /* sum of squared differences from the mean, for variance */
+  int64_t min;
+  int64_t max;
+  uint64_t negative[STATS_BUCKETS]; /* by magnitude */
+  uint64_t positive[STATS_BUCKETS];
+};
+
+enum stats_series_id {
+  STAT_CURRENT, /* amps */
+  STAT_VOLTAGE, /* volts */
+  STAT_POWER, /* watts, from current and voltage so up to 31 bits */
+  STAT_MIN_CELL, /* volts, lowest connected cell */
+  STAT_IMBALANCE, /* volts, highest less lowest connected cell */
+  STAT_RPM,
+  STAT_INTERNAL_TEMPERATURE, /* degrees celsius */
+  STAT_TEMPERATURE1, /* degrees celsius, and so on for the other probes */
+  STAT_TEMPERATURE3 = STAT_TEMPERATURE1 + 2,
+  STAT_COUNT
+};
+
+struct _stats {
+  uint64_t records;
+  struct _stat_series series[STAT_COUNT];
+  double seconds; /* logged time covered */
+  double amp_hours; /* integrated current */
+  double watt_hours; /* integrated power */
+  uint32_t first_energy; /* milliamp hours as logged */
+  uint32_t last_energy;
+  uint32_t first_interval; /* for integrating across stats_merge() */
+  uint32_t last_interval;
+  int16_t first_current;
+  int16_t last_current;
+  int32_t first_power;
+  int32_t last_power;
+};
+
+typedef struct _stat_series stat_series;
+typedef struct _stats stats;
+
+void stat_series_init(stat_series* s, double scale);
+void stat_series_add(stat_series* s, int64_t value);
+/* Adds the values of t to s, as if each had been added to s. */
+void stat_series_merge(stat_series* s, const stat_series* t);
+/* These are all scaled. */
+double stat_series_mean(const stat_series* s);
+double stat_series_stddev(const stat_series* s);
+double stat_series_quantile(const stat_series* s, double p);
+
+void stats_init(stats* st);
+void stats_add(stats* st, const powerlog6s* log);
+/* Adds the entries summarized in next, which came straight after those in
+ * st, to st. The result is what adding them one by one would have given, up
+ * to rounding, so a log can be summarized a piece at a time in parallel. */
+void stats_merge(stats* st, const stats* next);
+/* Prints a summary table to f, prefixed by name if it isn't NULL. */
+void stats_print(const stats* st, const char* name, FILE* f);
+
+#endif  /* STATS_H_ */
@@ -0,0 +1,19 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Clocks for measuring how long things take.
+ */
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+/* Seconds on a monotonic clock with an arbitrary epoch. */
+double timing_now();
+/* Seconds since the epoch on the realtime clock, which jumps whenever the
+ * time is set. */
+double timing_realtime();
+/* Seconds of CPU time, user plus system, used by the process so far. */
+double timing_cpu();
+void timing_sleep(double seconds);
+
+#endif  /* TIMING_H_ */
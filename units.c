@@ -0,0 +1,320 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Batch decoding into engineering units. Every kernel converts each field to
+ * float and then multiplies by the same float scale, two correctly rounded
+ * steps, so the vector kernels match the scalar one bit for bit.
+ *
+ * The vector kernels load 16 bit fields as the 32 bits ending with them and
+ * shift them down, which keeps every load inside its own entry (no field
+ * starts before offset 7), so even the last entry needs no special care.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNITS_X86 1
+#endif
+
+#include "rc.h"
+
+#include "units.h"
+
+DEFINE_string(units_kernel, "auto", "Kernel for decoding entries into "
+    "columns: scalar, sse2, avx2, or auto for the best the processor has");
+
+void fregister_units() {
+  REGISTER(units_kernel);
+}
+
+/* Entries decoded at a time, a multiple of every kernel's vector width. */
+#define UNITS_BLOCK 512
+
+#define FIELD_U16 0
+#define FIELD_S16 1
+#define FIELD_U32 2
+
+struct _units_field {
+  int offset; /* in the packed entry */
+  int kind;
+  float scale;
+};
+
+const struct _units_field kUnitsFields[UNIT_COUNT] = {
+  { offsetof(powerlog6s, current), FIELD_S16, 0.01f },
+  { offsetof(powerlog6s, voltage), FIELD_U16, 0.01f },
+  { offsetof(powerlog6s, energy), FIELD_U32, 0.001f },
+  { offsetof(powerlog6s, cell) + 0, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, cell) + 2, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, cell) + 4, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, cell) + 6, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, cell) + 8, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, cell) + 10, FIELD_S16, 0.001f },
+  { offsetof(powerlog6s, rpm), FIELD_U16, 1.0f },
+  { offsetof(powerlog6s, internal_temperature), FIELD_S16, 0.1f },
+  { offsetof(powerlog6s, temperature) + 0, FIELD_S16, 0.1f },
+  { offsetof(powerlog6s, temperature) + 2, FIELD_S16, 0.1f },
+  { offsetof(powerlog6s, temperature) + 4, FIELD_S16, 0.1f },
+  { offsetof(powerlog6s, period), FIELD_U16, 1.0f },
+  { offsetof(powerlog6s, pulse), FIELD_U16, 1.0f }
+};
+
+/* Decodes the float columns of as many of the n entries at logs as it can
+ * into the columns from entry at on, returning how many. */
+typedef size_t (*units_kernel)(const unsigned char* logs, size_t n,
+    units_columns* c, size_t at);
+
+struct _units_kernel_choice {
+  const char* name;
+  units_kernel kernel;
+};
+
+size_t decode_scalar(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at);
+#ifdef UNITS_X86
+__m128 sse2_to_float(__m128i raw, int kind);
+size_t decode_sse2(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at);
+__attribute__((target("avx2")))
+__m256 avx2_to_float(__m256i raw, int kind);
+__attribute__((target("avx2")))
+size_t decode_avx2(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at);
+#endif
+const struct _units_kernel_choice* choose_kernel();
+
+const struct _units_kernel_choice kScalarKernel = { "scalar", decode_scalar };
+#ifdef UNITS_X86
+const struct _units_kernel_choice kSse2Kernel = { "sse2", decode_sse2 };
+const struct _units_kernel_choice kAvx2Kernel = { "avx2", decode_avx2 };
+#endif
+const struct _units_kernel_choice* chosen_kernel = NULL;
+
+int units_columns_init(units_columns* c, size_t cap) {
+  size_t bytes;
+  int i;
+
+  memset(c, 0, sizeof(units_columns));
+  c->cap = cap;
+  /* Round up so every column can be read whole vectors at a time. */
+  bytes = (cap + UNITS_ALIGN) & ~(size_t) (UNITS_ALIGN - 1);
+  if (posix_memalign((void**) &c->interval, UNITS_ALIGN, bytes * 4) != 0
+      || posix_memalign((void**) &c->state, UNITS_ALIGN, bytes) != 0) {
+    perror("Failed to allocate columns");
+    return USER_SUCKS;
+  }
+  for (i = 0; i < UNIT_COUNT; i++) {
+    if (posix_memalign((void**) &c->values[i], UNITS_ALIGN,
+        bytes * sizeof(float)) != 0) {
+      perror("Failed to allocate columns");
+      return USER_SUCKS;
+    }
+  }
+  return SUCCESS;
+}
+
+void units_columns_free(units_columns* c) {
+  int i;
+
+  free(c->interval);
+  free(c->state);
+  for (i = 0; i < UNIT_COUNT; i++) {
+    free(c->values[i]);
+  }
+  memset(c, 0, sizeof(units_columns));
+}
+
+void units_decode(const powerlog6s* logs, size_t n, units_columns* c) {
+  const unsigned char* p = (const unsigned char*) logs;
+  units_kernel kernel;
+  size_t count;
+  size_t done;
+  size_t i;
+
+  if (n > c->cap) {
+    n = c->cap;
+  }
+  /* A block at a time, so the entries stay in cache while each field is
+   * picked out of them in turn. The vector kernels do as many whole vectors
+   * as they can, and the scalar one does the rest. */
+  kernel = choose_kernel()->kernel;
+  for (i = 0; i < n; i += count) {
+    count = n - i < UNITS_BLOCK ? n - i : UNITS_BLOCK;
+    done = kernel(p + i * sizeof(powerlog6s), count, c, i);
+    if (done < count) {
+      decode_scalar(p + (i + done) * sizeof(powerlog6s), count - done, c,
+          i + done);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    memcpy(&c->interval[i], p + offsetof(powerlog6s, interval), 4);
+    c->state[i] = p[offsetof(powerlog6s, state)];
+    p += sizeof(powerlog6s);
+  }
+  c->count = n;
+}
+
+const char* units_kernel_name() {
+  return choose_kernel()->name;
+}
+
+int units_use_kernel(const char* name) {
+  int automatic = strcmp(name, "auto") == 0;
+
+  chosen_kernel = &kScalarKernel;
+#ifdef UNITS_X86
+  __builtin_cpu_init();
+  if ((automatic || strcmp(name, "avx2") == 0)
+      && __builtin_cpu_supports("avx2")) {
+    chosen_kernel = &kAvx2Kernel;
+  } else if (automatic || strcmp(name, "sse2") == 0) {
+    chosen_kernel = &kSse2Kernel;
+  }
+#endif
+  if (automatic || strcmp(name, chosen_kernel->name) == 0) {
+    return SUCCESS;
+  }
+  return USER_SUCKS;
+}
+
+/* Picks the kernel --units_kernel asks for the first time one's needed. */
+const struct _units_kernel_choice* choose_kernel() {
+  if (!chosen_kernel && units_use_kernel(FLAGS_units_kernel) != SUCCESS) {
+    fprintf(stderr, "Units kernel '%s' isn't available here, using %s.\n",
+        FLAGS_units_kernel, chosen_kernel->name);
+  }
+  return chosen_kernel;
+}
+
+size_t decode_scalar(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at) {
+  const struct _units_field* field;
+  const unsigned char* p;
+  uint32_t u32;
+  uint16_t u16;
+  int16_t s16;
+  float value;
+  size_t i;
+  int j;
+
+  for (j = 0; j < UNIT_COUNT; j++) {
+    field = &kUnitsFields[j];
+    p = logs + field->offset;
+    for (i = 0; i < n; i++, p += sizeof(powerlog6s)) {
+      switch (field->kind) {
+        case FIELD_U16:
+          memcpy(&u16, p, 2);
+          value = (float) u16;
+          break;
+        case FIELD_S16:
+          memcpy(&s16, p, 2);
+          value = (float) s16;
+          break;
+        default:
+          memcpy(&u32, p, 4);
+          value = (float) u32;
+          break;
+      }
+      c->values[j][at + i] = value * field->scale;
+    }
+  }
+  return n;
+}
+
+#ifdef UNITS_X86
+/* Takes 32 bit lanes loaded as described at the top of the file to floats.
+ * Unsigned 32 bit values go in two halves, each exactly representable, so
+ * the only rounding is in adding them, as in the scalar conversion. */
+__m128 sse2_to_float(__m128i raw, int kind) {
+  __m128 high;
+
+  switch (kind) {
+    case FIELD_U16:
+      return _mm_cvtepi32_ps(_mm_srli_epi32(raw, 16));
+    case FIELD_S16:
+      return _mm_cvtepi32_ps(_mm_srai_epi32(raw, 16));
+    default:
+      high = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(raw, 16)),
+          _mm_set1_ps(65536.0f));
+      return _mm_add_ps(high, _mm_cvtepi32_ps(
+          _mm_and_si128(raw, _mm_set1_epi32(0xffff))));
+  }
+}
+
+/* Four entries at a time, assembling each vector from scalar loads. */
+size_t decode_sse2(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at) {
+  const struct _units_field* field;
+  const unsigned char* p;
+  int32_t lanes[4];
+  __m128 scale;
+  __m128 value;
+  size_t i;
+  int j;
+
+  for (j = 0; j < UNIT_COUNT; j++) {
+    field = &kUnitsFields[j];
+    scale = _mm_set1_ps(field->scale);
+    p = logs + field->offset - (field->kind == FIELD_U32 ? 0 : 2);
+    for (i = 0; i + 4 <= n; i += 4) {
+      memcpy(&lanes[0], p, 4);
+      memcpy(&lanes[1], p + sizeof(powerlog6s), 4);
+      memcpy(&lanes[2], p + 2 * sizeof(powerlog6s), 4);
+      memcpy(&lanes[3], p + 3 * sizeof(powerlog6s), 4);
+      value = sse2_to_float(_mm_setr_epi32(lanes[0], lanes[1], lanes[2],
+          lanes[3]), field->kind);
+      _mm_store_ps(c->values[j] + at + i, _mm_mul_ps(value, scale));
+      p += 4 * sizeof(powerlog6s);
+    }
+  }
+  return n & ~(size_t) 3;
+}
+
+__attribute__((target("avx2")))
+__m256 avx2_to_float(__m256i raw, int kind) {
+  __m256 high;
+
+  switch (kind) {
+    case FIELD_U16:
+      return _mm256_cvtepi32_ps(_mm256_srli_epi32(raw, 16));
+    case FIELD_S16:
+      return _mm256_cvtepi32_ps(_mm256_srai_epi32(raw, 16));
+    default:
+      high = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(raw, 16)),
+          _mm256_set1_ps(65536.0f));
+      return _mm256_add_ps(high, _mm256_cvtepi32_ps(
+          _mm256_and_si256(raw, _mm256_set1_epi32(0xffff))));
+  }
+}
+
+/* Eight entries at a time, gathering each field straight out of them. */
+__attribute__((target("avx2")))
+size_t decode_avx2(const unsigned char* logs, size_t n, units_columns* c,
+    size_t at) {
+  const struct _units_field* field;
+  const unsigned char* p;
+  __m256i strides;
+  __m256i raw;
+  __m256 scale;
+  size_t i;
+  int j;
+
+  strides = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+      _mm256_set1_epi32(sizeof(powerlog6s)));
+  for (j = 0; j < UNIT_COUNT; j++) {
+    field = &kUnitsFields[j];
+    scale = _mm256_set1_ps(field->scale);
+    p = logs + field->offset - (field->kind == FIELD_U32 ? 0 : 2);
+    for (i = 0; i + 8 <= n; i += 8) {
+      raw = _mm256_i32gather_epi32((const int*) p, strides, 1);
+      _mm256_store_ps(c->values[j] + at + i,
+          _mm256_mul_ps(avx2_to_float(raw, field->kind), scale));
+      p += 8 * sizeof(powerlog6s);
+    }
+  }
+  return n & ~(size_t) 7;
+}
+#endif
@@ -0,0 +1,64 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Batch decoding of packed log entries into aligned columns of engineering
+ * units, for analysis that wants one field of many entries at a time rather
+ * than whole entries. Uses SSE2 or AVX2 where the processor has them.
+ */
+
+#ifndef UNITS_H_
+#define UNITS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flags.h"
+#include "powerlog6s.h"
+
+/* Columns are aligned to this many bytes, enough for any vector kernel. */
+#define UNITS_ALIGN 32
+
+DECLARE_string(units_kernel);
+
+enum units_column {
+  UNIT_CURRENT, /* amps */
+  UNIT_VOLTAGE, /* volts */
+  UNIT_ENERGY, /* amp hours */
+  UNIT_CELL1, /* volts, and so on for the other five cells */
+  UNIT_CELL6 = UNIT_CELL1 + 5,
+  UNIT_RPM, /* revolutions per minute */
+  UNIT_INTERNAL_TEMPERATURE, /* degrees celsius */
+  UNIT_TEMPERATURE1, /* degrees celsius, and so on for the other two probes */
+  UNIT_TEMPERATURE3 = UNIT_TEMPERATURE1 + 2,
+  UNIT_PERIOD, /* as logged */
+  UNIT_PULSE, /* as logged */
+  UNIT_COUNT
+};
+
+struct _units_columns {
+  size_t count; /* entries decoded into the columns */
+  size_t cap;
+  uint32_t* interval; /* milliseconds, as logged */
+  uint8_t* state;
+  float* values[UNIT_COUNT];
+};
+
+typedef struct _units_columns units_columns;
+
+void fregister_units();
+
+/* Allocates columns for up to cap entries. Returns SUCCESS or an error code
+ * from rc.h. */
+int units_columns_init(units_columns* c, size_t cap);
+void units_columns_free(units_columns* c);
+
+/* Decodes n entries, at most c->cap, from logs into the columns, replacing
+ * what they held. Every kernel gives exactly the same values. */
+void units_decode(const powerlog6s* logs, size_t n, units_columns* c);
+/* Name of the kernel units_decode() uses, picked by --units_kernel. */
+const char* units_kernel_name();
+/* Switches units_decode() to the named kernel, as for --units_kernel.
+ * Returns USER_SUCKS, and picks the best there is, if it isn't available. */
+int units_use_kernel(const char* name);
+
+#endif  /* UNITS_H_ */
@@ -0,0 +1,161 @@
+/* Copyright (c) 2012, Jan Vaughan
+ * All rights reserved.
+ *
+ * Measures decoding log entries into columns of engineering units with each
+ * kernel the processor supports, checking they all agree with the scalar
+ * one, and formatting them as CSV with every column as logged and then in
+ * engineering units. Entries are synthesized like the simulator's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flags.h"
+#include "powerlog6s.h"
+#include "rc.h"
+#include "simdevice.h"
+#include "timing.h"
+#include "units.h"
+
+DEFINE_uint64(records, 1000000, "Log entries to decode");
+DEFINE_int64(passes, 5, "Times to decode with each kernel, taking the "
+    "fastest");
+
+void fregister_unitsbench() {
+  REGISTER(passes);
+  REGISTER(records);
+}
+
+const char* kKernels[] = { "scalar", "sse2", "avx2" };
+
+int same_columns(const units_columns* a, const units_columns* b);
+int bench_csv(const powerlog6s* logs, size_t n, const char* units);
+
+int main(int argc, char** argv) {
+  units_columns expected;
+  units_columns columns;
+  powerlog6s* logs;
+  sim_synth synth;
+  double best;
+  double start;
+  double elapsed;
+  size_t n;
+  size_t i;
+  int pass;
+  int rc;
+
+  fregister_unitsbench();
+  fregister_simdevice();
+  fregister_units();
+  fregister_powerlog6s();
+  fregister_flags();
+
+  parse_flags(&argc, &argv);
+  n = FLAGS_records;
+  logs = (powerlog6s*) malloc(n * sizeof(powerlog6s));
+  if (!logs || units_columns_init(&expected, n) != SUCCESS
+      || units_columns_init(&columns, n) != SUCCESS) {
+    perror("Failed to allocate log entries");
+    return USER_SUCKS;
+  }
+  sim_synth_init(&synth, POWERLOG6S_OFFLINE, 100);
+  for (i = 0; i < n; i++) {
+    sim_synth_record(&synth, &logs[i]);
+  }
+  units_use_kernel("scalar");
+  units_decode(logs, n, &expected);
+
+  rc = SUCCESS;
+  for (i = 0; i < sizeof(kKernels) / sizeof(kKernels[0]); i++) {
+    if (units_use_kernel(kKernels[i]) != SUCCESS) {
+      fprintf(stderr, "%-6s  not supported here\n", kKernels[i]);
+      continue;
+    }
+    best = 0;
+    for (pass = 0; pass < FLAGS_passes || pass == 0; pass++) {
+      start = timing_now();
+      units_decode(logs, n, &columns);
+      elapsed = timing_now() - start;
+      if (pass == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    if (!same_columns(&expected, &columns)) {
+      fprintf(stderr, "%-6s  doesn't match the scalar kernel\n",
+          kKernels[i]);
+      rc = BAD_MESSAGE_LENGTH;
+      continue;
+    }
+    fprintf(stderr, "%-6s  %7.1f MB/s  %6.1f M entries/s\n", kKernels[i],
+        n * sizeof(powerlog6s) / best / 1e6, n / best / 1e6);
+  }
+  if (bench_csv(logs, n, "") != SUCCESS
+      || bench_csv(logs, n, "all") != SUCCESS) {
+    rc = OUTPUT_ERROR;
+  }
+  units_columns_free(&expected);
+  units_columns_free(&columns);
+  free(logs);
+  return rc;
+}
+
+int same_columns(const units_columns* a, const units_columns* b) {
+  int j;
+
+  if (a->count != b->count
+      || memcmp(a->interval, b->interval, a->count * 4) != 0
+      || memcmp(a->state, b->state, a->count) != 0) {
+    return 0;
+  }
+  for (j = 0; j < UNIT_COUNT; j++) {
+    if (memcmp(a->values[j], b->values[j], a->count * sizeof(float)) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Formats every entry as CSV with the columns in units in engineering units,
+ * into a buffer reused for each chunk as output would be. */
+int bench_csv(const powerlog6s* logs, size_t n, const char* units) {
+  char* lines;
+  char* line;
+  double best;
+  double start;
+  double elapsed;
+  size_t bytes;
+  size_t i;
+  int pass;
+
+  lines = (char*) malloc(1024 * POWERLOG6S_CSV_MAX);
+  if (!lines) {
+    perror("Failed to allocate lines");
+    return OUTPUT_ERROR;
+  }
+  powerlog6s_use_units(units);
+  best = 0;
+  bytes = 0;
+  for (pass = 0; pass < FLAGS_passes || pass == 0; pass++) {
+    start = timing_now();
+    bytes = 0;
+    line = lines;
+    for (i = 0; i < n; i++) {
+      if (i % 1024 == 0) {
+        bytes += line - lines;
+        line = lines;
+      }
+      line += powerlog6s_csv_format(&logs[i], line);
+    }
+    bytes += line - lines;
+    elapsed = timing_now() - start;
+    if (pass == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  fprintf(stderr, "csv %-4s  %7.1f MB/s  %6.1f M entries/s\n",
+      *units ? units : "raw", bytes / best / 1e6, n / best / 1e6);
+  powerlog6s_use_units("");
+  free(lines);
+  return SUCCESS;
+}